@@ -25,6 +25,7 @@
 #include <libavutil/pixdesc.h>
 #include <libavutil/time.h>
 
+#include "input.h"
 #include "log.h"
 #include "m420.h"
 
@@ -37,6 +38,12 @@ static void help(const char *program_name) {
 	printf("Synopsys: %s -o output-file input-file\n", program_name);
 	puts("\nThis tool converts input video to M420 pixel format and outputs");
 	puts("it to YUV4MPEG container.");
+	puts("\nOptions:");
+	puts("    -h        Print help message");
+	puts("    -I arg    Input file I/O: default, readahead, direct or mmap");
+	puts("              [readahead]");
+	puts("    -o arg    Output file name [mandatory]");
+	puts("    -v        Be more verbose. Can be specified multiple times");
 }
 
 int main(int argc, char *argv[]) {
@@ -54,12 +61,14 @@ int main(int argc, char *argv[]) {
 	int rc, opt;
 
 	char const *output = NULL;
+	enum input_mode input_mode = INPUT_READAHEAD;
 
 	av_register_all();
 
-	while ((opt = getopt(argc, argv, "ho:v")) != -1) {
+	while ((opt = getopt(argc, argv, "hI:o:v")) != -1) {
 		switch (opt) {
 			case 'h': help(argv[0]); return EXIT_SUCCESS;
+			case 'I': input_mode = input_mode_parse(optarg); break;
 			case 'o': output = optarg; break;
 			case 'v':
 				vlevel++;
@@ -75,7 +84,7 @@ int main(int argc, char *argv[]) {
 	char const *input = argv[optind];
 
 	// Open video file
-	if (avformat_open_input(&ifc, input, NULL, &options) < 0)
+	if (input_open(&ifc, input, NULL, &options, input_mode, 0) < 0)
 		error(EXIT_FAILURE, 0, "Can't open file: %s!", argv[optind]);
 
 	// Retrieve stream information
@@ -236,7 +245,7 @@ int main(int argc, char *argv[]) {
 	avformat_free_context(ofc);
 	sws_freeContext(osc);
 
-	avformat_close_input(&ifc);
+	input_close(&ifc);
 
 	return EXIT_SUCCESS;
 }
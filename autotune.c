@@ -0,0 +1,153 @@
+/*
+ * Autotuning of number of frames in flight implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "autotune.h"
+#include "log.h"
+#include "stats.h"
+
+/* Frames measured at every depth */
+#define AUTOTUNE_WINDOW 30
+
+/* Sweep stops after this number of steps without throughput growth */
+#define AUTOTUNE_PATIENCE 2
+#define AUTOTUNE_GROWTH 1.02
+
+#define AUTOTUNE_MAX_DEPTH 64
+
+static struct step {
+	double fps;
+	double mean, p50, p99; //!< Latency in ms
+} steps[AUTOTUNE_MAX_DEPTH + 1];
+
+static bool tuning;
+static unsigned max, cur;
+static unsigned peak; //!< Depth with the highest throughput
+static unsigned grown; //!< Depth that raised peak notably last time
+static double target;
+
+/* Frames of previous depth are in flight until this number is encoded */
+static uint64_t settled;
+static bool measuring;
+static struct stats_counters from;
+static struct timespec start;
+
+static double elapsed(struct timespec const start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+unsigned autotune_init(unsigned const nbufs, double const fraction)
+{
+	struct stats_counters c;
+
+	stats_read(&c);
+
+	memset(steps, 0, sizeof(steps));
+	max = nbufs < AUTOTUNE_MAX_DEPTH ? nbufs : AUTOTUNE_MAX_DEPTH;
+	target = fraction;
+	cur = 1;
+	peak = 1;
+	grown = 1;
+	settled = c.queued;
+	measuring = false;
+	tuning = true;
+
+	pr_verb("Autotune: Calibrating depth from 1 to %u, %u frames each", max,
+			AUTOTUNE_WINDOW);
+
+	return cur;
+}
+
+/* Depths from 1 to last are measured */
+static void choose(unsigned const last)
+{
+	unsigned d;
+
+	for (d = 1; d < last && steps[d].fps < steps[peak].fps * target; d++);
+
+	pr_info("Autotune: Depth %u gives %.1f FPS (%.0f%% of peak %.1f FPS at "
+			"depth %u), latency mean %.1f ms p99 %.1f ms", d,
+			steps[d].fps, steps[d].fps / steps[peak].fps * 100,
+			steps[peak].fps, peak, steps[d].mean, steps[d].p99);
+
+	cur = d;
+	tuning = false;
+}
+
+unsigned autotune_depth(unsigned const depth)
+{
+	struct stats_counters c;
+
+	if (!tuning)
+		return depth;
+
+	stats_read(&c);
+
+	if (!measuring) {
+		if (c.encoded >= settled) {
+			from = c;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			measuring = true;
+		}
+		return cur;
+	}
+
+	uint64_t const frames = c.encoded - from.encoded;
+	if (frames < AUTOTUNE_WINDOW)
+		return cur;
+
+	struct step *const s = &steps[cur];
+
+	s->fps = frames / elapsed(start);
+	s->mean = (c.latency_sum - from.latency_sum) / 1000.0 / frames;
+	s->p50 = stats_percentile(&from, &c, 0.5);
+	s->p99 = stats_percentile(&from, &c, 0.99);
+
+	pr_verb("Autotune: Depth %u: %.1f FPS, latency mean %.1f ms p50 %.1f ms "
+			"p99 %.1f ms", cur, s->fps, s->mean, s->p50, s->p99);
+
+	if (s->fps > steps[grown].fps * AUTOTUNE_GROWTH)
+		grown = cur;
+	if (s->fps > steps[peak].fps)
+		peak = cur;
+
+	if (cur == max || cur - grown >= AUTOTUNE_PATIENCE) {
+		choose(cur);
+		return cur;
+	}
+
+	cur++;
+	settled = c.queued;
+	measuring = false;
+
+	return cur;
+}
+
+void autotune_finish(void)
+{
+	if (!tuning)
+		return;
+
+	/* Partial result is still better than nothing */
+	if (cur > 1 || measuring)
+		pr_warn("Autotune: Input ended during calibration at depth %u", cur);
+
+	if (cur > 1)
+		choose(cur - 1);
+
+	tuning = false;
+}
@@ -0,0 +1,27 @@
+/*
+ * Autotuning of number of frames in flight definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+/*
+ * Calibration starts with one frame in flight and increases depth after
+ * every measured window of frames up to nbufs, or until throughput stops
+ * growing. Throughput and latency are taken from statistics counters, so
+ * statistics must be initialized. Then the smallest depth that gives
+ * the fraction of the peak throughput is used for the rest of the run.
+ *
+ * autotune_init() returns depth to start with. autotune_depth() is called
+ * when all frames of the current depth are queued and returns depth for
+ * the next ones, it returns the given depth if calibration is not running.
+ */
+unsigned autotune_init(unsigned const nbufs, double const fraction);
+unsigned autotune_depth(unsigned const depth);
+void autotune_finish(void);
+
+#endif /* AUTOTUNE_H */
@@ -0,0 +1,210 @@
+#!/bin/sh
+#
+# Benchmark regression runner
+#
+# Runs scenarios from scenarios.txt, compares results with baselines and
+# exits with non-zero status if any result is worse than its baseline by
+# more than tolerance or has no baseline.
+#
+# Copyright 2019 RnD Center "ELVEES", JSC
+#
+# SPDX-License-Identifier: GPL-2.0
+
+set -e
+
+srcdir=$(cd "$(dirname "$0")" && pwd)
+
+builddir=.
+device=${BENCH_DEVICE:-}
+inputs=${BENCH_INPUTS:-}
+frames=${BENCH_FRAMES:-120}
+tolerance=${BENCH_TOLERANCE:-5}
+scenarios=$srcdir/scenarios.txt
+baseline=$srcdir/baseline.txt
+filter=
+update=false
+
+usage() {
+	echo "Synopsis: $0 [options] [scenario-pattern]"
+	echo
+	echo "Options:"
+	echo "    -B arg    Build directory with tools [.]"
+	echo "    -b arg    Baseline file [$baseline]"
+	echo "    -d arg    M2M device, scenarios which require it are skipped"
+	echo "              if it is not specified, replay:FILE replays session"
+	echo "              recorded by m2m-test -R FILE [\$BENCH_DEVICE]"
+	echo "    -h        Print help message"
+	echo "    -i arg    Directory with input files WIDTHxHEIGHT.mkv, missing"
+	echo "              files are generated by ffmpeg [\$BENCH_INPUTS]"
+	echo "    -n arg    Number of frames to process [$frames]"
+	echo "    -s arg    Scenario file [$scenarios]"
+	echo "    -t arg    Default tolerance in percent [$tolerance]"
+	echo "    -u        Update baseline file with results, scenarios without"
+	echo "              baseline do not fail"
+}
+
+while getopts "B:b:d:hi:n:s:t:u" opt; do
+	case $opt in
+		B) builddir=$OPTARG ;;
+		b) baseline=$OPTARG ;;
+		d) device=$OPTARG ;;
+		h) usage; exit 0 ;;
+		i) inputs=$OPTARG ;;
+		n) frames=$OPTARG ;;
+		s) scenarios=$OPTARG ;;
+		t) tolerance=$OPTARG ;;
+		u) update=true ;;
+		*) usage >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+filter=${1:-}
+
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+
+if [ -z "$inputs" ]; then
+	inputs=$tmpdir
+fi
+
+now() {
+	date +%s.%N
+}
+
+# Prints input file name for resolution, generates the file if needed
+input_file() {
+	file=$inputs/$1.mkv
+
+	if [ ! -f "$file" ]; then
+		command -v ffmpeg >/dev/null || return 1
+		ffmpeg -nostdin -v error -f lavfi -i "testsrc2=size=$1:rate=30" \
+			-frames:v "$frames" -c:v mpeg4 -q:v 2 "$file" || return 1
+	fi
+
+	echo "$file"
+}
+
+# Prints measured value of scenario. Returns 3 if scenario is skipped.
+run_scenario() {
+	kind=$1
+	res=$2
+	shift 2
+
+	case $kind in
+	m2m)
+		[ -n "$device" ] || return 3
+		input=$(input_file "$res") || return 3
+		"$builddir/m2m-test" -v -d "$device" -n "$frames" "$@" "$input" \
+			> "$tmpdir/log" || return 1
+		sed -n 's/^Total time in main loop: .* s (\(.*\) FPS)$/\1/p' "$tmpdir/log"
+		;;
+	jobs)
+		[ -n "$device" ] || return 3
+		input=$(input_file "$res") || return 3
+		njobs=$1
+		shift
+		: > "$tmpdir/manifest"
+		for i in $(seq "$njobs"); do
+			echo "$input $tmpdir/job$i.h264" >> "$tmpdir/manifest"
+		done
+		"$builddir/m2m-test" -v -d "$device" -n "$frames" \
+			--jobs="$tmpdir/manifest" "$@" > "$tmpdir/log" || return 1
+		rm -f "$tmpdir"/job*.h264
+		grep -q "^Jobs: $njobs done, 0 failed" "$tmpdir/log" || return 1
+		sed -n 's/^Device .* frames (\(.*\) FPS).*$/\1/p' "$tmpdir/log" | head -n 1
+		;;
+	any2m420)
+		[ -x "$builddir/any2m420" ] || return 3
+		input=$(input_file "$res") || return 3
+		start=$(now)
+		"$builddir/any2m420" -o "$tmpdir/out.y4m" "$@" "$input" \
+			> "$tmpdir/log" || return 1
+		stop=$(now)
+		rm -f "$tmpdir/out.y4m"
+		echo "$frames $start $stop" | awk '{ printf "%.1f\n", $1 / ($3 - $2) }'
+		;;
+	m420)
+		[ -x "$builddir/m420-bench" ] || return 3
+		"$builddir/m420-bench" -s "$res" "$@" > "$tmpdir/log" || return 1
+		sed -n 's/^.* \(.*\) GB\/s .*$/\1/p' "$tmpdir/log" | head -n 1
+		;;
+	devbuf)
+		[ -n "$device" ] || return 3
+		"$builddir/devbufbench" "$@" "$device" > "$tmpdir/log" || return 1
+		sed -n 's/^.* dev: .* ms, \(.*\) MiB\/s$/\1/p' "$tmpdir/log" | head -n 1
+		;;
+	*)
+		echo "Unknown scenario kind: $kind" >&2
+		return 1
+		;;
+	esac
+}
+
+results=$tmpdir/results
+
+printf "%-24s %10s %10s %8s  %s\n" "Scenario" "Value" "Baseline" "Delta" "Status"
+
+grep -v '^[[:space:]]*\(#\|$\)' "$scenarios" | while read -r name kind res args; do
+	case $name in
+		*$filter*) ;;
+		*) continue ;;
+	esac
+
+	# Word splitting of args is intended
+	status=0
+	value=$(run_scenario "$kind" "$res" $args) || status=$?
+
+	if [ $status -eq 3 ]; then
+		printf "%-24s %10s %10s %8s  %s\n" "$name" - - - skipped
+		continue
+	elif [ $status -ne 0 ] || [ -z "$value" ]; then
+		printf "%-24s %10s %10s %8s  %s\n" "$name" - - - FAILED
+		echo failure >> "$tmpdir/regressions"
+		continue
+	fi
+
+	echo "$name $value" >> "$results"
+
+	# Scenario without baseline can not detect regression
+	line=$(grep "^$name[[:space:]]" "$baseline" 2>/dev/null || true)
+	if [ -z "$line" ] && $update; then
+		printf "%-24s %10s %10s %8s  %s\n" "$name" "$value" - - new
+		continue
+	elif [ -z "$line" ]; then
+		printf "%-24s %10s %10s %8s  %s\n" "$name" "$value" - - "NO BASELINE"
+		echo "no baseline" >> "$tmpdir/regressions"
+		continue
+	fi
+
+	# All values are better when they are higher
+	echo "$line $value $tolerance" | awk '{
+		base = $2; tol = NF == 5 ? $3 : $NF; value = $(NF - 1)
+		if (base <= 0) {
+			printf "%-24s %10s %10s %8s  %s\n", $1, value, base, "-",
+				"invalid baseline"
+			exit 0
+		}
+		delta = (value - base) / base * 100
+		printf "%-24s %10s %10s %+7.1f%%  %s\n", $1, value, base, delta,
+			delta < -tol ? "REGRESSION" : "ok"
+		exit delta < -tol
+	}' || echo regression >> "$tmpdir/regressions"
+done
+
+if $update && [ -f "$results" ]; then
+	awk -v tol="$tolerance" '
+		FNR == NR { value[$1] = $2; next }
+		/^[[:space:]]*(#|$)/ { print; next }
+		$1 in value { print $1, value[$1], (NF > 2 ? $3 : tol); delete value[$1]; next }
+		{ print }
+		END { for (name in value) print name, value[name], tol }
+	' "$results" "$baseline" > "$tmpdir/baseline"
+	cp "$tmpdir/baseline" "$baseline"
+	echo "Baseline $baseline is updated"
+fi
+
+if [ -f "$tmpdir/regressions" ]; then
+	echo "$(wc -l < "$tmpdir/regressions") regression(s), failure(s) or missing" \
+		"baseline(s) found"
+	exit 1
+fi
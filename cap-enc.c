@@ -12,11 +12,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <error.h>
 #include <limits.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -26,7 +31,14 @@
 #include <linux/videodev2.h>
 
 #include "log.h"
+#include "shmring.h"
+#include "metrics.h"
+#include "output.h"
+#include "ratectl.h"
+#include "realtime.h"
+#include "stats.h"
 #include "v4l2-utils.h"
+#include "v4l2-trace.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #define ROUND_UP(x, a) (((x)+(a)-1)&~((a)-1))
@@ -56,11 +68,50 @@ static struct class_ctrls avico_ctrls[] = {
 	}
 };
 
+static volatile sig_atomic_t stop_signal; //!< Signal that requested to stop
+
+static void stop_handler(int const signo)
+{
+	stop_signal = signo;
+}
+
 static inline bool checklimit(unsigned const value, unsigned const limit)
 {
 	return limit == 0 || value < limit;
 }
 
+/*
+ * In low latency mode latency is counted from capture timestamp, that
+ * gives glass-to-bitstream latency if camera timestamps are monotonic.
+ */
+static void queue_frame(int const m2mfd, struct v4l2_buffer *const buf,
+		int const dmabuf, bool const low_latency)
+{
+	static bool warned;
+	bool const monotonic = (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+			V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	uint64_t const captured = buf->timestamp.tv_sec * 1000000ULL +
+			buf->timestamp.tv_usec;
+
+	if (low_latency && !monotonic && !warned) {
+		pr_warn("Camera timestamps are not monotonic, latency is counted from dequeuing");
+		warned = true;
+	}
+
+	buf->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	buf->memory = V4L2_MEMORY_DMABUF;
+	buf->m.fd = dmabuf;
+	buf->flags = 0;
+
+	v4l2_qbuf(m2mfd, buf);
+	ratectl_queued();
+
+	if (low_latency && monotonic)
+		stats_queued_at(captured);
+	else
+		stats_queued();
+}
+
 #ifndef VERSION
 #define VERSION "unversioned"
 #endif
@@ -70,13 +121,37 @@ static void help(const char *program_name)
 	puts("cap-enc " VERSION " \n");
 	printf("Synopsys: %s [options] input-device encode-device\n\n", program_name);
 	puts("Options:");
-	puts("    -f arg    Output file descriptor number");
+	puts("    --bitrate=kbps");
+	puts("              Control QP of I and P frames to encode with kbps kbit/s");
+	puts("              on average, controls set with -c give the initial QP");
+	puts("    --busy-poll");
+	puts("              Spin instead of sleeping while waiting for devices");
+	puts("    -f arg    Output file descriptor number, can be given several times");
+	puts("    --low-latency");
+	puts("              Keep single frame in encoder, newer captured frame");
+	puts("              replaces the waiting one, run with realtime priority");
+	puts("              and report glass-to-bitstream latency with -v");
+	puts("    --metrics=addr");
+	puts("              Serve statistics counters for Prometheus on UNIX socket");
+	puts("              (unix:path) or TCP socket ([host:]port, 127.0.0.1 by");
+	puts("              default)");
 	puts("    -n arg    Specify how many frames should be processed");
-	puts("    -o arg    Output file name");
+	puts("    -o arg    Output file name or socket (unix:PATH, tcp:HOST:PORT),");
+	puts("              can be given several times. Slow pipes and sockets do");
+	puts("              not stall encoding, frames are dropped for them instead");
 	puts("    -r arg    Specify desired framerate");
+	puts("    -R arg    Record V4L2 session timing to file");
 	puts("    -s arg    Set video size [defaults to 1280x720]");
+	puts("    --shm=name");
+	puts("              Publish encoded frames to shared memory ring for local");
+	puts("              readers, see ring-cat");
+	puts("    --stats-interval=sec");
+	puts("              Print FPS, bitrate, encoder queue occupancy, latency");
+	puts("              percentiles and CPU load every sec seconds");
 	puts("    -c <ctrl>=<val>    Set the value of the controls [VIDIOC_S_EXT_CTRLS]");
 	puts("    -v        Be more verbose. Can be specified multiple times");
+	puts("    --vbv=ms  Size of rate control buffer, bitrate may exceed the");
+	puts("              target for that time [1000]");
 }
 
 int main(int argc, char *argv[])
@@ -90,18 +165,37 @@ int main(int argc, char *argv[])
 	uint32_t width = 1280, height = 720;
 
 	unsigned framerate = 0;
-	char const *output = NULL;
-	int outfd = -1;
-
-	const char *optstring = "f:hn:o:r:s:c:v";
+	char const *trace_file = NULL;
+	double stats_interval = 0;
+	char const *metrics = NULL, *shm = NULL;
+	struct shmring *ring = NULL;
+	bool low_latency = false;
+	double bitrate = 0, vbv = 1000;
+
+	const char *optstring = "f:hn:o:r:R:s:c:v";
+	enum {
+		OPT_STATS_INTERVAL = 256, OPT_METRICS, OPT_SHM, OPT_LOW_LATENCY,
+		OPT_BUSY_POLL, OPT_BITRATE, OPT_VBV
+	};
+	const struct option longopts[] = {
+		{ "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+		{ "metrics", required_argument, NULL, OPT_METRICS },
+		{ "shm", required_argument, NULL, OPT_SHM },
+		{ "low-latency", no_argument, NULL, OPT_LOW_LATENCY },
+		{ "busy-poll", no_argument, NULL, OPT_BUSY_POLL },
+		{ "bitrate", required_argument, NULL, OPT_BITRATE },
+		{ "vbv", required_argument, NULL, OPT_VBV },
+		{ NULL }
+	};
 
-	while ((opt = getopt(argc, argv, optstring)) != -1) {
+	while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
 		switch (opt) {
-			case 'f': outfd = atoi(optarg); break;
+			case 'f': output_add_fd(atoi(optarg)); break;
 			case 'h': help(argv[0]); return EXIT_SUCCESS;
 			case 'n': frames = atoi(optarg); break;
-			case 'o': output = optarg; break;
+			case 'o': output_add(optarg); break;
 			case 'r': framerate = atoi(optarg); break;
+			case 'R': trace_file = optarg; break;
 			case 's': {
 				char *endptr;
 
@@ -117,16 +211,28 @@ int main(int argc, char *argv[])
 			}
 			case 'c': /* skip now, parse later */; break;
 			case 'v': vlevel++; break;
+			case OPT_STATS_INTERVAL: stats_interval = stats_parse_interval(optarg); break;
+			case OPT_METRICS: metrics = optarg; break;
+			case OPT_SHM: shm = optarg; break;
+			case OPT_LOW_LATENCY: low_latency = true; break;
+			case OPT_BUSY_POLL: v4l2_set_busy_poll(true); break;
+			case OPT_BITRATE: bitrate = atof(optarg); break;
+			case OPT_VBV: vbv = atof(optarg); break;
 			default: error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
 		}
 	}
 
 	if (argc < optind + 2)
 		error(EXIT_FAILURE, 0, "Not enough arguments");
+	if (bitrate < 0 || vbv <= 0)
+		error(EXIT_FAILURE, 0, "Bitrate and VBV size must be positive");
 
 	char const *inputdevice = argv[optind];
 	char const *m2mdevice = argv[optind + 1];
 
+	if (trace_file)
+		v4l2_trace_open(trace_file);
+
 	char card[32];
 	int inputfd = v4l2_open(inputdevice, V4L2_CAP_VIDEO_CAPTURE |
 			V4L2_CAP_STREAMING, V4L2_CAP_VIDEO_M2M, card);
@@ -138,7 +244,7 @@ int main(int argc, char *argv[])
 
 	find_controls(m2mfd, avico_ctrls, ARRAY_SIZE(avico_ctrls));
 	optind = 0;
-	while ((opt = getopt(argc, argv, optstring)) != -1) {
+	while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
 		switch (opt) {
 			case 'c':
 				parse_ctrl_opts(optarg, avico_ctrls, ARRAY_SIZE(avico_ctrls));
@@ -190,6 +296,13 @@ int main(int argc, char *argv[])
 			v4l2_framerate_get(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT),
 			v4l2_framerate_get(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE));
 
+	if (bitrate) {
+		float const fps = v4l2_framerate_get(inputfd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+		/* Camera may not report its frame rate */
+		ratectl_init(m2mfd, bitrate, fps > 0 ? fps : 25, vbv);
+	}
+
 	v4l2_buffers_request(inputfd, V4L2_BUF_TYPE_VIDEO_CAPTURE, NUM_BUFS, V4L2_MEMORY_MMAP);
 	v4l2_buffers_request(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT, NUM_BUFS, V4L2_MEMORY_DMABUF);
 	v4l2_buffers_request(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE, NUM_BUFS, V4L2_MEMORY_MMAP);
@@ -211,29 +324,91 @@ int main(int argc, char *argv[])
 		v4l2_qbuf(m2mfd, &buf);
 	}
 
+	v4l2_subscribe_event(inputfd, V4L2_EVENT_SOURCE_CHANGE);
+
 	v4l2_streamon(inputfd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
 	v4l2_streamon(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
 	v4l2_streamon(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
 
-	if (output) {
-		outfd = creat(output, S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
-		if (outfd < 0)
-			error(EXIT_FAILURE, errno, "Can not open output file");
+	if (shm) {
+		ring = shmring_create(shm, SHMRING_DEFAULT_SIZE);
+		if (!ring)
+			error(EXIT_FAILURE, errno, "Can not create shared memory ring %s", shm);
 	}
 
+	/* The second signal terminates immediately */
+	struct sigaction sa = {
+		.sa_handler = stop_handler,
+		.sa_flags = SA_RESETHAND
+	};
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
 	pr_verb("Begin processing...");
 
 	struct pollfd fds[2] = {
-		{ inputfd, POLLIN },
+		{ inputfd, POLLIN | POLLPRI },
 		{ m2mfd, POLLOUT | POLLIN }
 	};
 
+	struct timespec start, stop;
+	uint64_t outsize = 0;
+	bool stopping = false, stopped = false, last = false, changed = false;
+	uint32_t sequence = 0;
+
+	/* Camera frame captured while encoder is busy in low latency mode */
+	struct v4l2_buffer pending;
+	bool waiting = false;
+
+	/* Latency report uses statistics counters */
+	if (stats_interval || metrics || low_latency)
+		stats_init(stats_interval, NUM_BUFS);
+	if (metrics)
+		metrics_init(metrics);
+	if (low_latency)
+		realtime_init();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	while (checklimit(encframe, frames)) {
-		int rc = poll(fds, 2, 1000);
+		if ((stop_signal || changed) && !stopping) {
+			if (stop_signal)
+				pr_info("Stopping on signal %d after %u frames",
+						stop_signal, capframe);
+
+			/* Stop feeding and drain frames queued to encoder */
+			stopping = true;
+			fds[0].fd = -1;
+			stopped = v4l2_encoder_stop(m2mfd);
+		}
+
+		if (stopping && (stopped ? last : encframe == capframe))
+			break;
+
+		int rc = v4l2_poll(fds, 2, 1000);
+		if (rc < 0 && errno == EINTR) continue;
 		if (rc < 0) break;
 		if (rc == 0)
 			error(EXIT_FAILURE, 0, "Timeout waiting for data...");
 
+		/*
+		 * Camera buffers are shared with encoder, so new resolution
+		 * requires to set up both devices again
+		 */
+		if (fds[0].revents & POLLPRI) {
+			struct v4l2_event event;
+
+			while (v4l2_dqevent(inputfd, &event))
+				if (event.type == V4L2_EVENT_SOURCE_CHANGE &&
+				    event.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION)
+					changed = true;
+
+			if (changed)
+				pr_warn("Capture resolution is changed after %u frames, stopping",
+						capframe);
+		}
+
 		if (fds[0].revents & POLLIN) {
 			struct v4l2_buffer buf = {
 				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
@@ -245,16 +420,30 @@ int main(int argc, char *argv[])
 			pr_debug("Got buffer %u from %d capture", buf.index, inputfd);
 			pr_verb("Frame %u captured: %u bytes", capframe, buf.bytesused);
 
-			buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-			buf.memory = V4L2_MEMORY_DMABUF;
-			buf.m.fd = inbufs[buf.index];
-			buf.flags = 0;
-
-			v4l2_qbuf(m2mfd, &buf);
-
-			capframe += 1;
+			/* Camera skips sequence numbers of frames it drops */
+			if (capframe && buf.sequence > sequence + 1) {
+				pr_verb("Camera dropped %u frames", buf.sequence - sequence - 1);
+				stats_dropped(buf.sequence - sequence - 1);
+			}
+			sequence = buf.sequence;
+
+			/* Stale frame would only add latency to the fresh one */
+			if (low_latency && capframe > encframe) {
+				if (waiting) {
+					pr_verb("Frame is replaced by newer one");
+					stats_dropped(1);
+					pending.flags = 0;
+					v4l2_qbuf(inputfd, &pending);
+				}
+
+				pending = buf;
+				waiting = true;
+			} else {
+				queue_frame(m2mfd, &buf, inbufs[buf.index], low_latency);
+				capframe += 1;
+			}
 
-			if (!checklimit(capframe, frames))
+			if (!checklimit(capframe + waiting, frames))
 				fds[0].fd = -1;
 		}
 
@@ -285,18 +474,63 @@ int main(int argc, char *argv[])
 			v4l2_dqbuf(m2mfd, &buf);
 
 			pr_debug("Got buffer %u from %d capture", buf.index, m2mfd);
-			pr_info("Frame %u encoded: %u bytes", encframe, buf.bytesused);
 
-			write(outfd, encbufs[buf.index], buf.bytesused);
+			last = buf.flags & V4L2_BUF_FLAG_LAST;
+
+			/* Encoder may return empty last buffer after stop command */
+			if (buf.bytesused || !last) {
+				pr_info("Frame %u encoded: %u bytes", encframe,
+						buf.bytesused);
+
+				output_write(encbufs[buf.index], buf.bytesused,
+						buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+
+				if (ring && shmring_publish(ring, encbufs[buf.index],
+							buf.bytesused, buf.flags))
+					pr_warn("Can not publish frame to ring: %s",
+							strerror(errno));
+
+				stats_encoded(buf.bytesused);
+				ratectl_encoded(buf.bytesused,
+						buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+				outsize += buf.bytesused;
+				encframe += 1;
+			}
 
 			buf.flags = 0;
 			buf.bytesused = 0;
 
 			v4l2_qbuf(m2mfd, &buf);
 
-			encframe += 1;
+			if (waiting && !stopping) {
+				queue_frame(m2mfd, &pending, inbufs[pending.index],
+						low_latency);
+				capframe += 1;
+				waiting = false;
+			}
 		}
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	ratectl_finish();
+
+	if (low_latency)
+		stats_latency_summary("Glass-to-bitstream");
+
+	stats_finish();
+	metrics_finish();
+
+	double const time = stop.tv_sec - start.tv_sec +
+		(stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	pr_info("Encoded %u of %u captured frames, %" PRIu64 " KiB in %.1f s (%.1f FPS)",
+			encframe, capframe, outsize / 1024, time, encframe / time);
+
+	if (ring)
+		shmring_destroy(ring);
+
+	output_close();
+
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,226 @@
+/*
+ * Checksum functions implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "checksum.h"
+#include "log.h"
+
+#define CRC32C_POLY 0x82f63b78 /* Reflected Castagnoli polynomial */
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, uint8_t const *p, size_t size)
+{
+	if (!crc32c_table[1])
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+
+			crc32c_table[i] = c;
+		}
+
+	while (size--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, uint8_t const *p, size_t size)
+{
+	for (; size && ((uintptr_t)p & 7); size--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	uint64_t c = crc;
+	for (; size >= 8; size -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+
+	for (; size; size--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static bool crc32c_hw_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, uint8_t const *p, size_t size)
+{
+	for (; size && ((uintptr_t)p & 7); size--)
+		crc = __crc32cb(crc, *p++);
+
+	for (; size >= 8; size -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+
+	for (; size; size--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static bool crc32c_hw_supported(void)
+{
+	return true;
+}
+#else
+#define crc32c_hw crc32c_sw
+
+static bool crc32c_hw_supported(void)
+{
+	return false;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, void const *data, size_t size)
+{
+	static uint32_t (*impl)(uint32_t crc, uint8_t const *p, size_t size);
+
+	if (!impl) {
+		impl = crc32c_hw_supported() ? crc32c_hw : crc32c_sw;
+		pr_debug("CRC32C: Using %s implementation",
+				impl == crc32c_sw ? "software" : "hardware");
+	}
+
+	return ~impl(~crc, data, size);
+}
+
+void checksum_log_update(struct checksum_log *const log, void const *data,
+		size_t const size)
+{
+	log->frame = crc32c(log->frame, data, size);
+	log->running = crc32c(log->running, data, size);
+}
+
+void checksum_log_commit(struct checksum_log *const log)
+{
+	if (log->count == log->size) {
+		log->size = log->size ? log->size * 2 : 1024;
+		log->crcs = realloc(log->crcs, log->size * sizeof(*log->crcs));
+		if (!log->crcs) error(EXIT_FAILURE, 0, "Not enough memory");
+	}
+
+	pr_debug("Checksum: %s frame %u: %08x", log->name, log->count, log->frame);
+
+	log->crcs[log->count++] = log->frame;
+	log->frame = 0;
+}
+
+void checksum_log_add(struct checksum_log *const log, void const *data,
+		size_t const size)
+{
+	checksum_log_update(log, data, size);
+	checksum_log_commit(log);
+}
+
+static void checksum_log_save(char const *const path,
+		struct checksum_log const logs[], unsigned const num)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) error(EXIT_FAILURE, errno, "Can not create checksum file %s", path);
+
+	for (unsigned i = 0; i < num; i++) {
+		for (unsigned j = 0; j < logs[i].count; j++)
+			fprintf(f, "%s %u %08x\n", logs[i].name, j, logs[i].crcs[j]);
+
+		fprintf(f, "%s total %08x\n", logs[i].name, logs[i].running);
+	}
+
+	if (fclose(f))
+		error(EXIT_FAILURE, errno, "Can not write checksum file %s", path);
+
+	pr_info("Checksums are saved to %s", path);
+}
+
+static struct checksum_log const *find_log(struct checksum_log const logs[],
+		unsigned const num, char const *const name)
+{
+	for (unsigned i = 0; i < num; i++)
+		if (strcmp(logs[i].name, name) == 0)
+			return &logs[i];
+
+	return NULL;
+}
+
+unsigned checksum_log_compare(char const *const path,
+		struct checksum_log const logs[], unsigned const num)
+{
+	unsigned mismatched = 0, lines = 0;
+	char name[16], index[16];
+	uint32_t crc;
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		if (errno != ENOENT)
+			error(EXIT_FAILURE, errno, "Can not open checksum file %s", path);
+
+		checksum_log_save(path, logs, num);
+		return 0;
+	}
+
+	while (fscanf(f, "%15s %15s %x", name, index, &crc) == 3) {
+		struct checksum_log const *const log = find_log(logs, num, name);
+		lines++;
+
+		if (!log)
+			continue;
+
+		if (strcmp(index, "total") == 0) {
+			if (crc != log->running) {
+				pr_err("Checksum: %s total mismatch: %08x, expected %08x",
+						name, log->running, crc);
+				mismatched++;
+			}
+			continue;
+		}
+
+		unsigned const frame = strtoul(index, NULL, 10);
+
+		if (frame >= log->count) {
+			pr_err("Checksum: %s frame %u is missing", name, frame);
+			mismatched++;
+		} else if (log->crcs[frame] != crc) {
+			pr_err("Checksum: %s frame %u mismatch: %08x, expected %08x",
+					name, frame, log->crcs[frame], crc);
+			mismatched++;
+		}
+	}
+
+	if (!feof(f) || lines == 0)
+		error(EXIT_FAILURE, 0, "Malformed checksum file %s", path);
+
+	fclose(f);
+
+	pr_info("Checksum: %u mismatches against %s", mismatched, path);
+
+	return mismatched;
+}
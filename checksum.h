@@ -0,0 +1,42 @@
+/*
+ * Checksum functions definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli). Uses SSE4.2 or ARMv8 CRC instructions if available. */
+uint32_t crc32c(uint32_t crc, void const *data, size_t size);
+
+/* Per-frame checksums of one stream */
+struct checksum_log {
+	char const *name;
+	uint32_t *crcs;
+	unsigned count, size;
+	uint32_t running; //!< Checksum of all frames of the stream
+	uint32_t frame; //!< Checksum of the frame being added
+};
+
+void checksum_log_add(struct checksum_log *const log, void const *data,
+		size_t const size);
+
+/* Frame that is not contiguous is added piece by piece and then committed */
+void checksum_log_update(struct checksum_log *const log, void const *data,
+		size_t const size);
+void checksum_log_commit(struct checksum_log *const log);
+
+/*
+ * Compare logs with golden checksum file. If the file does not exist, it
+ * is created from logs. Returns number of mismatched frames.
+ */
+unsigned checksum_log_compare(char const *const path,
+		struct checksum_log const logs[], unsigned const num);
+
+#endif /* CHECKSUM_H */
@@ -413,7 +413,10 @@ int main(int argc, char *argv[]) {
 		timespec_gettime(&stop);
 		time = timespec_subtract(start, stop);
 
-		printf("%s: %.1f s\n", tests[t].message, timespec2float(time));
+		/* Time alone is too coarse for comparison of short runs */
+		printf("%s: %.1f ms, %.1f MiB/s\n", tests[t].message,
+				timespec2float(time) * 1e3,
+				(double)size * num / SZ_1M / timespec2float(time));
 	}
 
 	backend->buffer_free(devbuf, size);
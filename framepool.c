@@ -0,0 +1,156 @@
+/*
+ * Pool of decoded frame buffers implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <error.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "framepool.h"
+#include "log.h"
+
+#define FRAME_POOL_ALIGN 64
+
+static struct frame_pool {
+	pthread_mutex_t lock;
+	AVBufferPool *pool;
+	int format, width, height;
+	int linesize[4];
+	size_t offset[4];
+	size_t size;
+	unsigned depth; //!< Number of frames held by application
+	unsigned allocated; //!< Number of buffers allocated by pool
+	unsigned fallbacks; //!< Number of frames from default allocator
+} fp = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static AVBufferRef *frame_pool_alloc(void *opaque, int size)
+{
+	struct frame_pool *const p = opaque;
+
+	__atomic_fetch_add(&p->allocated, 1, __ATOMIC_RELAXED);
+
+	return av_buffer_alloc(size);
+}
+
+/* Must be called with lock held */
+static int frame_pool_create(AVCodecContext *const cc, AVFrame const *const frame)
+{
+	int width = frame->width, height = frame->height;
+	int align[AV_NUM_DATA_POINTERS];
+	uint8_t *data[4];
+	int rc;
+
+	/* Decoders write beyond visible area, use the same padding as FFmpeg */
+	avcodec_align_dimensions2(cc, &width, &height, align);
+
+	rc = av_image_fill_linesizes(fp.linesize, frame->format, width);
+	if (rc < 0)
+		return rc;
+
+	for (int i = 0; i < 4; i++)
+		fp.linesize[i] = FFALIGN(fp.linesize[i], FRAME_POOL_ALIGN);
+
+	rc = av_image_fill_pointers(data, frame->format, height, NULL, fp.linesize);
+	if (rc < 0)
+		return rc;
+
+	for (int i = 0; i < 4; i++)
+		fp.offset[i] = data[i] ? (size_t)(data[i] - data[0]) : 0;
+
+	av_buffer_pool_uninit(&fp.pool);
+
+	fp.size = rc + 16 + FRAME_POOL_ALIGN - 1;
+	fp.format = frame->format;
+	fp.width = frame->width;
+	fp.height = frame->height;
+	fp.pool = av_buffer_pool_init2(fp.size, &fp, frame_pool_alloc, NULL);
+	if (!fp.pool)
+		return AVERROR(ENOMEM);
+
+	/* Preallocate buffers for frames held by the decoder and application */
+	unsigned const num = fp.depth + cc->refs + cc->has_b_frames + 1 +
+		(cc->active_thread_type & FF_THREAD_FRAME ? cc->thread_count : 0);
+	AVBufferRef *bufs[num];
+
+	for (unsigned i = 0; i < num; i++)
+		bufs[i] = av_buffer_pool_get(fp.pool);
+
+	for (unsigned i = 0; i < num; i++)
+		av_buffer_unref(&bufs[i]);
+
+	pr_verb("Frame pool: %ux%u %s, %zu bytes per frame, %u preallocated",
+			frame->width, frame->height,
+			av_get_pix_fmt_name(frame->format), fp.size, num);
+
+	return 0;
+}
+
+static int frame_pool_get_buffer(AVCodecContext *cc, AVFrame *frame, int flags)
+{
+	int rc = 0;
+
+	if (!(cc->codec->capabilities & AV_CODEC_CAP_DR1)) {
+		__atomic_fetch_add(&fp.fallbacks, 1, __ATOMIC_RELAXED);
+		return avcodec_default_get_buffer2(cc, frame, flags);
+	}
+
+	/* Frame threads request buffers concurrently */
+	pthread_mutex_lock(&fp.lock);
+
+	if (!fp.pool || frame->format != fp.format || frame->width != fp.width ||
+	    frame->height != fp.height)
+		rc = frame_pool_create(cc, frame);
+
+	if (rc == 0) {
+		frame->buf[0] = av_buffer_pool_get(fp.pool);
+		if (!frame->buf[0])
+			rc = AVERROR(ENOMEM);
+	}
+
+	if (rc == 0) {
+		uint8_t *const base = (uint8_t *)FFALIGN(
+				(uintptr_t)frame->buf[0]->data, FRAME_POOL_ALIGN);
+
+		for (int i = 0; i < 4; i++) {
+			frame->data[i] = fp.linesize[i] ? base + fp.offset[i] : NULL;
+			frame->linesize[i] = fp.linesize[i];
+		}
+
+		frame->extended_data = frame->data;
+	}
+
+	pthread_mutex_unlock(&fp.lock);
+
+	return rc;
+}
+
+void frame_pool_init(AVCodecContext *const cc, unsigned const depth)
+{
+	fp.depth = depth;
+
+	cc->get_buffer2 = frame_pool_get_buffer;
+	/* Callback is thread-safe, so frame threads do not serialize on it */
+	cc->thread_safe_callbacks = 1;
+}
+
+void frame_pool_finish(AVCodecContext *const cc)
+{
+	pr_verb("Frame pool: %u buffers allocated, %u frames from default allocator",
+			fp.allocated, fp.fallbacks);
+
+	/* Pool is freed when the last frame returns its buffer */
+	av_buffer_pool_uninit(&fp.pool);
+}
@@ -0,0 +1,26 @@
+/*
+ * Pool of decoded frame buffers definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <libavcodec/avcodec.h>
+
+/*
+ * Installs get_buffer2() callback that allocates decoded frames from a
+ * pool of reference-counted buffers owned by the application. The pool is
+ * sized on the first frame and preallocated for frames held by the
+ * decoder plus depth frames held by the application, so decoding does not
+ * allocate frame memory in steady state. Must be called before
+ * avcodec_open2(). Decoders without direct rendering support use default
+ * allocator.
+ */
+void frame_pool_init(AVCodecContext *const cc, unsigned const depth);
+void frame_pool_finish(AVCodecContext *const cc);
+
+#endif /* FRAMEPOOL_H */
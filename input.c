@@ -0,0 +1,468 @@
+/*
+ * Input file I/O for demuxer implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#define _GNU_SOURCE /* O_DIRECT */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "input.h"
+#include "log.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define INPUT_ALIGN 4096 /* Alignment required by O_DIRECT */
+#define INPUT_BLOCK_SIZE (1024 * 1024)
+#define INPUT_BLOCKS 8
+#define INPUT_AVIO_SIZE (256 * 1024)
+#define INPUT_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+#define ROUND_UP(x, a) (((x)+(a)-1)&~((a)-1))
+#define MIB (1024.0 * 1024.0)
+
+static const char *input_mode_names[] = {
+	[INPUT_DEFAULT]   = "default",
+	[INPUT_READAHEAD] = "readahead",
+	[INPUT_DIRECT]    = "direct",
+	[INPUT_MMAP]      = "mmap",
+	[INPUT_PRELOAD]   = "preload"
+};
+
+/* State of an opened input, passed to I/O callbacks as opaque */
+struct input {
+	enum input_mode mode;
+	int fd;
+	int64_t size;
+	int64_t pos; //!< Position of the demuxer
+
+	/* File data in memory for mmap and preload modes */
+	uint8_t *map;
+	size_t map_size;
+	size_t window; //!< Number of bytes from file start available in map
+
+	/* Readahead ring. Blocks are filled by the thread only. */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct input_block {
+		uint8_t *data;
+		size_t len;
+	} blocks[INPUT_BLOCKS];
+	unsigned head, count;
+	size_t offset; //!< Consumed bytes of the head block
+	int64_t readpos; //!< Position of the next block
+	unsigned generation; //!< Incremented on seek to drop blocks in flight
+	bool eof, stop;
+	int err;
+
+	unsigned stalls; //!< Number of times the demuxer waited for data
+};
+
+enum input_mode input_mode_parse(char const *const name)
+{
+	for (int i = 0; i < ARRAY_SIZE(input_mode_names); i++)
+		if (strcmp(name, input_mode_names[i]) == 0)
+			return i;
+
+	error(EXIT_FAILURE, 0, "Unknown input mode: %s", name);
+
+	return INPUT_DEFAULT;
+}
+
+static void *input_thread(void *arg)
+{
+	struct input *const in = arg;
+
+	pthread_mutex_lock(&in->lock);
+
+	while (!in->stop) {
+		if (in->count == INPUT_BLOCKS || in->eof) {
+			pthread_cond_wait(&in->cond, &in->lock);
+			continue;
+		}
+
+		unsigned const generation = in->generation;
+		int64_t const pos = in->readpos;
+		struct input_block *const b =
+			&in->blocks[(in->head + in->count) % INPUT_BLOCKS];
+
+		pthread_mutex_unlock(&in->lock);
+		ssize_t const len = pread(in->fd, b->data, INPUT_BLOCK_SIZE, pos);
+		int const err = errno;
+		pthread_mutex_lock(&in->lock);
+
+		/* Demuxer has seeked while the block was read */
+		if (generation != in->generation)
+			continue;
+
+		if (len < 0) {
+			in->err = err;
+			in->eof = true;
+		} else {
+			if (len > 0) {
+				b->len = len;
+				in->count++;
+				in->readpos += len;
+			}
+
+			in->eof = len < INPUT_BLOCK_SIZE;
+		}
+
+		pthread_cond_broadcast(&in->cond);
+	}
+
+	pthread_mutex_unlock(&in->lock);
+
+	return NULL;
+}
+
+static int input_read_readahead(void *opaque, uint8_t *buf, int size)
+{
+	struct input *const in = opaque;
+	int copied = 0;
+
+	while (copied < size) {
+		pthread_mutex_lock(&in->lock);
+
+		if (in->count == 0 && !in->eof && copied == 0) {
+			in->stalls++;
+			while (in->count == 0 && !in->eof)
+				pthread_cond_wait(&in->cond, &in->lock);
+		}
+
+		if (in->count == 0) {
+			int const err = in->err;
+
+			pthread_mutex_unlock(&in->lock);
+
+			if (copied)
+				break;
+
+			return err ? AVERROR(err) : AVERROR_EOF;
+		}
+
+		struct input_block const *const b = &in->blocks[in->head];
+		size_t const offset = in->offset;
+
+		pthread_mutex_unlock(&in->lock);
+
+		/* Head block is not touched by the thread until it is released */
+		size_t const len = b->len > offset ?
+				FFMIN(b->len - offset, (size_t)(size - copied)) : 0;
+
+		memcpy(buf + copied, b->data + offset, len);
+		copied += len;
+
+		pthread_mutex_lock(&in->lock);
+		in->offset += len;
+		if (in->offset >= b->len) {
+			in->head = (in->head + 1) % INPUT_BLOCKS;
+			in->count--;
+			in->offset = 0;
+			pthread_cond_broadcast(&in->cond);
+		}
+		pthread_mutex_unlock(&in->lock);
+	}
+
+	in->pos += copied;
+
+	return copied;
+}
+
+static int input_read_memory(void *opaque, uint8_t *buf, int size)
+{
+	struct input *const in = opaque;
+
+	if (in->pos >= in->size)
+		return AVERROR_EOF;
+
+	if (in->pos < in->window) {
+		size = FFMIN(size, in->window - in->pos);
+		memcpy(buf, in->map + in->pos, size);
+	} else {
+		/* Data beyond preloaded window is read directly */
+		ssize_t const len = pread(in->fd, buf, size, in->pos);
+		if (len < 0)
+			return AVERROR(errno);
+		if (len == 0)
+			return AVERROR_EOF;
+
+		size = len;
+	}
+
+	in->pos += size;
+
+	return size;
+}
+
+static int64_t input_seek(void *opaque, int64_t offset, int whence)
+{
+	struct input *const in = opaque;
+	int64_t pos;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE: return in->size;
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = in->pos + offset; break;
+	case SEEK_END: pos = in->size + offset; break;
+	default: return AVERROR(EINVAL);
+	}
+
+	if (pos < 0)
+		return AVERROR(EINVAL);
+
+	if (in->mode == INPUT_MMAP || in->mode == INPUT_PRELOAD) {
+		in->pos = pos;
+		return pos;
+	}
+
+	pthread_mutex_lock(&in->lock);
+
+	/* Skip forward within buffered blocks */
+	int64_t const buffered = in->readpos - in->pos;
+	int64_t skip = pos - in->pos;
+
+	if (skip >= 0 && skip <= buffered) {
+		while (in->count) {
+			struct input_block const *const b = &in->blocks[in->head];
+			size_t const len = FFMIN((int64_t)(b->len - in->offset), skip);
+
+			in->offset += len;
+			skip -= len;
+			if (in->offset < b->len)
+				break;
+
+			in->head = (in->head + 1) % INPUT_BLOCKS;
+			in->count--;
+			in->offset = 0;
+		}
+	} else {
+		in->generation++;
+		in->count = 0;
+		in->readpos = pos & ~(int64_t)(INPUT_ALIGN - 1);
+		in->offset = pos - in->readpos;
+		in->eof = false;
+		in->err = 0;
+	}
+
+	in->pos = pos;
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->lock);
+
+	return pos;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void input_preload(struct input *const in, char const *const path,
+		size_t const window)
+{
+	bool huge = false;
+
+	in->window = window && window < in->size ? window : in->size;
+	if (in->window == 0)
+		return;
+
+#ifdef MAP_HUGETLB
+	in->map_size = ROUND_UP(in->window, INPUT_HUGEPAGE_SIZE);
+	in->map = mmap(NULL, in->map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	huge = in->map != MAP_FAILED;
+#endif
+
+	/* Hugepages are not reserved, try transparent ones */
+	if (!huge) {
+		in->map_size = in->window;
+		in->map = mmap(NULL, in->map_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (in->map == MAP_FAILED)
+			error(EXIT_FAILURE, errno, "Can not allocate %zu bytes to preload %s",
+					in->window, path);
+#ifdef MADV_HUGEPAGE
+		madvise(in->map, in->map_size, MADV_HUGEPAGE);
+#endif
+	}
+
+	double const start = now();
+
+	for (size_t done = 0; done < in->window;) {
+		ssize_t const len = pread(in->fd, in->map + done, in->window - done, done);
+		if (len < 0)
+			error(EXIT_FAILURE, errno, "Can not read %s", path);
+		if (len == 0)
+			error(EXIT_FAILURE, 0, "File %s is truncated while reading", path);
+
+		done += len;
+	}
+
+	double const time = now() - start;
+
+	pr_info("Input: Preloaded %.1f of %.1f MiB in %.3f s (%.1f MiB/s), %s pages",
+			in->window / MIB, in->size / MIB, time, in->window / MIB / time,
+			huge ? "huge" : "regular");
+}
+
+/* Returns NULL if input is not a regular file */
+static struct input *input_setup(char const *const path,
+		enum input_mode const mode, size_t const preload)
+{
+	struct input *in;
+	struct stat st;
+
+	/* Devices and URLs are left to libavformat */
+	if (stat(path, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+
+	/* State is per opening, so input may be opened any number of times */
+	in = calloc(1, sizeof(*in));
+	if (!in) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	pthread_mutex_init(&in->lock, NULL);
+	pthread_cond_init(&in->cond, NULL);
+
+	in->mode = mode;
+	in->fd = open(path, O_RDONLY | (mode == INPUT_DIRECT ? O_DIRECT : 0));
+	if (in->fd < 0 && mode == INPUT_DIRECT && errno == EINVAL) {
+		pr_warn("Input: File system does not support O_DIRECT");
+		in->mode = INPUT_READAHEAD;
+		in->fd = open(path, O_RDONLY);
+	}
+
+	if (in->fd < 0)
+		error(EXIT_FAILURE, errno, "Can not open %s", path);
+
+	in->size = st.st_size;
+
+	if (in->mode == INPUT_MMAP) {
+		in->map_size = in->window = in->size;
+		in->map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (in->map == MAP_FAILED)
+			error(EXIT_FAILURE, errno, "Can not mmap %s", path);
+
+		if (madvise(in->map, in->size, MADV_SEQUENTIAL) ||
+		    madvise(in->map, in->size, MADV_WILLNEED))
+			pr_warn("Input: madvise() failed: %s", strerror(errno));
+
+		return in;
+	}
+
+	if (in->mode == INPUT_PRELOAD) {
+		input_preload(in, path, preload);
+		return in;
+	}
+
+	if (in->mode == INPUT_READAHEAD) {
+		int const rc = posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (rc)
+			pr_warn("Input: posix_fadvise() failed: %s", strerror(rc));
+	}
+
+	for (int i = 0; i < INPUT_BLOCKS; i++) {
+		int const rc = posix_memalign((void **)&in->blocks[i].data, INPUT_ALIGN,
+				INPUT_BLOCK_SIZE);
+		if (rc) error(EXIT_FAILURE, rc, "Can not allocate input buffers");
+	}
+
+	int const rc = pthread_create(&in->thread, NULL, input_thread, in);
+	if (rc) error(EXIT_FAILURE, rc, "Can not create input thread");
+
+	return in;
+}
+
+int input_open(AVFormatContext **const ifc, char const *const path,
+		AVInputFormat *const fmt, AVDictionary **const options,
+		enum input_mode const mode, size_t const preload)
+{
+	struct input *const in = mode == INPUT_DEFAULT ? NULL :
+			input_setup(path, mode, preload);
+
+	if (!in)
+		return avformat_open_input(ifc, path, fmt, options);
+
+	uint8_t *const buffer = av_malloc(INPUT_AVIO_SIZE);
+	if (!buffer) error(EXIT_FAILURE, 0, "Can not allocate I/O buffer");
+
+	AVIOContext *const pb = avio_alloc_context(buffer, INPUT_AVIO_SIZE, 0, in,
+			in->map || in->mode == INPUT_PRELOAD ? input_read_memory :
+			input_read_readahead,
+			NULL, input_seek);
+	if (!pb) error(EXIT_FAILURE, 0, "Can not allocate I/O context");
+
+	*ifc = avformat_alloc_context();
+	if (!*ifc) error(EXIT_FAILURE, 0, "Can not allocate input context");
+
+	(*ifc)->pb = pb;
+	(*ifc)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	pr_info("Input: %s mode, %" PRId64 " bytes", input_mode_names[in->mode],
+			in->size);
+
+	return avformat_open_input(ifc, path, fmt, options);
+}
+
+void input_close(AVFormatContext **const ifc)
+{
+	AVIOContext *pb = *ifc && ((*ifc)->flags & AVFMT_FLAG_CUSTOM_IO) ?
+			(*ifc)->pb : NULL;
+
+	avformat_close_input(ifc);
+
+	if (!pb)
+		return;
+
+	struct input *const in = pb->opaque;
+
+	av_freep(&pb->buffer);
+	av_freep(&pb);
+
+	if (in->mode == INPUT_MMAP || in->mode == INPUT_PRELOAD) {
+		if (in->map)
+			munmap(in->map, in->map_size);
+		in->map = NULL;
+	} else {
+		pthread_mutex_lock(&in->lock);
+		in->stop = true;
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->lock);
+
+		pthread_join(in->thread, NULL);
+
+		for (int i = 0; i < INPUT_BLOCKS; i++)
+			free(in->blocks[i].data);
+
+		pr_verb("Input: Demuxer waited for data %u times", in->stalls);
+	}
+
+	close(in->fd);
+	pthread_mutex_destroy(&in->lock);
+	pthread_cond_destroy(&in->cond);
+	free(in);
+}
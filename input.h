@@ -0,0 +1,42 @@
+/*
+ * Input file I/O for demuxer definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <libavformat/avformat.h>
+
+/*
+ * Input modes:
+ * - default: libavformat's own I/O;
+ * - readahead: large blocks are read by a separate thread ahead of the
+ *   demuxer;
+ * - direct: the same as readahead, but the file is opened with O_DIRECT
+ *   to bypass page cache;
+ * - mmap: the file is mapped into memory and paged in by the kernel;
+ * - preload: the first preload bytes (whole file if 0) are read into
+ *   hugepage-backed memory at opening, so storage does not affect
+ *   processing. The rest of the file is read on demand.
+ * Only regular files use custom I/O, other inputs (devices, URLs) are
+ * always opened by libavformat.
+ */
+enum input_mode {
+	INPUT_DEFAULT,
+	INPUT_READAHEAD,
+	INPUT_DIRECT,
+	INPUT_MMAP,
+	INPUT_PRELOAD
+};
+
+enum input_mode input_mode_parse(char const *const name);
+int input_open(AVFormatContext **const ifc, char const *const path,
+		AVInputFormat *const fmt, AVDictionary **const options,
+		enum input_mode const mode, size_t const preload);
+void input_close(AVFormatContext **const ifc);
+
+#endif /* INPUT_H */
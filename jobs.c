@@ -0,0 +1,307 @@
+/*
+ * Batch encoding job scheduler implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "log.h"
+
+enum job_status {
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED
+};
+
+/*
+ * Written by worker processes, so it is kept in shared memory. Job is
+ * taken by setting its owner atomically, so a worker that dies at any
+ * moment after that is known to the parent.
+ */
+struct job_state {
+	unsigned owner; //!< Index of worker that has taken the job plus one
+	enum job_status status;
+	unsigned frames;
+	uint64_t bytes;
+	double start, end;
+};
+
+static struct job_state *states;
+
+static struct job *jobs;
+static unsigned njobs;
+
+static struct worker {
+	char const *device;
+	pid_t pid;
+} *workers;
+
+static unsigned self; //!< Index of the worker in worker process
+static struct job_state *current; //!< Job of the worker in worker process
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void jobs_load(char const *const path)
+{
+	FILE *const f = fopen(path, "r");
+	char *line = NULL;
+	size_t size = 0;
+	unsigned lineno = 0;
+
+	if (!f)
+		error(EXIT_FAILURE, errno, "Can not open job manifest %s", path);
+
+	while (getline(&line, &size, f) >= 0) {
+		char *save, *fields[4] = { NULL };
+		unsigned n = 0;
+
+		lineno++;
+
+		for (char *s = strtok_r(line, " \t\n", &save); s && n < 4;
+		     s = strtok_r(NULL, " \t\n", &save))
+			fields[n++] = s;
+
+		if (n == 0 || fields[0][0] == '#')
+			continue;
+
+		if (n < 2 || n > 3)
+			error(EXIT_FAILURE, 0, "%s:%u: Job must be: input output [controls]",
+					path, lineno);
+
+		jobs = realloc(jobs, (njobs + 1) * sizeof(*jobs));
+		if (!jobs) error(EXIT_FAILURE, 0, "Not enough memory");
+
+		struct job *const job = &jobs[njobs++];
+
+		job->input = strdup(fields[0]);
+		job->output = strdup(fields[1]);
+		job->ctrls = fields[2] ? strdup(fields[2]) : NULL;
+		if (!job->input || !job->output || (fields[2] && !job->ctrls))
+			error(EXIT_FAILURE, 0, "Not enough memory");
+	}
+
+	if (ferror(f))
+		error(EXIT_FAILURE, errno, "Can not read job manifest %s", path);
+
+	free(line);
+	fclose(f);
+
+	if (njobs == 0)
+		error(EXIT_FAILURE, 0, "No jobs in manifest %s", path);
+
+	pr_verb("Jobs: %u loaded from %s", njobs, path);
+}
+
+struct job const *jobs_next(void)
+{
+	unsigned i;
+
+	for (i = 0; i < njobs; i++) {
+		unsigned pending = 0;
+
+		if (__atomic_compare_exchange_n(&states[i].owner, &pending, self + 1,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (i == njobs) {
+		current = NULL;
+		return NULL;
+	}
+
+	current = &states[i];
+	current->start = now();
+	current->status = JOB_RUNNING;
+
+	pr_info("Job %u: %s -> %s on %s", i + 1, jobs[i].input, jobs[i].output,
+			workers[self].device);
+
+	return &jobs[i];
+}
+
+void jobs_done(unsigned const frames, uint64_t const bytes)
+{
+	current->frames = frames;
+	current->bytes = bytes;
+	current->end = now();
+	current->status = JOB_DONE;
+}
+
+static void spawn(unsigned const w, jobs_worker const worker, void *const arg)
+{
+	/* Buffered output would be written by both processes */
+	fflush(NULL);
+
+	pid_t const pid = fork();
+	if (pid < 0)
+		error(EXIT_FAILURE, errno, "Can not start worker for %s",
+				workers[w].device);
+
+	if (pid == 0) {
+		self = w;
+		worker(workers[w].device, arg);
+		exit(EXIT_SUCCESS);
+	}
+
+	workers[w].pid = pid;
+}
+
+/* Job may be taken but not marked running yet */
+static struct job_state *running_job(unsigned const w)
+{
+	for (unsigned i = 0; i < njobs; i++)
+		if (__atomic_load_n(&states[i].owner, __ATOMIC_ACQUIRE) == w + 1 &&
+		    states[i].status < JOB_DONE)
+			return &states[i];
+
+	return NULL;
+}
+
+static bool jobs_pending(void)
+{
+	for (unsigned i = 0; i < njobs; i++)
+		if (__atomic_load_n(&states[i].owner, __ATOMIC_RELAXED) == 0)
+			return true;
+
+	return false;
+}
+
+static void report(char const *const devices[], unsigned const ndevices,
+		unsigned const sessions, double const time)
+{
+	unsigned done = 0, failed = 0;
+
+	for (unsigned i = 0; i < njobs; i++)
+		if (states[i].status == JOB_DONE)
+			done++;
+		else if (states[i].status == JOB_FAILED)
+			failed++;
+
+	pr_info("Jobs: %u done, %u failed, %u not finished in %.1f s", done,
+			failed, njobs - done - failed, time);
+
+	/* Time between jobs is setup and scheduling overhead */
+	for (unsigned d = 0; d < ndevices; d++) {
+		unsigned n = 0, frames = 0;
+		uint64_t bytes = 0;
+		double busy = 0;
+
+		for (unsigned i = 0; i < njobs; i++) {
+			struct job_state const *const s = &states[i];
+
+			if (s->status < JOB_DONE || (s->owner - 1) / sessions != d)
+				continue;
+
+			n++;
+			frames += s->frames;
+			bytes += s->bytes;
+			busy += s->end - s->start;
+		}
+
+		pr_info("Device %s: %u jobs, %u frames (%.1f FPS), %.1f MiB, "
+				"utilisation %.0f%%", devices[d], n, frames,
+				frames / time, bytes / 1048576.0,
+				busy / (time * sessions) * 100);
+	}
+}
+
+unsigned jobs_run(char const *const devices[], unsigned const ndevices,
+		unsigned const sessions, jobs_worker const worker, void *const arg)
+{
+	unsigned const nworkers = ndevices * sessions;
+	unsigned running = 0, left = 0;
+
+	states = mmap(NULL, njobs * sizeof(*states), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (states == MAP_FAILED)
+		error(EXIT_FAILURE, errno, "Can not allocate job states");
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!workers) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	pr_info("Jobs: %u jobs on %u devices, %u sessions per device", njobs,
+			ndevices, sessions);
+
+	double const start = now();
+
+	for (unsigned w = 0; w < nworkers; w++) {
+		workers[w].device = devices[w / sessions];
+		spawn(w, worker, arg);
+		running++;
+	}
+
+	while (running) {
+		int status;
+		unsigned w;
+
+		pid_t const pid = wait(&status);
+		if (pid < 0 && errno == EINTR)
+			continue;
+		if (pid < 0)
+			error(EXIT_FAILURE, errno, "Can not wait for workers");
+
+		for (w = 0; w < nworkers && workers[w].pid != pid; w++);
+		if (w == nworkers)
+			continue;
+
+		running--;
+		workers[w].pid = 0;
+
+		bool const success = WIFEXITED(status) &&
+				WEXITSTATUS(status) == EXIT_SUCCESS;
+		struct job_state *const job = running_job(w);
+
+		/* Worker that is stopped or killed leaves its job unfinished */
+		if (!success && job) {
+			job->status = JOB_FAILED;
+			job->end = now();
+			pr_warn("Job %u (%s) failed on %s", (unsigned)(job - states) + 1,
+					jobs[job - states].input, workers[w].device);
+		} else if (!success) {
+			pr_warn("Worker for %s failed before taking a job",
+					workers[w].device);
+		}
+
+		/*
+		 * Device has worked, so the failure is likely caused by the job.
+		 * Crashed worker is restarted too, interrupted one exits normally.
+		 */
+		if (!success && job && jobs_pending()) {
+			pr_verb("Restarting worker for %s", workers[w].device);
+			spawn(w, worker, arg);
+			running++;
+		}
+	}
+
+	report(devices, ndevices, sessions, now() - start);
+
+	for (unsigned i = 0; i < njobs; i++)
+		if (states[i].status != JOB_DONE)
+			left++;
+
+	return left;
+}
@@ -0,0 +1,44 @@
+/*
+ * Batch encoding job scheduler definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdint.h>
+
+/*
+ * Manifest is a text file with a job per line:
+ *     input output [controls]
+ * where controls have the syntax of -c option. Empty lines and lines
+ * starting with '#' are ignored.
+ *
+ * Every device session is served by a worker process that is forked by
+ * jobs_run() and calls worker function once. Worker sets the device up and
+ * then takes jobs with jobs_next() until none is left, so setup is reused
+ * and jobs go to whichever session is free first. A worker that dies
+ * fails its current job and is restarted for the rest.
+ */
+struct job {
+	char const *input;
+	char const *output;
+	char const *ctrls; //!< Controls or NULL
+};
+
+typedef void (*jobs_worker)(char const *const device, void *const arg);
+
+void jobs_load(char const *const path);
+
+/* Returns number of jobs that are not done */
+unsigned jobs_run(char const *const devices[], unsigned const ndevices,
+		unsigned const sessions, jobs_worker const worker, void *const arg);
+
+/* Worker side */
+struct job const *jobs_next(void);
+void jobs_done(unsigned const frames, uint64_t const bytes);
+
+#endif /* JOBS_H */
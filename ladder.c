@@ -0,0 +1,358 @@
+/*
+ * Adaptive bitrate ladder implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <time.h>
+#include <semaphore.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <libavutil/imgutils.h>
+
+#include "ladder.h"
+#include "log.h"
+
+#define LADDER_MAX_RENDITIONS 8
+
+/* Frames decoder can be ahead of the slowest encoder */
+#define LADDER_SLOTS 4
+
+/* Period of checking that encoders are alive while waiting for them */
+#define LADDER_POLL_MS 100
+
+static struct rendition renditions[LADDER_MAX_RENDITIONS];
+static unsigned nrenditions;
+
+struct slot {
+	int width, height, format;
+};
+
+static struct {
+	sem_t progress; //!< Posted when encoder releases a frame
+	unsigned head; //!< Number of published frames
+	size_t slotsize;
+	struct slot slots[LADDER_SLOTS];
+	struct {
+		sem_t ready; //!< Posted for every published frame and at the end
+		unsigned tail; //!< Number of released frames
+		unsigned frames, keys;
+		uint32_t keyhash; //!< Hash of key frame positions
+	} enc[LADDER_MAX_RENDITIONS];
+} *shared;
+
+static uint8_t *slotdata;
+static size_t mapsize;
+
+static struct encoder {
+	pid_t pid;
+	bool alive;
+	bool failed;
+} encoders[LADDER_MAX_RENDITIONS];
+
+static char const *const *devices;
+static unsigned ndevices;
+static ladder_encoder encoder;
+static void *encoder_arg;
+
+static int self = -1; //!< Index of rendition in encoder process
+static unsigned taken; //!< Frames taken by encoder process
+
+void ladder_add(char const *const spec)
+{
+	struct rendition *const r = &renditions[nrenditions];
+	char *end;
+
+	if (nrenditions == LADDER_MAX_RENDITIONS)
+		error(EXIT_FAILURE, 0, "Too many renditions, at most %u are supported",
+				LADDER_MAX_RENDITIONS);
+
+	r->width = strtol(spec, &end, 10);
+	if (*end == 'x')
+		r->height = strtol(end + 1, &end, 10);
+	if (*end != ':' || r->width <= 0 || r->height <= 0 || end[1] == '\0')
+		error(EXIT_FAILURE, 0, "Rendition must be WIDTHxHEIGHT:output[:controls]: %s",
+				spec);
+
+	/* Output may be a socket address with colons, controls have '=' */
+	char const *const output = end + 1;
+	char const *const last = strrchr(output, ':');
+
+	if (last && strchr(last, '=')) {
+		r->output = strndup(output, last - output);
+		r->ctrls = strdup(last + 1);
+		if (!r->output || !r->ctrls) error(EXIT_FAILURE, 0, "Not enough memory");
+	} else {
+		r->output = output;
+	}
+
+	nrenditions++;
+}
+
+bool ladder_enabled(void)
+{
+	return nrenditions > 0;
+}
+
+void ladder_init(char const *const devs[], unsigned const ndevs,
+		ladder_encoder const enc, void *const arg)
+{
+	devices = devs;
+	ndevices = ndevs;
+	encoder = enc;
+	encoder_arg = arg;
+}
+
+static void start(AVFrame const *const frame)
+{
+	int const size = av_image_get_buffer_size(frame->format, frame->width,
+			frame->height, 1);
+	size_t const header = (sizeof(*shared) + 63) & ~(size_t)63;
+
+	if (size < 0)
+		error(EXIT_FAILURE, 0, "Ladder: Unsupported frame format %d", frame->format);
+
+	mapsize = header + LADDER_SLOTS * (size_t)size;
+	shared = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+	if (shared == MAP_FAILED)
+		error(EXIT_FAILURE, errno, "Can not allocate frame ring");
+
+	slotdata = (uint8_t *)shared + header;
+	shared->slotsize = size;
+
+	if (sem_init(&shared->progress, 1, 0))
+		error(EXIT_FAILURE, errno, "Can not initialize semaphore");
+
+	for (unsigned i = 0; i < nrenditions; i++)
+		if (sem_init(&shared->enc[i].ready, 1, 0))
+			error(EXIT_FAILURE, errno, "Can not initialize semaphore");
+
+	pr_info("Ladder: %u renditions of %dx%d", nrenditions, frame->width,
+			frame->height);
+
+	/* Buffered output would be written by both processes */
+	fflush(NULL);
+
+	for (unsigned i = 0; i < nrenditions; i++) {
+		pid_t const pid = fork();
+		if (pid < 0)
+			error(EXIT_FAILURE, errno, "Can not start encoder for rendition %dx%d",
+					renditions[i].width, renditions[i].height);
+
+		if (pid == 0) {
+			self = i;
+
+			/* Decoder stops on signal, encoders drain the rest */
+			signal(SIGINT, SIG_IGN);
+			signal(SIGTERM, SIG_IGN);
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+			encoder(devices[i % ndevices], &renditions[i], encoder_arg);
+			exit(EXIT_SUCCESS);
+		}
+
+		encoders[i].pid = pid;
+		encoders[i].alive = true;
+	}
+}
+
+static void reaped(pid_t const pid, int const status)
+{
+	for (unsigned i = 0; i < nrenditions; i++) {
+		if (encoders[i].pid != pid)
+			continue;
+
+		encoders[i].alive = false;
+		encoders[i].failed = !WIFEXITED(status) ||
+				WEXITSTATUS(status) != EXIT_SUCCESS;
+		if (encoders[i].failed)
+			pr_warn("Encoder of rendition %dx%d failed", renditions[i].width,
+					renditions[i].height);
+	}
+}
+
+/* Waits until all encoders that are alive have released the oldest slot */
+static void wait_slot(unsigned const head)
+{
+	while (true) {
+		unsigned alive = 0;
+		bool full = false;
+		struct timespec ts;
+		pid_t pid;
+		int status;
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			reaped(pid, status);
+
+		for (unsigned i = 0; i < nrenditions; i++) {
+			if (!encoders[i].alive)
+				continue;
+
+			alive++;
+			if (head - __atomic_load_n(&shared->enc[i].tail, __ATOMIC_ACQUIRE) >=
+			    LADDER_SLOTS)
+				full = true;
+		}
+
+		if (alive == 0)
+			error(EXIT_FAILURE, 0, "Encoders of all renditions failed");
+
+		if (!full)
+			return;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LADDER_POLL_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+
+		if (sem_timedwait(&shared->progress, &ts) && errno != ETIMEDOUT &&
+		    errno != EINTR)
+			error(EXIT_FAILURE, errno, "Can not wait for encoders");
+	}
+}
+
+void ladder_publish(AVFrame const *const frame)
+{
+	if (!shared)
+		start(frame);
+
+	unsigned const head = shared->head;
+	struct slot *const slot = &shared->slots[head % LADDER_SLOTS];
+	int const size = av_image_get_buffer_size(frame->format, frame->width,
+			frame->height, 1);
+
+	if (size < 0 || size > shared->slotsize)
+		error(EXIT_FAILURE, 0, "Ladder: Frame %dx%d does not fit into frame ring",
+				frame->width, frame->height);
+
+	wait_slot(head);
+
+	slot->width = frame->width;
+	slot->height = frame->height;
+	slot->format = frame->format;
+
+	av_image_copy_to_buffer(slotdata + (head % LADDER_SLOTS) * shared->slotsize,
+			size, (uint8_t const * const *)frame->data, frame->linesize,
+			frame->format, frame->width, frame->height, 1);
+
+	__atomic_store_n(&shared->head, head + 1, __ATOMIC_RELEASE);
+
+	for (unsigned i = 0; i < nrenditions; i++)
+		if (encoders[i].alive)
+			sem_post(&shared->enc[i].ready);
+}
+
+unsigned ladder_finish(void)
+{
+	unsigned failed = 0;
+	int ref = -1;
+
+	if (!shared) {
+		pr_warn("Ladder: No frames are decoded");
+		return nrenditions;
+	}
+
+	/* Encoders find no new frame and finish */
+	for (unsigned i = 0; i < nrenditions; i++)
+		if (encoders[i].alive)
+			sem_post(&shared->enc[i].ready);
+
+	for (unsigned i = 0; i < nrenditions; i++) {
+		int status;
+
+		while (encoders[i].alive) {
+			pid_t const pid = waitpid(encoders[i].pid, &status, 0);
+			if (pid < 0 && errno != EINTR)
+				error(EXIT_FAILURE, errno, "Can not wait for encoders");
+			if (pid > 0)
+				reaped(pid, status);
+		}
+	}
+
+	for (unsigned i = 0; i < nrenditions; i++) {
+		struct rendition const *const r = &renditions[i];
+
+		if (encoders[i].failed) {
+			failed++;
+			continue;
+		}
+
+		pr_info("Rendition %dx%d: %u frames, %u key frames", r->width, r->height,
+				shared->enc[i].frames, shared->enc[i].keys);
+
+		if (ref < 0) {
+			ref = i;
+			continue;
+		}
+
+		if (shared->enc[i].keys != shared->enc[ref].keys ||
+		    shared->enc[i].keyhash != shared->enc[ref].keyhash)
+			pr_warn("Key frames of rendition %dx%d are not aligned with %dx%d",
+					r->width, r->height, renditions[ref].width,
+					renditions[ref].height);
+	}
+
+	munmap(shared, mapsize);
+	shared = NULL;
+
+	return failed;
+}
+
+bool ladder_next(AVFrame *const frame)
+{
+	while (sem_wait(&shared->enc[self].ready))
+		if (errno != EINTR)
+			error(EXIT_FAILURE, errno, "Can not wait for frames");
+
+	/* The last post signals the end */
+	if (taken == __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE))
+		return false;
+
+	struct slot const *const slot = &shared->slots[taken % LADDER_SLOTS];
+
+	frame->width = slot->width;
+	frame->height = slot->height;
+	frame->format = slot->format;
+
+	av_image_fill_arrays(frame->data, frame->linesize,
+			slotdata + (taken % LADDER_SLOTS) * shared->slotsize,
+			slot->format, slot->width, slot->height, 1);
+
+	return true;
+}
+
+void ladder_release(void)
+{
+	__atomic_store_n(&shared->enc[self].tail, ++taken, __ATOMIC_RELEASE);
+	sem_post(&shared->progress);
+}
+
+void ladder_encoded(bool const key)
+{
+	if (self < 0)
+		return;
+
+	if (key) {
+		shared->enc[self].keys++;
+		shared->enc[self].keyhash = shared->enc[self].keyhash * 31 +
+				shared->enc[self].frames + 1;
+	}
+
+	shared->enc[self].frames++;
+}
@@ -0,0 +1,54 @@
+/*
+ * Adaptive bitrate ladder definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef LADDER_H
+#define LADDER_H
+
+#include <stdbool.h>
+
+#include <libavutil/frame.h>
+
+/*
+ * Input is decoded once by the main process, every rendition is encoded
+ * by a forked process with its own device session. Decoded frames are
+ * copied into a small ring in shared memory, encoder processes scale them
+ * into their device buffers in parallel. The ring slot is reused when all
+ * renditions have taken the frame, so the slowest encoder paces decoding.
+ *
+ * Rendition is given as WIDTHxHEIGHT:output[:controls], where controls
+ * have the syntax of -c option. Renditions get devices in turn.
+ *
+ * Encoder processes report their key frames, renditions that have key
+ * frames at different positions are reported at the end, as they can not
+ * be switched between.
+ */
+struct rendition {
+	int width, height;
+	char const *output;
+	char const *ctrls; //!< Controls or NULL
+};
+
+typedef void (*ladder_encoder)(char const *const device,
+		struct rendition const *const r, void *const arg);
+
+void ladder_add(char const *const spec);
+bool ladder_enabled(void);
+
+/* Decoder side, encoders are started with the first frame */
+void ladder_init(char const *const devices[], unsigned const ndevices,
+		ladder_encoder const encoder, void *const arg);
+void ladder_publish(AVFrame const *const frame);
+/* Returns number of renditions that failed */
+unsigned ladder_finish(void);
+
+/* Encoder side */
+bool ladder_next(AVFrame *const frame);
+void ladder_release(void);
+void ladder_encoded(bool const key);
+
+#endif /* LADDER_H */
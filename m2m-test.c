@@ -23,8 +23,10 @@
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
 #include <malloc.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -44,9 +46,24 @@
 #include <libavutil/pixdesc.h>
 #include <libavutil/time.h>
 
+#include "autotune.h"
+#include "checksum.h"
+#include "framepool.h"
+#include "input.h"
+#include "jobs.h"
+#include "ladder.h"
 #include "m420.h"
 #include "log.h"
+#include "metrics.h"
+#include "output.h"
+#include "quality.h"
+#include "ratectl.h"
+#include "realtime.h"
+#include "shmring.h"
+#include "stats.h"
+#include "twopass.h"
 #include "v4l2-utils.h"
+#include "v4l2-trace.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #define ROUND_UP(x, a) (((x)+(a)-1)&~((a)-1))
@@ -55,6 +72,8 @@
 #define V4L2_CID_TRANS_NUM_BUFS  (V4L2_CID_PRIVATE_BASE + 1)
 
 #define NUM_BUFS 4
+#define MAX_BUFS 32
+#define MAX_DEVICES 16
 
 /* Some evident defines */
 #define MSEC_IN_SEC 1000
@@ -88,11 +107,54 @@ static struct m2m_buffer {
 	struct v4l2_buffer v4l2;
 	void *buf;
 	AVFrame *frame;
-} out_bufs[NUM_BUFS], cap_bufs[NUM_BUFS];
+} out_bufs[MAX_BUFS], cap_bufs[MAX_BUFS];
+
+/*
+ * Mode of writing to mmapped output buffers. Device buffers are often
+ * write-combined or uncached, so reading them back or writing them
+ * non-sequentially is slow. Staged mode prepares frame in cached memory
+ * and then streams it to the device buffer.
+ */
+enum write_mode {
+	WRITE_AUTO,
+	WRITE_DIRECT,
+	WRITE_STAGED
+};
+
+static const char *write_mode_names[] = {
+	[WRITE_AUTO]   = "auto",
+	[WRITE_DIRECT] = "direct",
+	[WRITE_STAGED] = "staged"
+};
+
+static AVFrame *stage_frame; //!< Cached frame used in staged write mode
+static bool verify; //!< Verify quality of encoded stream
+static bool low_latency; //!< Single frame in flight, latency is reported
+static struct shmring *ring; //!< Ring to publish encoded frames to
+
+static struct checksum_log checksums[] = {
+	{ .name = "enc" },
+	{ .name = "in" }
+};
+static bool checksum_enc, checksum_in;
+
+static volatile sig_atomic_t stop_signal; //!< Signal that requested to stop
+static bool source_changed; //!< Device signalled change of its formats
+static bool avico; //!< Device is Avico encoder
+static unsigned depth = MAX_BUFS; //!< Limit of frames in flight
+
+static const struct {
+	char const *name;
+	int type;
+} thread_types[] = {
+	{ "auto",  FF_THREAD_FRAME | FF_THREAD_SLICE },
+	{ "frame", FF_THREAD_FRAME },
+	{ "slice", FF_THREAD_SLICE }
+};
 
 static inline bool is_valid_out_buf(unsigned const outn)
 {
-	return outn < NUM_BUFS && out_bufs[outn].buf;
+	return outn < MAX_BUFS && out_bufs[outn].buf;
 }
 
 static void m2m_vim2m_controls(int const fd) {
@@ -105,86 +167,92 @@ static void m2m_vim2m_controls(int const fd) {
 	if (hflip) {
 		ctrl.id = V4L2_CID_HFLIP;
 		ctrl.value = 1;
-		rc = ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+		rc = v4l2_ioctl(fd, VIDIOC_S_CTRL, &ctrl);
 		if (rc != 0) error(EXIT_SUCCESS, errno, "Can not set HFLIP");
 	}
 
 	if (vflip) {
 		ctrl.id = V4L2_CID_VFLIP;
 		ctrl.value = 1;
-		rc = ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+		rc = v4l2_ioctl(fd, VIDIOC_S_CTRL, &ctrl);
 		if (rc != 0) error(EXIT_SUCCESS, errno, "Can not set VFLIP");
 	}
 
 	ctrl.id = V4L2_CID_TRANS_TIME_MSEC;
 	ctrl.value = 100;
-	rc = ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+	rc = v4l2_ioctl(fd, VIDIOC_S_CTRL, &ctrl);
 	if (rc != 0) error(EXIT_SUCCESS, errno, "Can not set transaction time");
 
 	ctrl.id = V4L2_CID_TRANS_NUM_BUFS;
 	ctrl.value = 1;
-	rc = ioctl(fd, VIDIOC_S_CTRL, &ctrl);
+	rc = v4l2_ioctl(fd, VIDIOC_S_CTRL, &ctrl);
 	if (rc != 0) error(EXIT_SUCCESS, errno, "Can not set transaction length");
 }
 
-static void m2m_buffers_get(int const fd) {
+static unsigned m2m_buffers_request(int const fd, enum v4l2_buf_type const type,
+		unsigned const num)
+{
+	struct m2m_buffer *const bufs = type == V4L2_BUF_TYPE_VIDEO_OUTPUT ?
+			out_bufs : cap_bufs;
+	char const *const name = type == V4L2_BUF_TYPE_VIDEO_OUTPUT ?
+			"output" : "capture";
 	int rc;
 
-	pr_verb("M2M: Obtaining buffers...");
-
-	struct v4l2_requestbuffers outreqbuf = {
-		.count = NUM_BUFS,
-		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
-		.memory = V4L2_MEMORY_MMAP
-	};
-
-	struct v4l2_requestbuffers capreqbuf = {
-		.count = NUM_BUFS,
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	struct v4l2_requestbuffers reqbuf = {
+		.count = num,
+		.type = type,
 		.memory = V4L2_MEMORY_MMAP
 	};
 
-	rc = ioctl(fd, VIDIOC_REQBUFS, &outreqbuf);
-	if (rc != 0) error(EXIT_FAILURE, errno, "Can not request output buffers");
-	if (outreqbuf.count == 0) error(EXIT_FAILURE, 0, "Device gives zero output buffers");
-	pr_debug("M2M: Got %d output buffers", outreqbuf.count);
-
-	rc = ioctl(fd, VIDIOC_REQBUFS, &capreqbuf);
-	if (rc != 0) error(EXIT_FAILURE, errno, "Can not request capture buffers");
-	if (capreqbuf.count == 0) error(EXIT_FAILURE, 0, "Device gives zero capture buffers");
-	pr_debug("M2M: Got %d capture buffers", capreqbuf.count);
+	rc = v4l2_ioctl(fd, VIDIOC_REQBUFS, &reqbuf);
+	if (rc != 0) error(EXIT_FAILURE, errno, "Can not request %s buffers", name);
+	if (reqbuf.count == 0) error(EXIT_FAILURE, 0, "Device gives zero %s buffers", name);
+	if (reqbuf.count > MAX_BUFS)
+		error(EXIT_FAILURE, 0, "Device gives too many %s buffers: %u", name, reqbuf.count);
+	pr_debug("M2M: Got %d %s buffers", reqbuf.count, name);
 
-	for (int i = 0; i < outreqbuf.count; ++i) {
-		struct v4l2_buffer *vbuf = &out_bufs[i].v4l2;
-		vbuf->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	for (int i = 0; i < reqbuf.count; ++i) {
+		struct v4l2_buffer *vbuf = &bufs[i].v4l2;
+		vbuf->type = type;
 		vbuf->memory = V4L2_MEMORY_MMAP;
 		vbuf->index = i;
 		vbuf->flags = 0;
 
-		rc = ioctl(fd, VIDIOC_QUERYBUF, vbuf);
-		if (rc != 0) error(EXIT_FAILURE, errno, "Can not query output buffer");
-		pr_debug("M2M: Got output buffer #%u: length = %u", i, vbuf->length);
+		rc = v4l2_ioctl(fd, VIDIOC_QUERYBUF, vbuf);
+		if (rc != 0) error(EXIT_FAILURE, errno, "Can not query %s buffer", name);
+		pr_debug("M2M: Got %s buffer #%u: length = %u", name, i, vbuf->length);
 
-		out_bufs[i].buf = mmap(NULL, vbuf->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, vbuf->m.offset);
-		if (out_bufs[i].buf == MAP_FAILED) error(EXIT_FAILURE, errno, "Can not mmap output buffer");
+		bufs[i].buf = v4l2_mmap(NULL, vbuf->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, vbuf->m.offset);
+		if (bufs[i].buf == MAP_FAILED) error(EXIT_FAILURE, errno, "Can not mmap %s buffer", name);
 	}
 
-	for (int i = 0; i < capreqbuf.count; ++i) {
-		struct v4l2_buffer *vbuf = &cap_bufs[i].v4l2;
-		vbuf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		vbuf->memory = V4L2_MEMORY_MMAP;
-		vbuf->index = i;
-		vbuf->flags = 0;
+	return reqbuf.count;
+}
 
-		rc = ioctl(fd, VIDIOC_QUERYBUF, vbuf);
-		if (rc != 0) error(EXIT_FAILURE, errno, "Can not query capture buffer");
-		pr_debug("M2M: Got capture buffer #%u: length = %u", i, vbuf->length);
+static void m2m_buffers_release(int const fd, enum v4l2_buf_type const type)
+{
+	struct m2m_buffer *const bufs = type == V4L2_BUF_TYPE_VIDEO_OUTPUT ?
+			out_bufs : cap_bufs;
+	int rc;
 
-		cap_bufs[i].buf = mmap(NULL, vbuf->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, vbuf->m.offset);
-		if (cap_bufs[i].buf == MAP_FAILED) error(EXIT_FAILURE, errno, "Can not mmap capture buffer");
+	for (int i = 0; i < MAX_BUFS && bufs[i].buf; i++) {
+		v4l2_munmap(fd, bufs[i].buf, bufs[i].v4l2.length);
+		bufs[i].buf = NULL;
 	}
 
-	for (int i = 0; i < capreqbuf.count; ++i) {
+	struct v4l2_requestbuffers reqbuf = {
+		.count = 0,
+		.type = type,
+		.memory = V4L2_MEMORY_MMAP
+	};
+
+	rc = v4l2_ioctl(fd, VIDIOC_REQBUFS, &reqbuf);
+	if (rc != 0) error(EXIT_FAILURE, errno, "Can not release buffers");
+}
+
+static void m2m_capbufs_queue(int const fd)
+{
+	for (int i = 0; i < MAX_BUFS && cap_bufs[i].buf; ++i) {
 		struct v4l2_buffer buf = {
 			.index = i,
 			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
@@ -195,21 +263,127 @@ static void m2m_buffers_get(int const fd) {
 	}
 }
 
+static void m2m_buffers_get(int const fd, unsigned const num) {
+	pr_verb("M2M: Obtaining buffers...");
+
+	m2m_buffers_request(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, num);
+	m2m_buffers_request(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, num);
+	m2m_capbufs_queue(fd);
+}
+
+static enum write_mode parse_write_mode(char const *const name)
+{
+	for (int i = 0; i < ARRAY_SIZE(write_mode_names); i++)
+		if (strcmp(name, write_mode_names[i]) == 0)
+			return i;
+
+	error(EXIT_FAILURE, 0, "Unknown write mode: %s", name);
+	return WRITE_AUTO;
+}
+
+static int parse_thread_type(char const *const name)
+{
+	for (int i = 0; i < ARRAY_SIZE(thread_types); i++)
+		if (strcmp(name, thread_types[i].name) == 0)
+			return thread_types[i].type;
+
+	error(EXIT_FAILURE, 0, "Unknown decoder threading type: %s", name);
+
+	return 0;
+}
+
+static size_t parse_size(char const *const arg)
+{
+	char *end;
+	size_t size = strtoull(arg, &end, 0);
+
+	switch (*end) {
+		case 'G': size *= 1024; /* fall through */
+		case 'M': size *= 1024; /* fall through */
+		case 'K': size *= 1024; end++;
+	}
+
+	if (*end != '\0')
+		error(EXIT_FAILURE, 0, "Malformed size: %s", arg);
+
+	return size;
+}
+
+/*
+ * Input is checksummed in the cached staging frame, so the device buffer is
+ * not read back. Transformed frame is checksummed in M420 order, the same
+ * bytes as written to the device.
+ */
+static void checksum_input(bool const transform, size_t const size)
+{
+	unsigned const linesize = stage_frame->linesize[0];
+	uint8_t line[linesize];
+
+	if (!transform) {
+		checksum_log_add(&checksums[1], stage_frame->buf[0]->data, size);
+		return;
+	}
+
+	for (size_t i = 0; i < stage_frame->height / 2; i++) {
+		uint8_t const *const cb = &stage_frame->data[1][i * linesize / 2];
+		uint8_t const *const cr = &stage_frame->data[2][i * linesize / 2];
+
+		checksum_log_update(&checksums[1],
+				&stage_frame->data[0][2 * i * linesize], 2 * linesize);
+
+		for (size_t k = 0; k < linesize / 2; k++) {
+			line[2 * k]     = cb[k];
+			line[2 * k + 1] = cr[k];
+		}
+
+		checksum_log_update(&checksums[1], line, linesize);
+	}
+
+	checksum_log_commit(&checksums[1]);
+}
+
 static void queue_outbuf(int const fd, struct SwsContext *dsc, AVFrame * const iframe,
 		bool const transform, unsigned const index)
 {
+	AVFrame *const frame = stage_frame ?: out_bufs[index].frame;
+	struct timespec start;
+
+	/* Latency includes conversion of decoded frame */
+	if (low_latency)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
 	sws_scale(dsc, (uint8_t const * const*)iframe->data,
 			iframe->linesize, 0, iframe->height,
-			out_bufs[index].frame->data,
-			out_bufs[index].frame->linesize);
+			frame->data, frame->linesize);
+
+	if (verify)
+		quality_ref(frame);
+
 	/* Process frame */
-	if (transform)
+	if (stage_frame) {
+		if (transform)
+			yuv420_to_m420_stream(stage_frame, out_bufs[index].frame);
+		else
+			m420_stream_copy(out_bufs[index].buf, stage_frame->buf[0]->data,
+					stage_frame->buf[0]->size);
+	} else if (transform) {
 		yuv420_to_m420(out_bufs[index].frame);
+	}
 
 	out_bufs[index].v4l2.bytesused = out_bufs[index].frame->linesize[0] *
 			out_bufs[index].frame->height * 3 / 2;
+
+	if (checksum_in)
+		checksum_input(transform, out_bufs[index].v4l2.bytesused);
 	out_bufs[index].v4l2.flags = 0;
+	twopass_queue();
 	v4l2_qbuf(fd, &out_bufs[index].v4l2);
+	ratectl_queued();
+
+	if (low_latency)
+		stats_queued_at(start.tv_sec * 1000000ULL + start.tv_nsec / 1000);
+	else
+		stats_queued();
 }
 
 static void dequeue_outbuf(int const fd, unsigned const index)
@@ -219,9 +393,13 @@ static void dequeue_outbuf(int const fd, unsigned const index)
 		error(EXIT_FAILURE, 0, "Error index of buffer.");
 }
 
-static unsigned process_capbuf(int const fd, int const outfd)
+static void stop_handler(int const signo)
+{
+	stop_signal = signo;
+}
+
+static unsigned process_capbuf(int const fd, bool *const last)
 {
-	int rc = 0;
 	struct v4l2_buffer buf = {
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 		.memory = V4L2_MEMORY_MMAP
@@ -230,12 +408,30 @@ static unsigned process_capbuf(int const fd, int const outfd)
 
 	v4l2_dqbuf(fd, &buf);
 	bytesused = buf.bytesused;
-	if (outfd >= 0) {
-		rc = write(outfd, cap_bufs[buf.index].buf, buf.bytesused);
-		if (rc < 0)
-			error(EXIT_FAILURE, errno, "Can not write to output");
-	}
+	*last = buf.flags & V4L2_BUF_FLAG_LAST;
+
+	/* Encoder may return empty buffer marked as last after stop command */
+	if (bytesused == 0 && *last)
+		goto requeue;
+
+	stats_encoded(bytesused);
+	ratectl_encoded(bytesused, buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+	twopass_encoded(bytesused);
+	ladder_encoded(buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+
+	if (verify)
+		quality_packet(cap_bufs[buf.index].buf, buf.bytesused);
 
+	if (checksum_enc)
+		checksum_log_add(&checksums[0], cap_bufs[buf.index].buf, buf.bytesused);
+
+	output_write(cap_bufs[buf.index].buf, buf.bytesused,
+			buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+
+	if (ring && shmring_publish(ring, cap_bufs[buf.index].buf, buf.bytesused, buf.flags))
+		pr_warn("Can not publish frame to ring: %s", strerror(errno));
+
+requeue:
 	buf.flags = 0;
 	buf.bytesused = 0;
 	v4l2_qbuf(fd, &buf);
@@ -243,43 +439,91 @@ static unsigned process_capbuf(int const fd, int const outfd)
 	return bytesused;
 }
 
-static void m2m_process(int const fd, int const outfd, struct SwsContext *dsc,
-		AVFrame * const iframe, bool const transform, unsigned *const encframe,
-		uint64_t *const outsize, unsigned const outn)
+static void m2m_dequeue_events(int const fd, bool *const eos)
+{
+	struct v4l2_event event;
+
+	while (v4l2_dqevent(fd, &event))
+		if (event.type == V4L2_EVENT_EOS) {
+			pr_verb("Encoder signalled end of stream");
+			*eos = true;
+		} else if (event.type == V4L2_EVENT_SOURCE_CHANGE &&
+		           event.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION) {
+			pr_verb("Encoder signalled format change");
+			source_changed = true;
+		}
+}
+
+/*
+ * Processes encoded frames until output buffer outn is returned by device
+ * or, if outn is negative, until a frame is encoded.
+ */
+static void m2m_wait(int const fd, int const outn, unsigned *const encframe,
+		uint64_t *const outsize)
 {
 	int rc = 0;
 	unsigned bytesused = 0;
+	bool last, eos = false;
+	struct pollfd fds[1] = {
+		{ fd, (outn >= 0 ? POLLOUT : 0) | POLLIN | POLLPRI }
+	};
 
-	if (!(out_bufs[outn].v4l2.flags & V4L2_BUF_FLAG_QUEUED)) {
-		queue_outbuf(fd, dsc, iframe, transform, outn);
-	} else {
-		struct pollfd fds[1] = {
-			{ fd, POLLOUT | POLLIN }
-		};
+	while (1) {
+		rc = v4l2_poll(fds, 1, 1000);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			error(EXIT_FAILURE, errno, "Poll error");
+		if (rc == 0)
+			error(EXIT_FAILURE, 0, "Timeout waiting for data...");
 
-		while (1) {
-			rc = poll(fds, 1, 1000);
-			if (rc < 0)
-				error(EXIT_FAILURE, errno, "Poll error");
-			if (rc == 0)
-				error(EXIT_FAILURE, 0, "Timeout waiting for data...");
-
-			if (fds[0].revents & POLLIN) {
-				bytesused = process_capbuf(fd, outfd);
-				*outsize += bytesused;
-				pr_verb("Compressed frame %u (%u bytes)", *encframe, bytesused);
-				*encframe += 1;
-			}
+		if (fds[0].revents & POLLPRI)
+			m2m_dequeue_events(fd, &eos);
 
-			if (fds[0].revents & POLLOUT) {
-				dequeue_outbuf(fd, outn);
-				queue_outbuf(fd, dsc, iframe, transform, outn);
+		if (fds[0].revents & POLLIN) {
+			bytesused = process_capbuf(fd, &last);
+			*outsize += bytesused;
+			pr_verb("Compressed frame %u (%u bytes)", *encframe, bytesused);
+			*encframe += 1;
+
+			if (outn < 0)
 				break;
-			}
+		}
+
+		if (fds[0].revents & POLLOUT) {
+			dequeue_outbuf(fd, outn);
+			break;
 		}
 	}
 }
 
+static void m2m_process(int const fd, struct SwsContext *dsc,
+		AVFrame * const iframe, bool const transform, unsigned *const encframe,
+		uint64_t *const outsize, unsigned const outn)
+{
+	if (out_bufs[outn].v4l2.flags & V4L2_BUF_FLAG_QUEUED)
+		m2m_wait(fd, outn, encframe, outsize);
+
+	queue_outbuf(fd, dsc, iframe, transform, outn);
+
+	/* Encoded frame does not wait for conversion of the next one */
+	if (low_latency)
+		m2m_wait(fd, -1, encframe, outsize);
+}
+
+/*
+ * Buffers beyond depth are left queued when depth decreases. Device returns
+ * output buffers in order, so they are the oldest ones when all buffers
+ * below depth are requeued.
+ */
+static void m2m_retire(int const fd, unsigned *const encframe,
+		uint64_t *const outsize)
+{
+	for (unsigned i = depth; is_valid_out_buf(i); i++)
+		if (out_bufs[i].v4l2.flags & V4L2_BUF_FLAG_QUEUED)
+			m2m_wait(fd, i, encframe, outsize);
+}
+
 static inline struct timespec timespec_subtract(struct timespec const start,
 		struct timespec const stop)
 {
@@ -322,11 +566,308 @@ static inline float timespec2float(struct timespec const t)
 	return t.tv_sec + (float)t.tv_nsec / 1e9;
 }
 
+static uint64_t probe_sum;
+
+__attribute__((noinline))
+static float probe_read(void const *const ptr, size_t const size)
+{
+	uint64_t const *const a = ptr;
+	uint64_t sum = 0;
+	struct timespec start, stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t i = 0; i < size / sizeof(*a); i++)
+		sum += a[i];
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	/* Prevent compiler from optimizing out the loop */
+	probe_sum = sum;
+
+	return timespec2float(timespec_subtract(start, stop));
+}
+
+/*
+ * Compare time of reading output buffer with time of reading malloc()ed
+ * buffer of the same size. The same approach as in devbufbench is used.
+ */
+static enum write_mode probe_write_mode(void)
+{
+	size_t const size = out_bufs[0].v4l2.length;
+	void *const host = malloc(size);
+	if (!host) error(EXIT_FAILURE, 0, "Can not allocate memory for probe buffer");
+
+	memset(host, 0, size);
+	probe_read(host, size);
+
+	float const hosttime = probe_read(host, size);
+	float const devtime = probe_read(out_bufs[0].buf, size);
+
+	free(host);
+
+	pr_verb("Output buffer read is %.1f times slower than host memory read",
+			devtime / hosttime);
+
+	return devtime > 2 * hosttime ? WRITE_STAGED : WRITE_DIRECT;
+}
+
+static void stage_frame_alloc(enum AVPixelFormat const format, int const width,
+		int const height)
+{
+	int const size = av_image_get_buffer_size(format, width, height, 16);
+
+	if (!stage_frame)
+		stage_frame = av_frame_alloc();
+	if (!stage_frame) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	stage_frame->format = format;
+	stage_frame->width = width;
+	stage_frame->height = height;
+
+	/*
+	 * Layout must be the same as of output buffers. On resolution change
+	 * memory is reused in place when possible.
+	 */
+	if (av_buffer_realloc(&stage_frame->buf[0], size) < 0)
+		error(EXIT_FAILURE, 0, "Can not allocate staging buffer");
+
+	av_image_fill_arrays(stage_frame->data, stage_frame->linesize,
+			stage_frame->buf[0]->data, format, width, height, 16);
+}
+
+static void out_frames_setup(enum AVPixelFormat const format, int const width,
+		int const height)
+{
+	for (int i = 0; is_valid_out_buf(i); i++) {
+		AVFrame *frame = out_bufs[i].frame;
+
+		if (!frame)
+			frame = out_bufs[i].frame = av_frame_alloc();
+		if (!frame) error(EXIT_FAILURE, 0, "Not enough memory");
+
+		frame->format = format;
+		frame->width = width;
+		frame->height = height;
+
+		av_image_fill_arrays(frame->data, frame->linesize, out_bufs[i].buf,
+				frame->format, frame->width, frame->height, 16);
+	}
+}
+
+/* Position in input that is kept between loops */
+struct position {
+	unsigned frame, skipped, outn;
+};
+
 static inline bool checklimit(unsigned const value, unsigned const limit)
 {
 	return limit == 0 || value < limit;
 }
 
+static void m2m_drain(int const fd, unsigned *const encframe, unsigned const frames,
+		uint64_t *const outsize)
+{
+	struct pollfd fds[1] = {
+		{ fd, POLLIN | POLLPRI }
+	};
+	unsigned bytesused = 0;
+	bool last = false, eos = false;
+
+	/*
+	 * Encoder finishes all queued frames and marks the last one. Without
+	 * encoder commands support frames in flight are counted, no queued
+	 * frames means nothing to wait for.
+	 */
+	bool const stopped = v4l2_encoder_stop(fd);
+
+	while (stopped ? !last : *encframe < frames) {
+		/* After EOS event all frames are done, only dequeuing is left */
+		int const rc = v4l2_poll(fds, 1, eos ? 0 : 1000);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			error(EXIT_FAILURE, errno, "Poll error");
+		if (rc == 0 && eos)
+			break;
+		if (rc == 0)
+			error(EXIT_FAILURE, 0, "Timeout waiting for encoded frames");
+
+		if (fds[0].revents & POLLPRI)
+			m2m_dequeue_events(fd, &eos);
+
+		if (fds[0].revents & POLLIN) {
+			bytesused = process_capbuf(fd, &last);
+			if (bytesused == 0 && last)
+				break;
+
+			*outsize += bytesused;
+			pr_verb("Compressed frame %u (%u bytes)", *encframe, bytesused);
+			*encframe += 1;
+		}
+	}
+
+	pr_verb("Encoder is drained after %u frames", *encframe);
+}
+
+/*
+ * Formats can be changed only when streaming is stopped, so the encoder is
+ * drained and both queues are stopped. Buffers of a queue are reallocated
+ * only if the driver refuses to change format while they are allocated or
+ * they are too small for the new format, otherwise they are reused as is.
+ * Returns true if buffers are reallocated.
+ */
+static bool m2m_queue_reformat(int const fd, struct v4l2_format *const f)
+{
+	struct m2m_buffer *const bufs = f->type == V4L2_BUF_TYPE_VIDEO_OUTPUT ?
+			out_bufs : cap_bufs;
+	unsigned num = 0;
+	bool realloc = false;
+
+	if (v4l2_try_setformat(fd, f->type, f)) {
+		if (errno != EBUSY)
+			error(EXIT_FAILURE, errno, "Can not set %s format",
+					v4l2_type_name(f->type));
+		realloc = true;
+	}
+
+	for (; num < MAX_BUFS && bufs[num].buf; num++)
+		if (bufs[num].v4l2.length < f->fmt.pix.sizeimage)
+			realloc = true;
+
+	if (realloc) {
+		m2m_buffers_release(fd, f->type);
+		v4l2_setformat(fd, f->type, f);
+		m2m_buffers_request(fd, f->type, num);
+	}
+
+	return realloc;
+}
+
+/*
+ * Starts stopped encoder with new resolution. Without resolution change only
+ * capture format is updated, that is the case of format change signalled by
+ * device. Returns description of buffers reuse for logging.
+ */
+static char const *m2m_restart(int const fd, int const width, int const height)
+{
+	static char desc[64];
+	bool outrealloc = false, caprealloc;
+	AVFrame const *const frame = out_bufs[0].frame;
+
+	source_changed = false;
+
+	if (width != frame->width || height != frame->height) {
+		struct v4l2_format f_src = {
+			.type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+			.fmt = {
+				.pix = {
+					.width = width,
+					.height = height,
+					.pixelformat = V4L2_PIX_FMT_M420,
+					.field = V4L2_FIELD_ANY,
+					.bytesperline = ROUND_UP(width, 16)
+				}
+			}
+		};
+
+		outrealloc = m2m_queue_reformat(fd, &f_src);
+		v4l2_pix_fmt_validate(&f_src.fmt.pix, V4L2_PIX_FMT_M420, width,
+				height, ROUND_UP(width, 16));
+	}
+
+	struct v4l2_format f_dst = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.fmt = {
+			.pix = {
+				.width = width,
+				.height = height,
+				.pixelformat = V4L2_PIX_FMT_H264,
+				.field = V4L2_FIELD_ANY
+			}
+		}
+	};
+
+	caprealloc = m2m_queue_reformat(fd, &f_dst);
+	v4l2_pix_fmt_validate(&f_dst.fmt.pix, V4L2_PIX_FMT_H264, width, height, 0);
+
+	/* Output buffers are returned by stream off */
+	for (int i = 0; is_valid_out_buf(i); i++)
+		out_bufs[i].v4l2.flags = 0;
+
+	out_frames_setup(frame->format, width, height);
+	if (stage_frame)
+		stage_frame_alloc(stage_frame->format, width, height);
+
+	m2m_capbufs_queue(fd);
+
+	v4l2_streamon(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	v4l2_streamon(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+	snprintf(desc, sizeof(desc), "output buffers %s, capture buffers %s",
+			outrealloc ? "reallocated" : "reused",
+			caprealloc ? "reallocated" : "reused");
+
+	return desc;
+}
+
+/* Switch encoder to new resolution in the middle of stream */
+static void m2m_resize(int const fd, int const width,
+		int const height, bool const transform, unsigned *const encframe,
+		unsigned const frames, uint64_t *const outsize)
+{
+	struct timespec start, stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (avico && !transform && width % 16 > 0)
+		error(EXIT_FAILURE, 0, "Width must be multiple of 16 when pixel format is M420");
+
+	if (verify)
+		error(EXIT_FAILURE, 0, "Quality verification does not support resolution change");
+
+	m2m_drain(fd, encframe, frames, outsize);
+
+	v4l2_streamoff(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	v4l2_streamoff(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+	char const *const desc = m2m_restart(fd, width, height);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	pr_info("Switched to %dx%d in %.1f ms: %s", width, height,
+			timespec2float(timespec_subtract(start, stop)) * 1e3, desc);
+}
+
+/*
+ * Encodes frame scaled to width x height, the encoder is restarted if the
+ * size is changed.
+ */
+static void encode_frame(int const m2mfd, struct SwsContext **const dsc,
+		AVFrame *const iframe, int const width, int const height,
+		bool const transform, unsigned *const outn, unsigned *const encframe,
+		unsigned const frame, uint64_t *const outsize)
+{
+	/* Adaptive streams change resolution mid-stream */
+	if (width != out_bufs[0].frame->width ||
+	    height != out_bufs[0].frame->height || source_changed) {
+		m2m_resize(m2mfd, width, height, transform, encframe, frame, outsize);
+		*outn = 0;
+	}
+
+	*dsc = sws_getCachedContext(*dsc, iframe->width, iframe->height,
+			iframe->format, width, height, out_bufs[0].frame->format,
+			SWS_BILINEAR, NULL, NULL, NULL);
+	if (*dsc == NULL) error(EXIT_FAILURE, 0, "Can't allocate output swscale context");
+
+	m2m_process(m2mfd, *dsc, iframe, transform, encframe, outsize, *outn);
+	if (++*outn >= depth || !is_valid_out_buf(*outn)) {
+		m2m_retire(m2mfd, encframe, outsize);
+		depth = autotune_depth(depth);
+		*outn = 0;
+	}
+}
+
 /*
  * Limitations: The next parts work synchronously and can influence
  * each other and overall test performance:
@@ -335,13 +876,13 @@ static inline bool checklimit(unsigned const value, unsigned const limit)
  * - writing of processed (V4L2_BUF_TYPE_VIDEO_CAPTURE) frame
  */
 static unsigned process_stream(AVFormatContext *const ifc,
-		AVCodecContext *const icc, int const stream, struct SwsContext *dsc,
+		AVCodecContext *const icc, int const stream, struct SwsContext **const dsc,
 		unsigned const offset, unsigned const frames, bool const transform,
-		int const m2mfd, int const outfd, unsigned *const encframe,
+		int const m2mfd, struct position *const pos, unsigned *const encframe,
 		uint64_t *const outsize)
 {
 	static int64_t start_pts = 0;
-	static unsigned frame = 0, skipped = 0, outn = 0;
+	unsigned frame = pos->frame, skipped = pos->skipped, outn = pos->outn;
 
 	AVPacket packet;
 	int rc = 0;
@@ -351,23 +892,26 @@ static unsigned process_stream(AVFormatContext *const ifc,
 	if (iframe == NULL)
 		error(EXIT_FAILURE, 0, "Can not allocate memory for input frame");
 
-	while (checklimit(frame, frames)) {
+	while (checklimit(frame, frames) && !stop_signal) {
+		AVPacket *pkt = &packet;
+
 		rc = av_read_frame(ifc, &packet);
 		if (rc == AVERROR_EOF)
-			break; /// \todo Draining
+			pkt = NULL; /* Drain frames delayed by reordering and threads */
 		else if (rc != 0)
 			error(EXIT_FAILURE, 0, "Failed to read next packet: %d", rc);
+		else if (!start_pts)
+			start_pts = packet.pts;
 
-		if (!start_pts) start_pts = packet.pts;
-
-		if (packet.stream_index != stream)
+		if (pkt && packet.stream_index != stream)
 			goto forth;
 
-		rc = avcodec_send_packet(icc, &packet);
+		rc = avcodec_send_packet(icc, pkt);
 		if (rc)
 			error(EXIT_FAILURE, 0, "Failed to send packet to decoder");
 
-		while((rc = avcodec_receive_frame(icc, iframe)) == 0) {
+		while (checklimit(frame, frames) && !stop_signal &&
+		       (rc = avcodec_receive_frame(icc, iframe)) == 0) {
 			pr_verb("Frame is read...");
 
 			if (skipped < offset) {
@@ -376,9 +920,13 @@ static unsigned process_stream(AVFormatContext *const ifc,
 				continue;
 			}
 
-			m2m_process(m2mfd, outfd, dsc, iframe, transform, encframe, outsize, outn);
-			if (!is_valid_out_buf(++outn))
-				outn = 0;
+			/* Renditions are encoded by other processes */
+			if (ladder_enabled())
+				ladder_publish(iframe);
+			else
+				encode_frame(m2mfd, dsc, iframe, iframe->width,
+						iframe->height, transform, &outn, encframe,
+						frame, outsize);
 
 			/*if (ofc) {
 				AVPacket packet = { };
@@ -406,6 +954,12 @@ static unsigned process_stream(AVFormatContext *const ifc,
 		if (rc != 0 && rc != AVERROR(EAGAIN) && rc != AVERROR_EOF)
 			error(EXIT_FAILURE, 0, "Failed to read decoded frame");
 
+		if (!pkt) {
+			/* Decoder is reused after rewinding in the next loop */
+			avcodec_flush_buffers(icc);
+			break;
+		}
+
 forth:
 		// Unref data that was allocated by av_read_frame()
 		av_packet_unref(&packet);
@@ -415,124 +969,74 @@ forth:
 
 	av_frame_free(&iframe);
 
+	pos->frame = frame;
+	pos->skipped = skipped;
+	pos->outn = outn;
+
 	return frame;
 }
 
+/* Encoding settings given by command line */
+struct params {
+	unsigned offset, frames, loops, nbufs;
+	int threads, thread_type;
+	char const *framerate;
+	char const *opfn; //!< Output pixel format name
+	bool transform;
+	enum write_mode write_mode;
+	enum input_mode input_mode;
+	size_t preload;
+	char **ctrls; //!< Arguments of -c options
+	unsigned nctrls;
+	double autotune; //!< Target fraction of peak throughput, 0 is off
+	double bitrate; //!< Target of rate control in kbit/s, 0 is off
+	double vbv; //!< Rate control buffer in ms
+	uint64_t twopass; //!< Target size of two-pass encoding, 0 is off
+};
 
-static void m2m_drain(int const fd, int const outfd, unsigned encframe, unsigned const frames,
-		uint64_t *const outsize)
+static int m2m_open(char const *const device, struct params const *const p)
 {
-	unsigned bytesused = 0;
+	char card[32];
+
+	int const m2mfd = v4l2_open(device, V4L2_CAP_VIDEO_M2M | V4L2_CAP_STREAMING, 0, card);
+	pr_info("Card: %.32s", card);
 
-	while (checklimit(encframe, frames)) {
-		bytesused = process_capbuf(fd, outfd);
-		*outsize += bytesused;
-		pr_verb("Compressed frame %u (%u bytes)", encframe, bytesused);
-		encframe += 1;
+	if (strncmp(card, "vim2m", 32) == 0) {
+		m2m_vim2m_controls(m2mfd);
 	}
-}
 
-#ifndef VERSION
-#define VERSION "unversioned"
-#endif
+	avico = strncmp(card, "avico", 32) == 0;
 
-static void help(const char *program_name) {
-	puts("m2m-test " VERSION " \n");
-	printf("Synopsys: %s -d device [options] file | /dev/videoX\n\n", program_name);
-	puts("Options:");
-	puts("    -d arg    Specify M2M device to use [mandatory]");
-	puts("    -f arg    Output file descriptor number");
-	puts("    -l arg    Loop over input file (-1 means infinitely)");
-	puts("    -n arg    Specify how many frames should be processed");
-	puts("    -o arg    Output file name (takes precedence over -f)");
-	puts("    -p arg    Specify output pixel format for M2M device");
-	puts("    -r arg    When grabbing from camera specify desired framerate");
-	puts("    -s arg    From which frame processing should be started");
-	puts("    -t        Transform video to M420 [Avico-specific]");
-	puts("    -c <ctrl>=<val>    Set the value of the controls [VIDIOC_S_EXT_CTRLS]");
-	puts("    -v        Be more verbose. Can be specified multiple times");
+	/* Controls can be parsed only when their names are known */
+	find_controls(m2mfd, avico_ctrls, ARRAY_SIZE(avico_ctrls));
+	for (unsigned i = 0; i < p->nctrls; i++)
+		parse_ctrl_opts(p->ctrls[i], avico_ctrls, ARRAY_SIZE(avico_ctrls));
+
+	return m2mfd;
 }
 
-int main(int argc, char *argv[]) {
+/*
+ * Opens input and its decoder. Returns index of the video stream.
+ */
+static int decoder_open(char const *const input, struct params const *const p,
+		AVFormatContext **const pifc, AVCodecContext **const picc,
+		AVDictionary **const poptions)
+{
 	AVFormatContext *ifc = NULL; //!< Input format context
-	/* AVFormatContext *ofc = NULL; //!< Output format context */
 	AVInputFormat *ifmt = NULL; //!< Input format
 	AVCodecContext *icc; //!< Input codec context
-	//AVCodecContext *occ; //!< Output codec context
 	AVCodec *ic; //!< Input codec
-	// AVCodec *oc; //!< Output codec
 	AVDictionary *options = NULL;
-	enum AVPixelFormat opf = AV_PIX_FMT_NONE; //!< Output pixel format
-	struct SwsContext *dsc = NULL; //!< Device swscale context
-	struct SwsContext *osc = NULL; //!< Output swscale context
-	AVFrame *oframe = NULL; //!< Output frame
-
-	uint64_t outsize = 0;
-	struct timespec loopstart, loopstop, looptime = { 0 };
-	int rc, opt;
-	int m2mfd, outfd = -1;
-
-	unsigned offset = 0, frames = 0, loops = 1;
-	char *framerate = NULL;
-	bool transform = false;
-
-	char const *output = NULL, *device = NULL;
-	char const *opfn = NULL; //!< Output pixel format name
-
-	av_register_all();
-
-	const char *optstring = "d:f:hl:n:o:p:r:s:tc:v";
-
-	while ((opt = getopt(argc, argv, optstring)) != -1) {
-		switch (opt) {
-			case 'd': device = optarg; break;
-			case 'f': outfd = atoi(optarg); break;
-			case 'h': help(argv[0]); return EXIT_SUCCESS;
-			case 'l': loops = atoi(optarg); break;
-			case 'n': frames = atoi(optarg); break;
-			case 'o': output = optarg; break;
-			case 'p': opfn = optarg; break;
-			case 'r': framerate = optarg; break;
-			case 's': offset = atoi(optarg); break;
-			case 't': transform = true; break;
-			case 'c': /* skip now, parse later */; break;
-			case 'v': vlevel++; break;
-			default: error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
-		}
-	}
-
-	if (argc < optind + 1) error(EXIT_FAILURE, 0, "Not enough arguments");
-	if (device == NULL) error(EXIT_FAILURE, 0, "You must specify device");
-
-	char card[32];
-
-	m2mfd = v4l2_open(device, V4L2_CAP_VIDEO_M2M | V4L2_CAP_STREAMING, 0, card);
-	pr_info("Card: %.32s", card);
-
-	if (strncmp(card, "vim2m", 32) == 0) {
-		m2m_vim2m_controls(m2mfd);
-	}
-
-	find_controls(m2mfd, avico_ctrls, ARRAY_SIZE(avico_ctrls));
-	optind = 0;
-	while ((opt = getopt(argc, argv, optstring)) != -1) {
-		switch (opt) {
-			case 'c':
-				parse_ctrl_opts(optarg, avico_ctrls, ARRAY_SIZE(avico_ctrls));
-				break;
-		}
-	}
-
-	char const *input = argv[optind];
+	int rc;
 
-	if (framerate && ifmt && ifmt->priv_class &&
+	if (p->framerate && ifmt && ifmt->priv_class &&
 			av_opt_find(&ifmt->priv_class, "framerate", NULL, 0, AV_OPT_SEARCH_FAKE_OBJ)) {
-		av_dict_set(&options, "framerate", framerate, 0);
+		av_dict_set(&options, "framerate", p->framerate, 0);
 	}
 
 	// Open video file
-	if (avformat_open_input(&ifc, input, ifmt, &options) < 0)
-		error(EXIT_FAILURE, 0, "Can't open file: %s!", argv[optind]);
+	if (input_open(&ifc, input, ifmt, &options, p->input_mode, p->preload) < 0)
+		error(EXIT_FAILURE, 0, "Can't open file: %s!", input);
 
 	// Retrieve stream information
 	if(avformat_find_stream_info(ifc, NULL) < 0)
@@ -566,13 +1070,159 @@ int main(int argc, char *argv[]) {
 	if (rc)
 		error(EXIT_FAILURE, 0, "Failed to copy codec parameters to decoder context");
 
+	/*
+	 * Decoder feeds the encoder synchronously, so it must not be the
+	 * bottleneck. FFmpeg decodes in a single thread by default.
+	 */
+	icc->thread_count = p->threads;
+	icc->thread_type = p->thread_type;
+
+	/*
+	 * Decoded frame is converted to device buffer before the next one is
+	 * received, so only one frame is held here. Frames delayed by frame
+	 * threads and reordering, thread_count - 1 + has_b_frames, stay in the
+	 * decoder and are added by the pool when it is sized on the first frame.
+	 */
+	frame_pool_init(icc, 1);
+
 	// Open codec
 	if (avcodec_open2(icc, ic, NULL) < 0)
 		error(EXIT_FAILURE, 0, "Could not open codec");
 
-	if (strncmp(card, "avico", 32) == 0 && !transform && icc->width % 16 > 0)
+	pr_info("Decoder: %s, %d threads, %s threading", ic->name, icc->thread_count,
+			icc->active_thread_type == FF_THREAD_FRAME ? "frame" :
+			icc->active_thread_type == FF_THREAD_SLICE ? "slice" : "no");
+
+	/* Frames held by the decoder are drained at the end of the stream */
+	pr_verb("Decoder delay: up to %d frames",
+			(icc->active_thread_type == FF_THREAD_FRAME ?
+			 icc->thread_count - 1 : 0) + icc->has_b_frames);
+
+	*pifc = ifc;
+	*picc = icc;
+	*poptions = options;
+
+	return video_stream_number;
+}
+
+static void decoder_close(AVFormatContext **const ifc, AVCodecContext **const icc,
+		AVDictionary **const options)
+{
+	frame_pool_finish(*icc);
+	avcodec_free_context(icc);
+	input_close(ifc);
+	av_dict_free(options);
+}
+
+/*
+ * Sets the device up for width x height frames. The first call allocates
+ * buffers, the next ones restart the stopped encoder and reuse them.
+ */
+static void m2m_setup(int const m2mfd, int const width, int const height,
+		struct params *const p)
+{
+	enum AVPixelFormat const format = AV_PIX_FMT_YUV420P;
+
+	if (avico && !p->transform && width % 16 > 0)
 		error(EXIT_FAILURE, 0, "Width must be multiple of 16 when pixel format is M420");
 
+	if (is_valid_out_buf(0)) {
+		struct timespec start, stop;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		/* Controls are changed while the encoder is stopped */
+		g_s_ctrls(m2mfd, avico_ctrls, ARRAY_SIZE(avico_ctrls), true);
+		char const *const desc = m2m_restart(m2mfd, width, height);
+
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+
+		pr_info("Restarted at %dx%d in %.1f ms: %s", width, height,
+				timespec2float(timespec_subtract(start, stop)) * 1e3, desc);
+	} else {
+		struct v4l2_format f_src = {
+			.fmt = {
+				.pix = {
+					.width = width,
+					.height = height,
+					.pixelformat = V4L2_PIX_FMT_M420,
+					.field = V4L2_FIELD_ANY,
+					.bytesperline = ROUND_UP(width, 16)
+					/* Default colorspace parameters */
+				}
+			}
+		};
+		struct v4l2_format f_dst = {
+			.fmt = {
+				.pix = {
+					.width = width,
+					.height = height,
+					.pixelformat = V4L2_PIX_FMT_H264,
+					.field = V4L2_FIELD_ANY
+				}
+			}
+		};
+		v4l2_setformat(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &f_src);
+		v4l2_pix_fmt_validate(&f_src.fmt.pix, V4L2_PIX_FMT_M420, width, height, ROUND_UP(width, 16));
+		v4l2_setformat(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE, &f_dst);
+		v4l2_pix_fmt_validate(&f_dst.fmt.pix, V4L2_PIX_FMT_H264, width, height, 0);
+
+		g_s_ctrls(m2mfd, avico_ctrls, ARRAY_SIZE(avico_ctrls), true);
+
+		m2m_buffers_get(m2mfd, p->nbufs);
+
+		v4l2_streamon(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+		v4l2_streamon(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+		v4l2_subscribe_event(m2mfd, V4L2_EVENT_EOS);
+		v4l2_subscribe_event(m2mfd, V4L2_EVENT_SOURCE_CHANGE);
+
+		pr_verb("Allocating AVFrames for obtained buffers...");
+
+		int av_frame_size = av_image_get_buffer_size(format, width, height, 16);
+		for (int i = 0; is_valid_out_buf(i); i++)
+			if (av_frame_size != out_bufs[i].v4l2.length)
+				error(EXIT_FAILURE, 0, "FFmpeg and V4L2 buffer sizes are not equal");
+
+		out_frames_setup(format, width, height);
+
+		/* Input checksums are computed in staging frame */
+		if (p->write_mode == WRITE_AUTO)
+			p->write_mode = checksum_in ? WRITE_STAGED : probe_write_mode();
+
+		pr_info("Output buffer write mode: %s", write_mode_names[p->write_mode]);
+
+		if (p->write_mode == WRITE_STAGED)
+			stage_frame_alloc(format, width, height);
+	}
+}
+
+/*
+ * Encodes input with opened device. The first call sets the device up,
+ * the next ones reuse its buffers and reallocate them only if the input
+ * does not fit. Encoder is drained and stopped at the end. Returns number
+ * of processed frames.
+ */
+static unsigned encode(int const m2mfd, char const *const input,
+		struct params *const p, uint64_t *const outsize)
+{
+	AVFormatContext *ifc = NULL; //!< Input format context
+	/* AVFormatContext *ofc = NULL; //!< Output format context */
+	AVCodecContext *icc; //!< Input codec context
+	//AVCodecContext *occ; //!< Output codec context
+	// AVCodec *oc; //!< Output codec
+	AVDictionary *options = NULL;
+	enum AVPixelFormat opf = AV_PIX_FMT_NONE; //!< Output pixel format
+	struct SwsContext *dsc = NULL; //!< Device swscale context
+	struct SwsContext *osc = NULL; //!< Output swscale context
+	AVFrame *oframe = NULL; //!< Output frame
+
+	struct timespec loopstart, loopstop, looptime = { 0 };
+	struct position pos = { 0 };
+	int rc;
+
+	int const video_stream_number = decoder_open(input, p, &ifc, &icc, &options);
+
 	enum AVPixelFormat format = AV_PIX_FMT_YUV420P;
 
 	//! \brief Device swscale context
@@ -581,7 +1231,7 @@ int main(int argc, char *argv[]) {
 			icc->width, icc->height, format, SWS_BILINEAR, NULL, NULL, NULL);
 	if (dsc == NULL) error(EXIT_FAILURE, 0, "Can't allocate output swscale context");
 
-	if (opfn) opf = av_get_pix_fmt(opfn);
+	if (p->opfn) opf = av_get_pix_fmt(p->opfn);
 	if (opf == AV_PIX_FMT_NONE) opf = format;
 	if (opf != format) osc = sws_getContext(icc->width, icc->height, format,
 			icc->width, icc->height, opf, SWS_BILINEAR, NULL, NULL, NULL);
@@ -598,64 +1248,23 @@ int main(int argc, char *argv[]) {
 		if (rc < 0) error(EXIT_FAILURE, 0, "Can not allocate output frame buffers");
 	}
 
-	struct v4l2_format f_src = {
-		.fmt = {
-			.pix = {
-				.width = icc->width,
-				.height = icc->height,
-				.pixelformat = V4L2_PIX_FMT_M420,
-				.field = V4L2_FIELD_ANY,
-				.bytesperline = ROUND_UP(icc->width, 16)
-				/* Default colorspace parameters */
-			}
-		}
-	};
-	struct v4l2_format f_dst = {
-		.fmt = {
-			.pix = {
-				.width = icc->width,
-				.height = icc->height,
-				.pixelformat = V4L2_PIX_FMT_H264,
-				.field = V4L2_FIELD_ANY
-			}
-		}
-	};
-	v4l2_setformat(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &f_src);
-	v4l2_pix_fmt_validate(&f_src.fmt.pix, V4L2_PIX_FMT_M420, icc->width, icc->height, ROUND_UP(icc->width, 16));
-	v4l2_setformat(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE, &f_dst);
-	v4l2_pix_fmt_validate(&f_dst.fmt.pix, V4L2_PIX_FMT_H264, icc->width, icc->height, 0);
-
-	g_s_ctrls(m2mfd, avico_ctrls, ARRAY_SIZE(avico_ctrls), true);
-
-	m2m_buffers_get(m2mfd);
-
-	v4l2_streamon(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
-	v4l2_streamon(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
-
-	pr_verb("Allocating AVFrames for obtained buffers...");
-
-	int av_frame_size = av_image_get_buffer_size(format, icc->width, icc->height, 16);
-	for (int i = 0; is_valid_out_buf(i); i++)
-		if (av_frame_size != out_bufs[i].v4l2.length)
-			error(EXIT_FAILURE, 0, "FFmpeg and V4L2 buffer sizes are not equal");
-
-	for (int i = 0; is_valid_out_buf(i); i++) {
-		AVFrame *frame = out_bufs[i].frame = av_frame_alloc();
-		if (!frame) error(EXIT_FAILURE, 0, "Not enough memory");
+	m2m_setup(m2mfd, icc->width, icc->height, p);
 
-		frame->format = format;
-		frame->width = icc->width;
-		frame->height = icc->height;
+	if (p->bitrate) {
+		AVRational const rate = ifc->streams[video_stream_number]->avg_frame_rate;
 
-		av_image_fill_arrays(frame->data, frame->linesize, out_bufs[i].buf,
-				frame->format, frame->width, frame->height, 16);
+		/* Raw streams may have no frame rate */
+		ratectl_init(m2mfd, p->bitrate, rate.num && rate.den ? av_q2d(rate) : 25,
+				p->vbv);
 	}
 
-	if (output) {
-		outfd = creat(output, S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
-		if (outfd < 0)
-			error(EXIT_FAILURE, errno, "Can not open output file");
-	}
+	if (p->twopass)
+		twopass_init(m2mfd, p->twopass, p->offset, p->frames);
+
+	if (verify)
+		quality_init(icc->width, icc->height,
+				ifc->streams[video_stream_number]->avg_frame_rate,
+				p->nbufs);
 
 	/* if (output) {
 		avformat_alloc_output_context2(&ofc, NULL, NULL, output);
@@ -689,10 +1298,21 @@ int main(int argc, char *argv[]) {
 
 	unsigned int frame = 0, encframe = 0;
 
+	depth = low_latency ? 1 : MAX_BUFS;
+	if (p->autotune) {
+		unsigned n = 0;
+
+		while (is_valid_out_buf(n))
+			n++;
+
+		depth = autotune_init(n, p->autotune);
+	}
+
 	rc = clock_gettime(CLOCK_MONOTONIC, &loopstart);
 	pr_verb("Begin processing...");
 
-	for (unsigned loop = 0; checklimit(loop, loops) && checklimit(frame, frames); loop++) {
+	for (unsigned loop = 0; checklimit(loop, p->loops) &&
+	     checklimit(frame, p->frames) && !stop_signal; loop++) {
 		pr_verb("Loop #%u", loop);
 
 		if (loop != 0) {
@@ -702,14 +1322,23 @@ int main(int argc, char *argv[]) {
 				error(EXIT_FAILURE, 0, "Can not rewind input file: %d", rc);
 		}
 
-		frame = process_stream(ifc, icc, video_stream_number, dsc, offset,
-				frames, transform, m2mfd, outfd, &encframe, &outsize);
+		frame = process_stream(ifc, icc, video_stream_number, &dsc, p->offset,
+				p->frames, p->transform, m2mfd, &pos, &encframe, outsize);
 	}
 
-	m2m_drain(m2mfd, outfd, encframe, frame, &outsize);
+	if (stop_signal)
+		pr_info("Stopping on signal %d after %u frames", stop_signal, frame);
+
+	m2m_drain(m2mfd, &encframe, frame, outsize);
+	autotune_finish();
+	ratectl_finish();
+	twopass_finish();
 
-	outsize /= 1024;
-	pr_info("Output size: %" PRIu64 " KiB", outsize);
+	/* Next input restarts the encoder */
+	v4l2_streamoff(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	v4l2_streamoff(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+	pr_info("Output size: %" PRIu64 " KiB", *outsize / 1024);
 
 	rc = clock_gettime(CLOCK_MONOTONIC, &loopstop);
 	looptime = timespec_subtract(loopstart, loopstop);
@@ -717,8 +1346,450 @@ int main(int argc, char *argv[]) {
 	pr_info("Total time in main loop: %.1f s (%.1f FPS)",
 			timespec2float(looptime), frame / timespec2float(looptime));
 
-	if (outfd >= 0)
-		close(outfd);
+	decoder_close(&ifc, &icc, &options);
+	sws_freeContext(dsc);
+	sws_freeContext(osc);
+	av_frame_free(&oframe);
+
+	if (verify)
+		quality_finish();
+
+	return frame;
+}
+
+/*
+ * Serves one session of the device: the device is opened and set up once,
+ * controls of the command line are the base for controls of every job.
+ */
+static void job_worker(char const *const device, void *const arg)
+{
+	struct params *const p = arg;
+	struct ctrl base[ARRAY_SIZE(avico_mpeg_ctrls)];
+	struct job const *job;
+
+	int const m2mfd = m2m_open(device, p);
+
+	if (p->autotune || low_latency)
+		stats_init(0, p->nbufs);
+	if (low_latency)
+		realtime_init();
+
+	/* Controls that are not given are reset to values read from device */
+	g_s_ctrls(m2mfd, avico_ctrls, ARRAY_SIZE(avico_ctrls), false);
+	memcpy(base, avico_mpeg_ctrls, sizeof(base));
+	for (unsigned i = 0; i < ARRAY_SIZE(base); i++)
+		base[i].set_value = true;
+
+	while (!stop_signal && (job = jobs_next())) {
+		uint64_t outsize = 0;
+
+		memcpy(avico_mpeg_ctrls, base, sizeof(base));
+		if (job->ctrls) {
+			char *const ctrls = strdup(job->ctrls);
+			if (!ctrls) error(EXIT_FAILURE, 0, "Not enough memory");
+
+			parse_ctrl_opts(ctrls, avico_ctrls, ARRAY_SIZE(avico_ctrls));
+			free(ctrls);
+		}
+
+		output_add(job->output);
+		unsigned const frames = encode(m2mfd, job->input, p, &outsize);
+		output_close();
+
+		/* Interrupted job is left unfinished */
+		if (!stop_signal)
+			jobs_done(frames, outsize);
+	}
+}
+
+/*
+ * Decodes input for renditions of the ladder, they are encoded by other
+ * processes. Returns number of decoded frames.
+ */
+static unsigned decode(char const *const input, struct params *const p)
+{
+	AVFormatContext *ifc = NULL;
+	AVCodecContext *icc;
+	AVDictionary *options = NULL;
+	struct timespec start, stop;
+	struct position pos = { 0 };
+	unsigned frame = 0;
+
+	int const stream = decoder_open(input, p, &ifc, &icc, &options);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (unsigned loop = 0; checklimit(loop, p->loops) &&
+	     checklimit(frame, p->frames) && !stop_signal; loop++) {
+		if (loop != 0 && avformat_seek_file(ifc, stream, 0, 0, 0, AVSEEK_FLAG_FRAME) < 0)
+			error(EXIT_FAILURE, 0, "Can not rewind input file");
+
+		frame = process_stream(ifc, icc, stream, NULL, p->offset, p->frames,
+				p->transform, -1, &pos, NULL, NULL);
+	}
+
+	if (stop_signal)
+		pr_info("Stopping on signal %d after %u frames", stop_signal, frame);
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	pr_info("Decoded %u frames in %.1f s (%.1f FPS)", frame,
+			timespec2float(timespec_subtract(start, stop)),
+			frame / timespec2float(timespec_subtract(start, stop)));
+
+	decoder_close(&ifc, &icc, &options);
+
+	return frame;
+}
+
+/*
+ * Encodes a rendition of the ladder with its own device session, controls
+ * of the rendition are applied over the command line ones.
+ */
+static void rendition_worker(char const *const device,
+		struct rendition const *const r, void *const arg)
+{
+	struct params *const p = arg;
+	struct SwsContext *dsc = NULL;
+	unsigned frame = 0, encframe = 0, outn = 0;
+	uint64_t outsize = 0;
+
+	AVFrame *iframe = av_frame_alloc();
+	if (!iframe) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	int const m2mfd = m2m_open(device, p);
+
+	if (r->ctrls) {
+		char *const ctrls = strdup(r->ctrls);
+		if (!ctrls) error(EXIT_FAILURE, 0, "Not enough memory");
+
+		parse_ctrl_opts(ctrls, avico_ctrls, ARRAY_SIZE(avico_ctrls));
+		free(ctrls);
+	}
+
+	output_add(r->output);
+	m2m_setup(m2mfd, r->width, r->height, p);
+
+	/* Frame is scaled into device buffer before it is released */
+	while (ladder_next(iframe)) {
+		encode_frame(m2mfd, &dsc, iframe, r->width, r->height, p->transform,
+				&outn, &encframe, frame, &outsize);
+		ladder_release();
+		frame++;
+	}
+
+	m2m_drain(m2mfd, &encframe, frame, &outsize);
+
+	v4l2_streamoff(m2mfd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	v4l2_streamoff(m2mfd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+	output_close();
+
+	pr_info("Rendition %dx%d on %s: %" PRIu64 " KiB", r->width, r->height,
+			device, outsize / 1024);
+
+	sws_freeContext(dsc);
+	av_frame_free(&iframe);
+}
+
+#ifndef VERSION
+#define VERSION "unversioned"
+#endif
+
+static void help(const char *program_name) {
+	puts("m2m-test " VERSION " \n");
+	printf("Synopsys: %s -d device [options] file | /dev/videoX\n", program_name);
+	printf("          %s -d device [-d device]... --jobs=manifest [options]\n\n",
+			program_name);
+	puts("Options:");
+	puts("    --autotune[=percent]");
+	puts("              Calibrate number of frames in flight at start: depth is");
+	puts("              increased up to -b while throughput grows, then the");
+	puts("              smallest depth giving percent of peak throughput is used");
+	puts("              for the rest of the run [95]");
+	puts("    -b arg    Number of output and capture buffers [4]");
+	puts("    --bitrate=kbps");
+	puts("              Control QP of I and P frames to encode with kbps kbit/s");
+	puts("              on average, controls set with -c give the initial QP");
+	puts("    --busy-poll");
+	puts("              Spin instead of sleeping while waiting for device");
+	puts("    -d arg    Specify M2M device to use [mandatory], can be given several");
+	puts("              times with --jobs");
+	puts("    -f arg    Output file descriptor number, can be given several times");
+	puts("    -I arg    Input file I/O: default, readahead, direct, mmap or");
+	puts("              preload [readahead]");
+	puts("    -j arg    Number of decoder threads, 0 means auto [0]");
+	puts("    --jobs=manifest");
+	puts("              Encode jobs from manifest file with all devices. Every");
+	puts("              line is a job: input output [controls], where controls");
+	puts("              are given as for -c. Free device sessions take the next");
+	puts("              job and reuse their setup, summary of device");
+	puts("              utilisation is printed at the end with -v");
+	puts("    -k arg    Compare checksums of encoded frames with file");
+	puts("              (file is created if it does not exist)");
+	puts("    -K        Checksum input frames too (use with -k, implies -w staged)");
+	puts("    -l arg    Loop over input file (-1 means infinitely)");
+	puts("    --low-latency");
+	puts("              Keep single frame in flight and take encoded frame");
+	puts("              right away, decode with slice threads only, run with");
+	puts("              realtime priority and report latency from decoded");
+	puts("              frame to bitstream with -v");
+	puts("    --metrics=addr");
+	puts("              Serve statistics counters for Prometheus on UNIX socket");
+	puts("              (unix:path) or TCP socket ([host:]port, 127.0.0.1 by");
+	puts("              default)");
+	puts("    -n arg    Specify how many frames should be processed");
+	puts("    -o arg    Output file name or socket (unix:PATH, tcp:HOST:PORT),");
+	puts("              can be given several times. Slow pipes and sockets do");
+	puts("              not stall encoding, frames are dropped for them instead");
+	puts("    -p arg    Specify output pixel format for M2M device");
+	puts("    --preload[=size]");
+	puts("              Read input (or its first size bytes, K/M/G suffixes");
+	puts("              are accepted) into memory before processing, the same");
+	puts("              as -I preload");
+	puts("    -q        Verify quality of encoded video (PSNR/SSIM)");
+	puts("    -r arg    When grabbing from camera specify desired framerate");
+	puts("    -R arg    Record V4L2 session timing to file, it can be replayed");
+	puts("              later with -d " V4L2_REPLAY_PREFIX "file");
+	puts("    --rendition=WxH:output[:controls]");
+	puts("              Encode input scaled to WxH to output, can be given");
+	puts("              several times to make a bitrate ladder. Input is decoded");
+	puts("              once, every rendition is encoded by its own session of");
+	puts("              the next device of -d with controls given as for -c");
+	puts("    -s arg    From which frame processing should be started");
+	puts("    --sessions=num");
+	puts("              Number of sessions per device with --jobs, while one");
+	puts("              of them prepares a job the others keep device busy [1]");
+	puts("    --shm=name");
+	puts("              Publish encoded frames to shared memory ring for local");
+	puts("              readers, see ring-cat");
+	puts("    --stats-interval=sec");
+	puts("              Print FPS, bitrate, encoder queue occupancy, latency");
+	puts("              percentiles and CPU load every sec seconds");
+	puts("    -t        Transform video to M420 [Avico-specific]");
+	puts("    --two-pass=size");
+	puts("              Encode input file to size bytes (K/M/G suffixes are");
+	puts("              accepted). The first pass analyses complexity of frames");
+	puts("              with -j threads, the second one sets QP per segment and");
+	puts("              places key frames at scene cuts");
+	puts("    -T arg    Decoder threading: auto, frame or slice [auto]");
+	puts("    -c <ctrl>=<val>    Set the value of the controls [VIDIOC_S_EXT_CTRLS]");
+	puts("    -v        Be more verbose. Can be specified multiple times");
+	puts("    --vbv=ms  Size of rate control buffer, bitrate may exceed the");
+	puts("              target for that time [1000]");
+	puts("    -w arg    Output buffer write mode: auto, direct or staged [auto]");
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t outsize = 0;
+	int opt;
+	int m2mfd;
+
+	struct params p = {
+		.loops = 1,
+		.nbufs = NUM_BUFS,
+		.thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE,
+		.write_mode = WRITE_AUTO,
+		.input_mode = INPUT_READAHEAD,
+		.vbv = 1000
+	};
+	double stats_interval = 0;
+	char const *metrics = NULL, *shm = NULL, *manifest = NULL;
+	unsigned sessions = 1;
+
+	char const *devices[MAX_DEVICES];
+	unsigned ndevices = 0;
+	char const *checksum_file = NULL;
+	char const *trace_file = NULL;
+
+	av_register_all();
+
+	const char *optstring = "b:d:f:hI:j:k:Kl:n:o:p:qr:R:s:tT:c:vw:";
+	enum {
+		OPT_PRELOAD = 256, OPT_STATS_INTERVAL, OPT_METRICS, OPT_SHM,
+		OPT_JOBS, OPT_SESSIONS, OPT_AUTOTUNE, OPT_LOW_LATENCY, OPT_BUSY_POLL,
+		OPT_BITRATE, OPT_VBV, OPT_TWO_PASS, OPT_RENDITION
+	};
+	const struct option longopts[] = {
+		{ "preload", optional_argument, NULL, OPT_PRELOAD },
+		{ "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+		{ "metrics", required_argument, NULL, OPT_METRICS },
+		{ "shm", required_argument, NULL, OPT_SHM },
+		{ "jobs", required_argument, NULL, OPT_JOBS },
+		{ "sessions", required_argument, NULL, OPT_SESSIONS },
+		{ "autotune", optional_argument, NULL, OPT_AUTOTUNE },
+		{ "low-latency", no_argument, NULL, OPT_LOW_LATENCY },
+		{ "busy-poll", no_argument, NULL, OPT_BUSY_POLL },
+		{ "bitrate", required_argument, NULL, OPT_BITRATE },
+		{ "vbv", required_argument, NULL, OPT_VBV },
+		{ "two-pass", required_argument, NULL, OPT_TWO_PASS },
+		{ "rendition", required_argument, NULL, OPT_RENDITION },
+		{ NULL }
+	};
+
+	p.ctrls = calloc(argc, sizeof(*p.ctrls));
+	if (!p.ctrls) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
+		switch (opt) {
+			case 'b': p.nbufs = atoi(optarg); break;
+			case 'd':
+				if (ndevices == MAX_DEVICES)
+					error(EXIT_FAILURE, 0, "At most %u devices are supported",
+							MAX_DEVICES);
+				devices[ndevices++] = optarg;
+				break;
+			case 'f': output_add_fd(atoi(optarg)); break;
+			case 'h': help(argv[0]); return EXIT_SUCCESS;
+			case 'I': p.input_mode = input_mode_parse(optarg); break;
+			case 'j': p.threads = atoi(optarg); break;
+			case 'k': checksum_file = optarg; break;
+			case 'K': checksum_in = true; break;
+			case 'l': p.loops = atoi(optarg); break;
+			case 'n': p.frames = atoi(optarg); break;
+			case 'o': output_add(optarg); break;
+			case 'p': p.opfn = optarg; break;
+			case 'q': verify = true; break;
+			case 'r': p.framerate = optarg; break;
+			case 'R': trace_file = optarg; break;
+			case 's': p.offset = atoi(optarg); break;
+			case 't': p.transform = true; break;
+			case 'T': p.thread_type = parse_thread_type(optarg); break;
+			case 'c': p.ctrls[p.nctrls++] = optarg; break;
+			case 'v': vlevel++; break;
+			case 'w': p.write_mode = parse_write_mode(optarg); break;
+			case OPT_PRELOAD:
+				p.input_mode = INPUT_PRELOAD;
+				p.preload = optarg ? parse_size(optarg) : 0;
+				break;
+			case OPT_STATS_INTERVAL: stats_interval = stats_parse_interval(optarg); break;
+			case OPT_METRICS: metrics = optarg; break;
+			case OPT_SHM: shm = optarg; break;
+			case OPT_JOBS: manifest = optarg; break;
+			case OPT_SESSIONS: sessions = atoi(optarg); break;
+			case OPT_AUTOTUNE:
+				p.autotune = optarg ? atof(optarg) / 100 : 0.95;
+				if (p.autotune <= 0 || p.autotune > 1)
+					error(EXIT_FAILURE, 0, "Autotune target must be from 0 to 100%%");
+				break;
+			case OPT_LOW_LATENCY: low_latency = true; break;
+			case OPT_BUSY_POLL: v4l2_set_busy_poll(true); break;
+			case OPT_BITRATE: p.bitrate = atof(optarg); break;
+			case OPT_VBV: p.vbv = atof(optarg); break;
+			case OPT_TWO_PASS: p.twopass = parse_size(optarg); break;
+			case OPT_RENDITION: ladder_add(optarg); break;
+			default: error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
+		}
+	}
+
+	if (argc < optind + (manifest ? 0 : 1)) error(EXIT_FAILURE, 0, "Not enough arguments");
+	if (ndevices == 0) error(EXIT_FAILURE, 0, "You must specify device");
+	if (ndevices > 1 && !manifest && !ladder_enabled())
+		error(EXIT_FAILURE, 0, "Several devices can be used with --jobs and "
+				"--rendition only");
+	if (sessions == 0)
+		error(EXIT_FAILURE, 0, "Number of sessions must be positive");
+	if (p.nbufs == 0 || p.nbufs > MAX_BUFS)
+		error(EXIT_FAILURE, 0, "Number of buffers must be from 1 to %u", MAX_BUFS);
+	if (checksum_in && !checksum_file)
+		error(EXIT_FAILURE, 0, "Checksum file must be specified with -K");
+	if (checksum_in && p.write_mode == WRITE_DIRECT)
+		error(EXIT_FAILURE, 0, "Input checksums need staged write mode");
+	if (p.bitrate < 0 || p.vbv <= 0)
+		error(EXIT_FAILURE, 0, "Bitrate and VBV size must be positive");
+
+	/* Workers run in parallel, so per-session facilities are not shared */
+	if (manifest && (output_enabled() || checksum_file || verify || trace_file ||
+	    stats_interval || metrics || shm))
+		error(EXIT_FAILURE, 0, "Options -f, -o, -k, -q, -R, --metrics, --shm "
+				"and --stats-interval can not be used with --jobs");
+
+	/* Work on the frame path that does not produce the stream is skipped */
+	if (low_latency && (p.autotune || verify || checksum_file))
+		error(EXIT_FAILURE, 0, "Options --autotune, -q and -k can not be used "
+				"with --low-latency");
+
+	/* Encoding facilities of the main process are not used by renditions */
+	if (ladder_enabled() && (manifest || output_enabled() || checksum_file ||
+	    verify || trace_file || stats_interval || metrics || shm || p.twopass ||
+	    p.bitrate || p.autotune || low_latency))
+		error(EXIT_FAILURE, 0, "Options --jobs, -f, -o, -k, -q, -R, --metrics, "
+				"--shm, --stats-interval, --two-pass, --bitrate, --autotune "
+				"and --low-latency can not be used with --rendition");
+
+	/* Plan covers a single pass over one input */
+	if (p.twopass && (manifest || p.loops != 1 || p.bitrate || low_latency))
+		error(EXIT_FAILURE, 0, "Option --two-pass can not be used with --jobs, "
+				"-l, --bitrate and --low-latency");
+
+	/* Frame threading holds frames in decoder */
+	if (low_latency)
+		p.thread_type = FF_THREAD_SLICE;
+
+	checksum_enc = checksum_file != NULL;
+
+	if (trace_file)
+		v4l2_trace_open(trace_file);
+
+	/* The second signal terminates immediately */
+	struct sigaction sa = {
+		.sa_handler = stop_handler,
+		.sa_flags = SA_RESETHAND
+	};
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (manifest) {
+		jobs_load(manifest);
+		return jobs_run(devices, ndevices, sessions, job_worker, &p) ?
+				EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (ladder_enabled()) {
+		ladder_init(devices, ndevices, rendition_worker, &p);
+		decode(argv[optind], &p);
+		return ladder_finish() ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (p.twopass)
+		twopass_analyse(argv[optind], p.threads);
+
+	m2mfd = m2m_open(devices[0], &p);
+
+	if (shm) {
+		ring = shmring_create(shm, SHMRING_DEFAULT_SIZE);
+		if (!ring)
+			error(EXIT_FAILURE, errno, "Can not create shared memory ring %s", shm);
+	}
+
+	/* Autotune and latency report use statistics counters */
+	if (stats_interval || metrics || p.autotune || low_latency)
+		stats_init(stats_interval, p.nbufs);
+	if (metrics)
+		metrics_init(metrics);
+	if (low_latency)
+		realtime_init();
+
+	encode(m2mfd, argv[optind], &p, &outsize);
+
+	if (low_latency)
+		stats_latency_summary("Frame-to-bitstream");
+
+	stats_finish();
+	metrics_finish();
+
+	if (ring)
+		shmring_destroy(ring);
+
+	/* Interrupted run would be reported as mismatch or saved as reference */
+	if (checksum_file && stop_signal)
+		pr_warn("Checksums are not compared for interrupted run");
+	else if (checksum_file &&
+	    checksum_log_compare(checksum_file, checksums, checksum_in ? 2 : 1))
+		return EXIT_FAILURE;
+
+	output_close();
 
 	return EXIT_SUCCESS;
 }
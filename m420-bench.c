@@ -0,0 +1,276 @@
+/*
+ * Microbenchmark of YUV420 to M420 conversion implementations
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <error.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+
+#include "m420.h"
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define NSEC_IN_SEC 1000000000
+
+/* Buffer used to evict frames from caches, must be larger than LLC */
+#define FLUSH_SIZE (64 * 1024 * 1024)
+
+#ifndef VERSION
+#define VERSION "unversioned"
+#endif
+
+/*
+ * Reference implementation. It is the original conversion loop built
+ * without vectorization, so other implementations are checked against
+ * straightforward scalar code.
+ */
+__attribute__((optimize("no-tree-vectorize")))
+static void reference(AVFrame *src, AVFrame *dst)
+{
+	unsigned const linesize = src->linesize[0], height = src->height;
+	uint8_t *out = dst->data[0];
+
+	for (size_t i = 0; i < height; i += 2) {
+		memcpy(out, &src->data[0][i * linesize], 2 * linesize);
+		out += 2 * linesize;
+
+		for (size_t k = 0; k < linesize / 2; k++) {
+			out[2 * k]     = src->data[1][i / 2 * linesize / 2 + k];
+			out[2 * k + 1] = src->data[2][i / 2 * linesize / 2 + k];
+		}
+		out += linesize;
+	}
+}
+
+static void generic(AVFrame *src, AVFrame *dst)
+{
+	yuv420_to_m420_generic(src);
+}
+
+static void dispatched(AVFrame *src, AVFrame *dst)
+{
+	yuv420_to_m420(src);
+}
+
+static void stream(AVFrame *src, AVFrame *dst)
+{
+	yuv420_to_m420_stream(src, dst);
+}
+
+static const struct impl {
+	char const *name;
+	void (*convert)(AVFrame *src, AVFrame *dst);
+	bool inplace; //!< Result is in src
+} impls[] = {
+	{ "reference",  reference,  false },
+	{ "generic",    generic,    true },
+	{ "dispatched", dispatched, true },
+	{ "stream",     stream,     false }
+};
+
+static const struct resolution {
+	unsigned width, height;
+} resolutions[] = {
+	{ 720, 576 },
+	{ 1280, 720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 }
+};
+
+static uint8_t *flushbuf;
+
+static void flush_caches(void)
+{
+	for (size_t i = 0; i < FLUSH_SIZE; i += 64)
+		flushbuf[i]++;
+}
+
+static void frame_alloc(AVFrame *frame, unsigned const width, unsigned const height)
+{
+	unsigned const linesize = (width + 15) & ~15;
+	size_t const size = linesize * height * 3 / 2;
+	uint8_t *buf;
+
+	int rc = posix_memalign((void **)&buf, 64, size);
+	if (rc) error(EXIT_FAILURE, rc, "Can not allocate frame");
+
+	memset(frame, 0, sizeof(*frame));
+	frame->width = width;
+	frame->height = height;
+	frame->format = AV_PIX_FMT_YUV420P;
+	frame->linesize[0] = linesize;
+	frame->linesize[1] = frame->linesize[2] = linesize / 2;
+	frame->data[0] = buf;
+	frame->data[1] = buf + linesize * height;
+	frame->data[2] = buf + linesize * height * 5 / 4;
+}
+
+static size_t frame_size(AVFrame const *frame)
+{
+	return frame->linesize[0] * frame->height * 3 / 2;
+}
+
+static void frame_fill(AVFrame *frame)
+{
+	srand(frame->width * frame->height);
+
+	for (size_t i = 0; i < frame_size(frame); i++)
+		frame->data[0][i] = rand();
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		error(EXIT_FAILURE, errno, "Failed to get time");
+
+	return ts.tv_sec + (double)ts.tv_nsec / NSEC_IN_SEC;
+}
+
+static bool verify(struct impl const *const impl, AVFrame *src, AVFrame *dst,
+		uint8_t const *expected)
+{
+	frame_fill(src);
+	memset(dst->data[0], 0, frame_size(dst));
+
+	impl->convert(src, dst);
+
+	return memcmp(impl->inplace ? src->data[0] : dst->data[0], expected,
+			frame_size(src)) == 0;
+}
+
+static double measure(struct impl const *const impl, AVFrame *src, AVFrame *dst,
+		unsigned const num, bool const cold)
+{
+	double total = 0;
+
+	/* Warm up buffers and conversion kernel */
+	impl->convert(src, dst);
+
+	for (unsigned i = 0; i < num; i++) {
+		if (cold)
+			flush_caches();
+
+		double const start = now();
+		impl->convert(src, dst);
+		total += now() - start;
+	}
+
+	return total / num;
+}
+
+static void help(const char *program_name)
+{
+	puts("m420-bench " VERSION " \n");
+	printf("Synopsis: %s [options]\n\n", program_name);
+	puts("Options:");
+	puts("    -c        Measure with cold caches only");
+	puts("    -h        Print help message");
+	puts("    -i arg    Run only specified implementation");
+	puts("    -n arg    Number of iterations [20]");
+	puts("    -s arg    Frame size, e.g. 1920x1080 [standard resolutions]");
+	puts("    -w        Measure with warm caches only");
+	fputs("\nImplementations: ", stdout);
+
+	for (int i = 0; i < ARRAY_SIZE(impls); i++)
+		printf("%s ", impls[i].name);
+	puts("");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	unsigned num = 20;
+	bool cold = true, warm = true, failed = false;
+	char const *only = NULL;
+	struct resolution custom = { 0 };
+
+	while ((opt = getopt(argc, argv, "chi:n:s:w")) != -1) {
+		switch (opt) {
+			case 'c': warm = false; break;
+			case 'h': help(argv[0]); return EXIT_SUCCESS;
+			case 'i': only = optarg; break;
+			case 'n': num = atoi(optarg); break;
+			case 's':
+				if (sscanf(optarg, "%ux%u", &custom.width, &custom.height) != 2 ||
+				    custom.width == 0 || custom.height % 2)
+					error(EXIT_FAILURE, 0, "Malformed argument: %s", optarg);
+				break;
+			case 'w': cold = false; break;
+			default: error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
+		}
+	}
+
+	if (num == 0)
+		error(EXIT_FAILURE, 0, "Number of iterations must be positive");
+
+	flushbuf = calloc(1, FLUSH_SIZE);
+	if (!flushbuf) error(EXIT_FAILURE, 0, "Can not allocate memory");
+
+	printf("%-10s %-10s %-5s %14s %11s %s\n", "Size", "Impl", "Cache",
+			"Time", "Bandwidth", "Exact");
+
+	for (int r = 0; r < ARRAY_SIZE(resolutions); r++) {
+		struct resolution const *const res = custom.width ? &custom : &resolutions[r];
+		AVFrame src, dst;
+		char size[16];
+
+		frame_alloc(&src, res->width, res->height);
+		frame_alloc(&dst, res->width, res->height);
+		snprintf(size, sizeof(size), "%ux%u", res->width, res->height);
+
+		uint8_t *const expected = malloc(frame_size(&src));
+		if (!expected) error(EXIT_FAILURE, 0, "Can not allocate memory");
+
+		frame_fill(&src);
+		reference(&src, &dst);
+		memcpy(expected, dst.data[0], frame_size(&dst));
+
+		for (int i = 0; i < ARRAY_SIZE(impls); i++) {
+			struct impl const *const impl = &impls[i];
+
+			if (only && strcmp(only, impl->name) != 0)
+				continue;
+
+			bool const exact = verify(impl, &src, &dst, expected);
+			failed |= !exact;
+
+			for (int c = 0; c < 2; c++) {
+				if ((c == 0 && !warm) || (c == 1 && !cold))
+					continue;
+
+				double const t = measure(impl, &src, &dst, num, c == 1);
+
+				printf("%-10s %-10s %-5s %5.3f ns/pixel %6.2f GB/s %s\n",
+						size, impl->name, c ? "cold" : "warm",
+						t * NSEC_IN_SEC / (res->width * res->height),
+						frame_size(&src) / t / 1e9,
+						exact ? "ok" : "MISMATCH");
+			}
+		}
+
+		free(expected);
+		free(src.data[0]);
+		free(dst.data[0]);
+
+		if (custom.width)
+			break;
+	}
+
+	free(flushbuf);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
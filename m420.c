@@ -4,27 +4,81 @@
  * SPDX-License-Identifier:	GPL-2.0
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <error.h>
 
 #include <libavformat/avformat.h>
 
-void yuv420_to_m420(AVFrame *frame) {
-	unsigned const linesize = frame->linesize[0], height = frame->height;
-	uint8_t *temp = malloc(linesize * height * 3 / 2);
-	if (!temp) error(EXIT_FAILURE, 0, "Can not allocate memory for convertion buffer");
+#include "m420.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#if defined(__GNUC__) && __GNUC__ >= 8
+#define M420_UNROLL _Pragma("GCC unroll 8")
+#else
+#define M420_UNROLL
+#endif
+
+/*
+ * Conversion buffer is kept between calls to avoid mmap()/munmap() and page
+ * faults for every frame. It is thread-local, so conversion of different
+ * frames can run in parallel.
+ */
+static __thread uint8_t *m420_temp;
+static __thread size_t m420_temp_size;
+
+static uint8_t *m420_temp_get(size_t const size)
+{
+	if (size > m420_temp_size) {
+		free(m420_temp);
+		m420_temp = malloc(size);
+		if (!m420_temp)
+			error(EXIT_FAILURE, 0, "Can not allocate memory for convertion buffer");
+		m420_temp_size = size;
+	}
+
+	return m420_temp;
+}
+
+/*
+ * Conversion body. When it is inlined with constant linesize and height
+ * the compiler knows all loop bounds, so the luma copies become fixed-size
+ * moves and the chroma loop is vectorized without remainder handling.
+ * Aligned variant may be used only if all planes and linesize are aligned
+ * by 16 bytes.
+ */
+static inline __attribute__((always_inline))
+void m420_convert(AVFrame *frame, unsigned const linesize, unsigned const height,
+		bool const aligned)
+{
+	uint8_t *const temp = m420_temp_get(linesize * height * 3 / 2);
+	uint8_t *luma = frame->data[0], *cb = frame->data[1], *cr = frame->data[2];
+
+	if (aligned) {
+		luma = __builtin_assume_aligned(luma, 16);
+		cb = __builtin_assume_aligned(cb, 16);
+		cr = __builtin_assume_aligned(cr, 16);
+	}
 
 	// Luma
 	for (size_t i = 0, j = 0; i < height; i += 2, j += 3) {
-		memcpy(temp + j * linesize, &frame->data[0][i * linesize], 2 * linesize);
+		memcpy(temp + j * linesize, &luma[i * linesize], 2 * linesize);
 	}
 
 	// Chroma
 	for (size_t i = 0, j = 2; i < height / 2; i++, j += 3) {
 		uint8_t *const out = &temp[j * linesize];
-		uint8_t *const incb = &frame->data[1][i * linesize / 2];
-		uint8_t *const incr = &frame->data[2][i * linesize / 2];
+		uint8_t const *const incb = &cb[i * linesize / 2];
+		uint8_t const *const incr = &cr[i * linesize / 2];
 
+		M420_UNROLL
 		for (size_t k = 0; k < linesize / 2; k++) {
 			out[2 * k]     = incb[k];
 			out[2 * k + 1] = incr[k];
@@ -34,6 +88,177 @@ void yuv420_to_m420(AVFrame *frame) {
 	memcpy(frame->data[0], temp, linesize * height);
 	memcpy(frame->data[1], temp + linesize * height, linesize * height / 4);
 	memcpy(frame->data[2], temp + linesize * height + linesize * height / 4, linesize * height / 4);
+}
+
+#define M420_KERNEL(w, h) \
+	static void yuv420_to_m420_##w##x##h(AVFrame *frame) \
+	{ \
+		m420_convert(frame, w, h, true); \
+	}
+
+M420_KERNEL(1280, 720)
+M420_KERNEL(1920, 1080)
+M420_KERNEL(3840, 2160)
+
+static const struct m420_kernel {
+	unsigned linesize;
+	unsigned height;
+	void (*convert)(AVFrame *frame);
+} m420_kernels[] = {
+	{ 1280,  720, yuv420_to_m420_1280x720 },
+	{ 1920, 1080, yuv420_to_m420_1920x1080 },
+	{ 3840, 2160, yuv420_to_m420_3840x2160 }
+};
+
+static inline bool m420_aligned(AVFrame const *frame)
+{
+	return (((uintptr_t)frame->data[0] | (uintptr_t)frame->data[1] |
+		 (uintptr_t)frame->data[2] | frame->linesize[0]) & 15) == 0;
+}
+
+void yuv420_to_m420_generic(AVFrame *frame)
+{
+	m420_convert(frame, frame->linesize[0], frame->height, false);
+}
+
+void yuv420_to_m420(AVFrame *frame)
+{
+	if (m420_aligned(frame))
+		for (int i = 0; i < ARRAY_SIZE(m420_kernels); i++)
+			if (m420_kernels[i].linesize == frame->linesize[0] &&
+			    m420_kernels[i].height == frame->height) {
+				m420_kernels[i].convert(frame);
+				return;
+			}
+
+	yuv420_to_m420_generic(frame);
+}
+
+/*
+ * Streaming output for write-combined or uncached device buffers. Source
+ * is read from cached memory only and destination is written strictly
+ * sequentially. Bytes up to the first cache line boundary are written as
+ * is, the rest is written by whole aligned cache lines, so every line is
+ * flushed from write-combining buffers at once. On x86 non-temporal stores
+ * are used, so destination lines are not read for ownership.
+ */
+#define M420_LINE 64
+
+static inline void m420_store_line(uint8_t *dst, uint8_t const *src)
+{
+#if defined(__SSE2__)
+	__m128i *const d = (__m128i *)dst;
+	__m128i const *const s = (__m128i const *)src;
+
+	_mm_stream_si128(d + 0, _mm_loadu_si128(s + 0));
+	_mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+	_mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+	_mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
+#else
+	memcpy(dst, src, M420_LINE);
+#endif
+}
+
+static inline void m420_store_done(void)
+{
+#if defined(__SSE2__)
+	_mm_sfence();
+#endif
+}
+
+/* Returns number of bytes before the first cache line boundary of dst */
+static inline size_t m420_line_head(void const *dst, size_t const size)
+{
+	size_t const head = -(uintptr_t)dst & (M420_LINE - 1);
+
+	return head < size ? head : size;
+}
+
+static void m420_stream_row(uint8_t *dst, uint8_t const *src, size_t const size)
+{
+	size_t i = m420_line_head(dst, size);
+
+	memcpy(dst, src, i);
+
+	for (; i + M420_LINE <= size; i += M420_LINE)
+		m420_store_line(dst + i, src + i);
+
+	memcpy(dst + i, src + i, size - i);
+}
+
+static inline void m420_store_chroma(uint8_t *dst, uint8_t const *cb,
+		uint8_t const *cr, size_t i, size_t const end)
+{
+	for (; i < end; i += 2) {
+		dst[i]     = cb[i / 2];
+		dst[i + 1] = cr[i / 2];
+	}
+}
+
+static void m420_stream_chroma(uint8_t *dst, uint8_t const *cb, uint8_t const *cr,
+		size_t const size)
+{
+	size_t const head = m420_line_head(dst, size);
+	size_t i = 0;
+
+	/* Pair of chroma samples can not be split at line boundary */
+	if (head % 2 == 0) {
+		m420_store_chroma(dst, cb, cr, 0, head);
+
+		for (i = head; i + M420_LINE <= size; i += M420_LINE) {
+			uint8_t const *const b = cb + i / 2, *const r = cr + i / 2;
+#if defined(__SSE2__)
+			__m128i *const d = (__m128i *)(dst + i);
+			__m128i const b0 = _mm_loadu_si128((__m128i const *)b);
+			__m128i const b1 = _mm_loadu_si128((__m128i const *)b + 1);
+			__m128i const r0 = _mm_loadu_si128((__m128i const *)r);
+			__m128i const r1 = _mm_loadu_si128((__m128i const *)r + 1);
+
+			_mm_stream_si128(d + 0, _mm_unpacklo_epi8(b0, r0));
+			_mm_stream_si128(d + 1, _mm_unpackhi_epi8(b0, r0));
+			_mm_stream_si128(d + 2, _mm_unpacklo_epi8(b1, r1));
+			_mm_stream_si128(d + 3, _mm_unpackhi_epi8(b1, r1));
+#elif defined(__ARM_NEON)
+			uint8x16x2_t const v0 = { { vld1q_u8(b), vld1q_u8(r) } };
+			uint8x16x2_t const v1 = { { vld1q_u8(b + 16), vld1q_u8(r + 16) } };
+
+			vst2q_u8(dst + i, v0);
+			vst2q_u8(dst + i + 32, v1);
+#else
+			uint8_t line[M420_LINE];
+
+			for (size_t k = 0; k < M420_LINE / 2; k++) {
+				line[2 * k]     = b[k];
+				line[2 * k + 1] = r[k];
+			}
+
+			m420_store_line(dst + i, line);
+#endif
+		}
+	}
+
+	m420_store_chroma(dst, cb, cr, i, size);
+}
+
+void m420_stream_copy(void *dst, void const *src, size_t const size)
+{
+	m420_stream_row(dst, src, size);
+	m420_store_done();
+}
+
+void yuv420_to_m420_stream(AVFrame const *src, AVFrame *dst)
+{
+	unsigned const linesize = src->linesize[0], height = src->height;
+	uint8_t *out = dst->data[0];
+
+	for (size_t i = 0; i < height / 2; i++) {
+		m420_stream_row(out, &src->data[0][2 * i * linesize], 2 * linesize);
+		out += 2 * linesize;
+
+		m420_stream_chroma(out, &src->data[1][i * linesize / 2],
+				&src->data[2][i * linesize / 2], linesize);
+		out += linesize;
+	}
 
-	free(temp);
+	m420_store_done();
 }
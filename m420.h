@@ -9,6 +9,16 @@
 
 #include <libavformat/avformat.h>
 
+/* Converts frame in place. Uses kernel specialized for frame size if any. */
 void yuv420_to_m420(AVFrame *frame);
+/* Converts frame in place without size specialization */
+void yuv420_to_m420_generic(AVFrame *frame);
+
+/*
+ * Functions for write-combined or uncached destination. They never read
+ * destination and write it sequentially by whole cache lines.
+ */
+void yuv420_to_m420_stream(AVFrame const *src, AVFrame *dst);
+void m420_stream_copy(void *dst, void const *src, size_t const size);
 
 #endif /* M420_H */
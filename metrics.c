@@ -0,0 +1,283 @@
+/*
+ * Metrics HTTP endpoint implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#define _GNU_SOURCE /* accept4() */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "stats.h"
+
+/* Client must send request in time, it must not stall the server */
+#define METRICS_TIMEOUT_MS 1000
+
+#define METRICS_REQUEST_SIZE 1024
+
+static pthread_t thread;
+static int listenfd = -1;
+static int wakefd[2] = { -1, -1 }; //!< Pipe to wake server on finish
+static char const *sockpath; //!< Path of UNIX socket to remove on finish
+
+static void metrics_socket(char const *const address)
+{
+	int rc;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un sa = { .sun_family = AF_UNIX };
+		struct stat st;
+
+		sockpath = address + 5;
+		if (strlen(sockpath) >= sizeof(sa.sun_path))
+			error(EXIT_FAILURE, 0, "Metrics: Socket path is too long: %s", sockpath);
+		strcpy(sa.sun_path, sockpath);
+
+		/* Remove socket left by previous run, but no other files */
+		if (stat(sockpath, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(sockpath);
+
+		listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listenfd < 0) error(EXIT_FAILURE, errno, "Metrics: Can not create socket");
+
+		rc = bind(listenfd, (struct sockaddr *)&sa, sizeof(sa));
+	} else {
+		struct sockaddr_in sa = {
+			.sin_family = AF_INET,
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+		};
+		char const *port = strrchr(address, ':');
+		char host[INET_ADDRSTRLEN];
+		char *end;
+		int const one = 1;
+
+		if (port) {
+			if (port - address >= sizeof(host))
+				error(EXIT_FAILURE, 0, "Metrics: Malformed address: %s", address);
+			memcpy(host, address, port - address);
+			host[port - address] = '\0';
+			if (inet_pton(AF_INET, host, &sa.sin_addr) != 1)
+				error(EXIT_FAILURE, 0, "Metrics: Malformed address: %s", address);
+			port++;
+		} else {
+			port = address;
+		}
+
+		unsigned long const num = strtoul(port, &end, 10);
+		if (*end != '\0' || num == 0 || num > UINT16_MAX)
+			error(EXIT_FAILURE, 0, "Metrics: Malformed port: %s", port);
+		sa.sin_port = htons(num);
+
+		listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listenfd < 0) error(EXIT_FAILURE, errno, "Metrics: Can not create socket");
+
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		rc = bind(listenfd, (struct sockaddr *)&sa, sizeof(sa));
+	}
+
+	if (rc) error(EXIT_FAILURE, errno, "Metrics: Can not bind to %s", address);
+
+	if (listen(listenfd, 4))
+		error(EXIT_FAILURE, errno, "Metrics: Can not listen on %s", address);
+}
+
+static void print_counter(FILE *const f, char const *const name,
+		char const *const help, uint64_t const value)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n",
+			name, help, name, name, value);
+}
+
+static void print_gauge(FILE *const f, char const *const name,
+		char const *const help, uint64_t const value)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %" PRIu64 "\n",
+			name, help, name, name, value);
+}
+
+static char *exposition(size_t *const size)
+{
+	struct stats_counters c;
+	char *text = NULL;
+	uint64_t count = 0;
+
+	FILE *const f = open_memstream(&text, size);
+	if (!f) error(EXIT_FAILURE, errno, "Metrics: Not enough memory");
+
+	stats_read(&c);
+
+	print_counter(f, "m2m_frames_queued_total",
+			"Frames queued to encoder", c.queued);
+	print_counter(f, "m2m_frames_encoded_total",
+			"Frames returned by encoder", c.encoded);
+	print_counter(f, "m2m_frames_dropped_total",
+			"Frames lost before encoder", c.dropped);
+	print_counter(f, "m2m_bytes_written_total",
+			"Bytes of encoded stream", c.bytes);
+	print_gauge(f, "m2m_queue_depth",
+			"Frames in encoder", c.queued - c.encoded);
+	print_gauge(f, "m2m_queue_size",
+			"Encoder buffers", stats_depth());
+
+	/* Buckets are coarsened to powers of two */
+	fputs("# HELP m2m_encode_latency_seconds Time from queuing frame to "
+			"dequeuing encoded data\n"
+			"# TYPE m2m_encode_latency_seconds histogram\n", f);
+
+	for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+		count += c.latency[b];
+		if (b % STATS_SUBBUCKETS == STATS_SUBBUCKETS - 1)
+			fprintf(f, "m2m_encode_latency_seconds_bucket{le=\"%g\"} %" PRIu64 "\n",
+					(stats_bucket_value(b) + 1) / 1e6, count);
+	}
+
+	fprintf(f, "m2m_encode_latency_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+			"m2m_encode_latency_seconds_sum %g\n"
+			"m2m_encode_latency_seconds_count %" PRIu64 "\n",
+			count, c.latency_sum / 1e6, count);
+
+	if (fclose(f))
+		error(EXIT_FAILURE, errno, "Metrics: Not enough memory");
+
+	return text;
+}
+
+static void send_all(int const fd, char const *data, size_t size)
+{
+	while (size) {
+		ssize_t const rc = send(fd, data, size, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return;
+
+		data += rc;
+		size -= rc;
+	}
+}
+
+static void serve(int const fd)
+{
+	char request[METRICS_REQUEST_SIZE];
+	size_t len = 0;
+
+	/* Only request head is read, any path is answered with metrics */
+	while (len < sizeof(request) - 1) {
+		struct pollfd pfd = { fd, POLLIN };
+
+		if (poll(&pfd, 1, METRICS_TIMEOUT_MS) <= 0)
+			return;
+
+		ssize_t const rc = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+		if (rc <= 0)
+			return;
+
+		len += rc;
+		request[len] = '\0';
+
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+
+	size_t size;
+	char *const text = exposition(&size);
+	char head[128];
+
+	int const headlen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", size);
+
+	send_all(fd, head, headlen);
+	if (strncmp(request, "HEAD ", 5) != 0)
+		send_all(fd, text, size);
+
+	free(text);
+}
+
+static void *metrics_thread(void *arg)
+{
+	struct pollfd fds[2] = {
+		{ listenfd, POLLIN },
+		{ wakefd[0], POLLIN }
+	};
+
+	while (1) {
+		int const rc = poll(fds, 2, -1);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			error(EXIT_FAILURE, errno, "Metrics: Poll error");
+
+		if (fds[1].revents)
+			break;
+
+		if (fds[0].revents & POLLIN) {
+			int const fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0) {
+				pr_warn("Metrics: Can not accept connection: %s",
+						strerror(errno));
+				continue;
+			}
+
+			serve(fd);
+			close(fd);
+		}
+	}
+
+	return NULL;
+}
+
+void metrics_init(char const *const address)
+{
+	int rc;
+
+	metrics_socket(address);
+
+	if (pipe(wakefd))
+		error(EXIT_FAILURE, errno, "Metrics: Can not create pipe");
+
+	rc = pthread_create(&thread, NULL, metrics_thread, NULL);
+	if (rc) error(EXIT_FAILURE, rc, "Metrics: Can not create thread");
+
+	pr_info("Metrics are served on %s", address);
+}
+
+void metrics_finish(void)
+{
+	if (listenfd < 0)
+		return;
+
+	if (write(wakefd[1], "", 1) != 1)
+		error(EXIT_FAILURE, errno, "Metrics: Can not stop server");
+
+	pthread_join(thread, NULL);
+
+	close(wakefd[0]);
+	close(wakefd[1]);
+	close(listenfd);
+	listenfd = -1;
+
+	if (sockpath)
+		unlink(sockpath);
+}
@@ -0,0 +1,21 @@
+/*
+ * Metrics HTTP endpoint definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * Statistics counters (see stats.h) are served in Prometheus text
+ * exposition format by a separate thread to any HTTP request. Address is
+ * either "unix:PATH" for UNIX socket or "[HOST:]PORT" for TCP socket,
+ * HOST is 127.0.0.1 by default. Statistics must be initialized.
+ */
+void metrics_init(char const *const address);
+void metrics_finish(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,297 @@
+/*
+ * Encoded stream output to multiple sinks implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "output.h"
+
+#define OUTPUT_MAX_SINKS 8
+
+/* About a second of high bitrate stream */
+#define OUTPUT_BACKLOG_SIZE (8 << 20)
+
+/* Time to flush backlogs on close */
+#define OUTPUT_CLOSE_TIMEOUT_MS 1000
+
+static struct sink {
+	int fd;
+	char const *name;
+	bool blocking; //!< Regular file, written synchronously
+	bool resync; //!< Frames are dropped until key frame
+	int flags; //!< Original file status flags
+	uint8_t *backlog;
+	size_t len; //!< Length of data in backlog
+	unsigned dropped;
+	uint64_t bytes;
+} sinks[OUTPUT_MAX_SINKS];
+
+static unsigned nsinks;
+
+static void sink_add(int const fd, char const *const name)
+{
+	struct stat st;
+
+	if (nsinks == OUTPUT_MAX_SINKS)
+		error(EXIT_FAILURE, 0, "Too many outputs, at most %u are supported",
+				OUTPUT_MAX_SINKS);
+
+	if (fstat(fd, &st))
+		error(EXIT_FAILURE, errno, "Can not use output %s", name);
+
+	struct sink *const s = &sinks[nsinks++];
+
+	s->fd = fd;
+	s->name = name;
+	s->blocking = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+
+	if (!s->blocking) {
+		s->backlog = malloc(OUTPUT_BACKLOG_SIZE);
+		if (!s->backlog) error(EXIT_FAILURE, 0, "Not enough memory");
+
+		s->flags = fcntl(fd, F_GETFL);
+		if (s->flags < 0 || fcntl(fd, F_SETFL, s->flags | O_NONBLOCK))
+			error(EXIT_FAILURE, errno, "Can not make output %s non-blocking", name);
+
+		/* Disconnected reader fails the sink with EPIPE, not the process */
+		signal(SIGPIPE, SIG_IGN);
+	}
+}
+
+static int connect_unix(char const *const path)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(sa.sun_path))
+		error(EXIT_FAILURE, 0, "Socket path is too long: %s", path);
+	strcpy(sa.sun_path, path);
+
+	int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+		error(EXIT_FAILURE, errno, "Can not connect to %s", path);
+
+	return fd;
+}
+
+static int connect_tcp(char const *const address)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	struct addrinfo *res;
+	char host[256];
+	int fd = -1, rc;
+
+	char const *const port = strrchr(address, ':');
+	if (!port || port - address >= sizeof(host))
+		error(EXIT_FAILURE, 0, "Malformed address: %s", address);
+
+	memcpy(host, address, port - address);
+	host[port - address] = '\0';
+
+	rc = getaddrinfo(host, port + 1, &hints, &res);
+	if (rc)
+		error(EXIT_FAILURE, 0, "Can not resolve %s: %s", address, gai_strerror(rc));
+
+	for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0)
+		error(EXIT_FAILURE, errno, "Can not connect to %s", address);
+
+	return fd;
+}
+
+void output_add(char const *const name)
+{
+	int fd;
+
+	if (strncmp(name, "unix:", 5) == 0)
+		fd = connect_unix(name + 5);
+	else if (strncmp(name, "tcp:", 4) == 0)
+		fd = connect_tcp(name + 4);
+	else
+		fd = creat(name, S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
+
+	if (fd < 0)
+		error(EXIT_FAILURE, errno, "Can not open output file %s", name);
+
+	sink_add(fd, name);
+}
+
+void output_add_fd(int const fd)
+{
+	static char names[OUTPUT_MAX_SINKS][16];
+
+	snprintf(names[nsinks % OUTPUT_MAX_SINKS], sizeof(names[0]), "fd %d", fd);
+	sink_add(fd, names[nsinks % OUTPUT_MAX_SINKS]);
+}
+
+bool output_enabled(void)
+{
+	return nsinks > 0;
+}
+
+static void sink_fail(struct sink *const s)
+{
+	pr_warn("Output %s failed, closing it: %s", s->name, strerror(errno));
+
+	close(s->fd);
+	s->fd = -1;
+}
+
+/*
+ * Writes backlog and then new data with a single call. Returns number of
+ * bytes of new data that are written.
+ */
+static size_t sink_write(struct sink *const s, void const *const data,
+		size_t const size)
+{
+	struct iovec iov[2] = {
+		{ s->backlog, s->len },
+		{ (void *)data, size }
+	};
+	ssize_t rc;
+
+	do
+		rc = writev(s->fd, s->len ? iov : iov + 1, s->len ? 2 : 1);
+	while (rc < 0 && errno == EINTR);
+
+	if (rc < 0 && errno == EAGAIN)
+		rc = 0;
+
+	if (rc < 0) {
+		sink_fail(s);
+		return size;
+	}
+
+	s->bytes += rc;
+
+	if (rc < s->len) {
+		memmove(s->backlog, s->backlog + rc, s->len - rc);
+		s->len -= rc;
+		return 0;
+	}
+
+	rc -= s->len;
+	s->len = 0;
+
+	return rc;
+}
+
+void output_write(void const *const data, size_t const size, bool const key)
+{
+	for (unsigned i = 0; i < nsinks; i++) {
+		struct sink *const s = &sinks[i];
+
+		if (s->fd < 0)
+			continue;
+
+		if (s->blocking) {
+			ssize_t const rc = write(s->fd, data, size);
+			if (rc < 0 || rc != size)
+				error(EXIT_FAILURE, errno, "Can not write to output %s", s->name);
+			s->bytes += size;
+			continue;
+		}
+
+		/* Decoder of the sink can restart from key frame only */
+		if (s->resync && !key) {
+			s->dropped++;
+			sink_write(s, NULL, 0);
+			continue;
+		}
+
+		size_t const written = sink_write(s, data, size);
+
+		if (s->fd < 0 || written == size) {
+			s->resync = false;
+			continue;
+		}
+
+		/*
+		 * Rest of a partially written frame is dropped as well, decoder
+		 * of the sink skips the broken frame and resyncs on key frame.
+		 */
+		if (s->len + size - written > OUTPUT_BACKLOG_SIZE) {
+			if (size > OUTPUT_BACKLOG_SIZE)
+				pr_warn("Output %s: Frame of %zu bytes does not fit into "
+						"backlog, dropping it", s->name, size);
+			else if (!s->resync)
+				pr_warn("Output %s is too slow, dropping frames", s->name);
+			s->dropped++;
+			s->resync = true;
+			continue;
+		}
+
+		memcpy(s->backlog + s->len, (uint8_t const *)data + written,
+				size - written);
+		s->len += size - written;
+		s->resync = false;
+	}
+}
+
+void output_close(void)
+{
+	for (unsigned i = 0; i < nsinks; i++) {
+		struct sink *const s = &sinks[i];
+
+		while (s->fd >= 0 && s->len) {
+			struct pollfd pfd = { s->fd, POLLOUT };
+
+			if (poll(&pfd, 1, OUTPUT_CLOSE_TIMEOUT_MS) <= 0) {
+				pr_warn("Output %s is not flushed, %zu bytes are lost",
+						s->name, s->len);
+				break;
+			}
+
+			sink_write(s, NULL, 0);
+		}
+
+		if (s->dropped)
+			pr_warn("Output %s: %u frames are dropped", s->name, s->dropped);
+
+		pr_verb("Output %s: %" PRIu64 " bytes written", s->name, s->bytes);
+
+		/* Descriptor may be shared with other processes */
+		if (s->fd >= 0 && !s->blocking)
+			fcntl(s->fd, F_SETFL, s->flags);
+
+		if (s->fd >= 0 && close(s->fd))
+			error(EXIT_FAILURE, errno, "Can not write to output %s", s->name);
+
+		free(s->backlog);
+	}
+
+	nsinks = 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Encoded stream output to multiple sinks definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Every encoded frame is written to all sinks directly from the device
+ * buffer. Regular files are written synchronously. Pipes, sockets and other
+ * sinks are non-blocking: data a sink can not accept is kept in its backlog
+ * and is written before the next frame, so a slow sink does not stall the
+ * others. Frames that do not fit into backlog are dropped for that sink up
+ * to the next key frame. A sink that fails is closed with a warning.
+ *
+ * Sink name is a file path, "unix:PATH" or "tcp:HOST:PORT" to connect to a
+ * stream socket.
+ */
+void output_add(char const *const name);
+void output_add_fd(int const fd);
+bool output_enabled(void);
+void output_write(void const *const data, size_t const size, bool const key);
+void output_close(void);
+
+#endif /* OUTPUT_H */
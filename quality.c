@@ -0,0 +1,438 @@
+/*
+ * Encoded stream quality verification implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <error.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "log.h"
+#include "quality.h"
+
+#define QUALITY_MAX_PSNR 100.0
+
+/* Number of frames besides encoder depth decoder can lag behind */
+#define QUALITY_SLACK 4
+
+static struct quality_ring {
+	uint8_t **bufs;
+	unsigned size, head, count;
+} refs, pkts;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool finishing;
+
+static AVCodecContext *dcc; //!< Decoder context
+static int qwidth, qheight;
+static AVRational qframerate;
+static size_t *pktsizes;
+
+static struct quality_stats {
+	unsigned frames, mismatched;
+	uint64_t bytes;
+	uint64_t sse[3];
+	double psnr[3];
+	double psnr_all;
+	double ssim;
+} stats;
+
+static void ring_alloc(struct quality_ring *const ring, unsigned const size,
+		size_t const bufsize)
+{
+	ring->size = size;
+	ring->bufs = calloc(size, sizeof(*ring->bufs));
+	if (!ring->bufs) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	for (unsigned i = 0; i < size; i++) {
+		ring->bufs[i] = bufsize ? malloc(bufsize) : NULL;
+		if (bufsize && !ring->bufs[i]) error(EXIT_FAILURE, 0, "Not enough memory");
+	}
+}
+
+static void ring_free(struct quality_ring *const ring)
+{
+	for (unsigned i = 0; i < ring->size; i++)
+		free(ring->bufs[i]);
+
+	free(ring->bufs);
+}
+
+/* Waits for a free slot and returns its index. Must be called with lock held. */
+static unsigned ring_wait_free(struct quality_ring *const ring)
+{
+	while (ring->count == ring->size)
+		pthread_cond_wait(&cond, &lock);
+
+	return (ring->head + ring->count) % ring->size;
+}
+
+static uint64_t ssd_row(uint8_t const *a, uint8_t const *b, int const n)
+{
+	uint64_t sum = 0;
+	int i = 0;
+
+#if defined(__SSE2__)
+	__m128i const zero = _mm_setzero_si128();
+	__m128i acc = zero;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i const x = _mm_loadu_si128((__m128i const *)(a + i));
+		__m128i const y = _mm_loadu_si128((__m128i const *)(b + i));
+		__m128i const d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+		__m128i const lo = _mm_unpacklo_epi8(d, zero);
+		__m128i const hi = _mm_unpackhi_epi8(d, zero);
+
+		acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo),
+				_mm_madd_epi16(hi, hi)));
+	}
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__ARM_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t const d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+
+		acc = vpadalq_u16(acc, vmull_u8(vget_low_u8(d), vget_low_u8(d)));
+		acc = vpadalq_u16(acc, vmull_u8(vget_high_u8(d), vget_high_u8(d)));
+	}
+
+	uint64x2_t const acc2 = vpaddlq_u32(acc);
+	sum = vgetq_lane_u64(acc2, 0) + vgetq_lane_u64(acc2, 1);
+#endif
+
+	for (; i < n; i++) {
+		int const d = a[i] - b[i];
+		sum += d * d;
+	}
+
+	return sum;
+}
+
+static uint64_t ssd_plane(uint8_t const *a, int const astride,
+		uint8_t const *b, int const bstride, int const width, int const height)
+{
+	uint64_t sum = 0;
+
+	for (int y = 0; y < height; y++)
+		sum += ssd_row(a + y * astride, b + y * bstride, width);
+
+	return sum;
+}
+
+static double sse2psnr(uint64_t const sse, uint64_t const pixels)
+{
+	if (sse == 0)
+		return QUALITY_MAX_PSNR;
+
+	return fmin(10 * log10(255.0 * 255.0 * pixels / sse), QUALITY_MAX_PSNR);
+}
+
+/*
+ * SSIM of luma plane over 8x8 windows with step 4 as in x264.
+ */
+static double ssim_plane(uint8_t const *a, int const astride,
+		uint8_t const *b, int const bstride, int const width, int const height)
+{
+	static const double c1 = 0.01 * 255 * 0.01 * 255;
+	static const double c2 = 0.03 * 255 * 0.03 * 255;
+	double ssim = 0;
+	unsigned windows = 0;
+
+	for (int y = 0; y + 8 <= height; y += 4)
+		for (int x = 0; x + 8 <= width; x += 4) {
+			uint32_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+
+			for (int j = 0; j < 8; j++) {
+				uint8_t const *const pa = a + (y + j) * astride + x;
+				uint8_t const *const pb = b + (y + j) * bstride + x;
+
+				for (int i = 0; i < 8; i++) {
+					sa += pa[i];
+					sb += pb[i];
+					saa += pa[i] * pa[i];
+					sbb += pb[i] * pb[i];
+					sab += pa[i] * pb[i];
+				}
+			}
+
+			double const ma = sa / 64.0, mb = sb / 64.0;
+			double const va = saa / 64.0 - ma * ma;
+			double const vb = sbb / 64.0 - mb * mb;
+			double const cov = sab / 64.0 - ma * mb;
+
+			ssim += (2 * ma * mb + c1) * (2 * cov + c2) /
+				((ma * ma + mb * mb + c1) * (va + vb + c2));
+			windows++;
+		}
+
+	return windows ? ssim / windows : 1;
+}
+
+static void compare(AVFrame const *const frame, uint8_t const *const ref)
+{
+	int const cw = (qwidth + 1) / 2, ch = (qheight + 1) / 2;
+	uint8_t const *const planes[3] = {
+		ref, ref + qwidth * qheight, ref + qwidth * qheight + cw * ch
+	};
+	int const widths[3] = { qwidth, cw, cw }, heights[3] = { qheight, ch, ch };
+	uint64_t sse[3], sse_all = 0, pixels_all = 0;
+	double psnr[3];
+
+	if (frame->width != qwidth || frame->height != qheight ||
+	    frame->format != AV_PIX_FMT_YUV420P) {
+		stats.mismatched++;
+		return;
+	}
+
+	for (int p = 0; p < 3; p++) {
+		uint64_t const pixels = (uint64_t)widths[p] * heights[p];
+
+		sse[p] = ssd_plane(frame->data[p], frame->linesize[p], planes[p],
+				widths[p], widths[p], heights[p]);
+		psnr[p] = sse2psnr(sse[p], pixels);
+
+		stats.sse[p] += sse[p];
+		stats.psnr[p] += psnr[p];
+		sse_all += sse[p];
+		pixels_all += pixels;
+	}
+
+	double const ssim = ssim_plane(frame->data[0], frame->linesize[0], planes[0],
+			qwidth, qwidth, qheight);
+	double const psnr_all = sse2psnr(sse_all, pixels_all);
+
+	stats.psnr_all += psnr_all;
+	stats.ssim += ssim;
+
+	pr_verb("Quality: frame %u: PSNR Y %.2f U %.2f V %.2f (%.2f) dB, SSIM %.4f",
+			stats.frames, psnr[0], psnr[1], psnr[2], psnr_all, ssim);
+
+	stats.frames++;
+}
+
+static void receive_frames(AVFrame *const frame)
+{
+	int rc;
+
+	while ((rc = avcodec_receive_frame(dcc, frame)) == 0) {
+		pthread_mutex_lock(&lock);
+		while (refs.count == 0 && !finishing)
+			pthread_cond_wait(&cond, &lock);
+
+		if (refs.count == 0) {
+			pthread_mutex_unlock(&lock);
+			stats.mismatched++;
+			continue;
+		}
+
+		uint8_t const *const ref = refs.bufs[refs.head];
+		pthread_mutex_unlock(&lock);
+
+		compare(frame, ref);
+
+		pthread_mutex_lock(&lock);
+		refs.head = (refs.head + 1) % refs.size;
+		refs.count--;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+
+	if (rc != AVERROR(EAGAIN) && rc != AVERROR_EOF)
+		error(EXIT_FAILURE, 0, "Quality: Failed to read decoded frame");
+}
+
+static void *quality_thread(void *arg)
+{
+	AVPacket packet;
+	AVFrame *frame = av_frame_alloc();
+
+	if (!frame) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	av_init_packet(&packet);
+
+	while (true) {
+		pthread_mutex_lock(&lock);
+		while (pkts.count == 0 && !finishing)
+			pthread_cond_wait(&cond, &lock);
+
+		if (pkts.count == 0) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+
+		unsigned const index = pkts.head;
+		pthread_mutex_unlock(&lock);
+
+		packet.data = pkts.bufs[index];
+		packet.size = pktsizes[index];
+
+		if (avcodec_send_packet(dcc, &packet))
+			error(EXIT_FAILURE, 0, "Quality: Failed to send packet to decoder");
+
+		pthread_mutex_lock(&lock);
+		pkts.head = (pkts.head + 1) % pkts.size;
+		pkts.count--;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+
+		receive_frames(frame);
+	}
+
+	/* Drain decoder */
+	avcodec_send_packet(dcc, NULL);
+	receive_frames(frame);
+
+	av_frame_free(&frame);
+
+	return NULL;
+}
+
+void quality_init(int const width, int const height, AVRational const framerate,
+		unsigned const depth)
+{
+	AVCodec *const codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+	if (!codec) error(EXIT_FAILURE, 0, "Quality: H.264 decoder is not found");
+
+	dcc = avcodec_alloc_context3(codec);
+	if (!dcc) error(EXIT_FAILURE, 0, "Quality: Failed to allocate codec context");
+
+	/* Slice threading does not add delay, so frames are returned in time */
+	dcc->thread_type = FF_THREAD_SLICE;
+
+	if (avcodec_open2(dcc, codec, NULL) < 0)
+		error(EXIT_FAILURE, 0, "Quality: Could not open codec");
+
+	qwidth = width;
+	qheight = height;
+	qframerate = framerate;
+
+	ring_alloc(&refs, depth + QUALITY_SLACK,
+			width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2));
+	ring_alloc(&pkts, depth + QUALITY_SLACK, 0);
+
+	pktsizes = calloc(pkts.size, sizeof(*pktsizes));
+	if (!pktsizes) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	int rc = pthread_create(&thread, NULL, quality_thread, NULL);
+	if (rc) error(EXIT_FAILURE, rc, "Quality: Can not create thread");
+}
+
+void quality_ref(AVFrame const *const frame)
+{
+	int const cw = (qwidth + 1) / 2, ch = (qheight + 1) / 2;
+	int const widths[3] = { qwidth, cw, cw }, heights[3] = { qheight, ch, ch };
+
+	pthread_mutex_lock(&lock);
+	unsigned const index = ring_wait_free(&refs);
+	pthread_mutex_unlock(&lock);
+
+	uint8_t *dst = refs.bufs[index];
+
+	for (int p = 0; p < 3; p++)
+		for (int y = 0; y < heights[p]; y++) {
+			memcpy(dst, frame->data[p] + y * frame->linesize[p], widths[p]);
+			dst += widths[p];
+		}
+
+	pthread_mutex_lock(&lock);
+	refs.count++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void quality_packet(void const *const data, size_t const size)
+{
+	if (size == 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	unsigned const index = ring_wait_free(&pkts);
+	pthread_mutex_unlock(&lock);
+
+	/* Decoder requires padding at the end of packet */
+	uint8_t *const buf = realloc(pkts.bufs[index], size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (!buf) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	memcpy(buf, data, size);
+	memset(buf + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	pkts.bufs[index] = buf;
+	pktsizes[index] = size;
+	stats.bytes += size;
+
+	pthread_mutex_lock(&lock);
+	pkts.count++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void quality_finish(void)
+{
+	pthread_mutex_lock(&lock);
+	finishing = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+
+	if (stats.mismatched || refs.count)
+		pr_warn("Quality: %u decoded and %u source frames are not matched",
+				stats.mismatched, refs.count);
+
+	if (stats.frames == 0) {
+		pr_warn("Quality: No frames are compared");
+	} else {
+		unsigned const n = stats.frames;
+		uint64_t const pixels = (uint64_t)qwidth * qheight * n;
+		uint64_t const cpixels = (uint64_t)((qwidth + 1) / 2) * ((qheight + 1) / 2) * n;
+		double const ssim = stats.ssim / n;
+
+		pr_info("Quality: %u frames, average PSNR Y %.2f U %.2f V %.2f (%.2f) dB, "
+				"global PSNR Y %.2f U %.2f V %.2f (%.2f) dB",
+				n, stats.psnr[0] / n, stats.psnr[1] / n,
+				stats.psnr[2] / n, stats.psnr_all / n,
+				sse2psnr(stats.sse[0], pixels),
+				sse2psnr(stats.sse[1], cpixels),
+				sse2psnr(stats.sse[2], cpixels),
+				sse2psnr(stats.sse[0] + stats.sse[1] + stats.sse[2],
+					pixels + 2 * cpixels));
+		pr_info("Quality: SSIM %.4f (%.2f dB)", ssim,
+				ssim < 1 ? -10 * log10(1 - ssim) : QUALITY_MAX_PSNR);
+
+		/* Data point for BD-rate calculation: bitrate vs quality */
+		double const bits = stats.bytes * 8.0 / n;
+		if (qframerate.num && qframerate.den)
+			pr_info("RD point: %.1f kbps, PSNR Y %.2f dB, SSIM %.4f",
+					bits * av_q2d(qframerate) / 1000,
+					sse2psnr(stats.sse[0], pixels), ssim);
+		else
+			pr_info("RD point: %.0f bits/frame, PSNR Y %.2f dB, SSIM %.4f",
+					bits, sse2psnr(stats.sse[0], pixels), ssim);
+	}
+
+	ring_free(&refs);
+	ring_free(&pkts);
+	free(pktsizes);
+	avcodec_free_context(&dcc);
+}
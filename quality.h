@@ -0,0 +1,29 @@
+/*
+ * Encoded stream quality verification definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <stddef.h>
+
+#include <libavformat/avformat.h>
+
+/*
+ * Encoded stream is decoded by FFmpeg in a separate thread and each decoded
+ * frame is compared with the corresponding source frame. Source frames are
+ * kept in a small ring, so quality_ref() blocks if the decoder lags behind
+ * the encoder by more than the ring size. Ring size is derived from depth,
+ * that is the maximal number of frames in flight in the encoder.
+ */
+void quality_init(int const width, int const height, AVRational const framerate,
+		unsigned const depth);
+void quality_ref(AVFrame const *const frame);
+void quality_packet(void const *const data, size_t const size);
+void quality_finish(void);
+
+#endif /* QUALITY_H */
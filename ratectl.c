@@ -0,0 +1,211 @@
+/*
+ * Software rate control implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <error.h>
+
+#include <linux/videodev2.h>
+
+#include "log.h"
+#include "ratectl.h"
+#include "v4l2-utils.h"
+
+/* Enough for any number of frames in flight */
+#define RATECTL_MAX_QUEUED 64
+
+/* Maximum QP change per frame, larger when buffer overflows */
+#define RATECTL_STEP 1
+#define RATECTL_PANIC_STEP 4
+
+/* Weight of the last P frame in complexity estimation */
+#define RATECTL_SMOOTHING 0.25
+
+static bool enabled;
+static int fd;
+
+static struct {
+	double kbps, fps;
+	double target; //!< Bits per frame
+	double size; //!< Size of virtual buffer in bits
+	double fullness; //!< Bits in virtual buffer
+	double complexity; //!< Bits of P frame at QP 0, 0 if unknown
+	int qp; //!< QP of P frames
+	int offset; //!< Difference of I frame QP from P frame QP
+	int min, max; //!< P frame QP range of device
+	int imin, imax; //!< I frame QP range of device
+} rc;
+
+/* QP of frames in flight */
+static struct {
+	int qp[RATECTL_MAX_QUEUED];
+	unsigned head, count;
+} inflight;
+
+static struct {
+	uint64_t frames, bits, overflows;
+	int qpmin, qpmax;
+} total;
+
+static int query_qp(uint32_t const id, int *const min, int *const max)
+{
+	struct v4l2_query_ext_ctrl qc = { .id = id };
+	struct v4l2_ext_control ctrl = { .id = id };
+
+	if (query_ext_ctrl_ioctl(fd, &qc))
+		error(EXIT_FAILURE, 0, "Rate control requires QP control %u", id);
+
+	v4l2_g_ext_ctrls(fd, V4L2_CTRL_CLASS_MPEG, 1, &ctrl);
+
+	*min = qc.minimum;
+	*max = qc.maximum;
+
+	return ctrl.value;
+}
+
+static int clamp(int const value, int const min, int const max)
+{
+	return value < min ? min : value > max ? max : value;
+}
+
+void ratectl_init(int const m2mfd, double const kbps, double const fps,
+		double const vbv)
+{
+	fd = m2mfd;
+
+	int const qpi = query_qp(V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP, &rc.imin, &rc.imax);
+	int const qpp = query_qp(V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP, &rc.min, &rc.max);
+
+	rc.kbps = kbps;
+	rc.fps = fps;
+	rc.target = kbps * 1000 / fps;
+	rc.size = kbps * vbv;
+	rc.fullness = rc.size / 2;
+	rc.complexity = 0;
+	rc.qp = qpp;
+	rc.offset = qpi - qpp;
+
+	inflight.count = 0;
+
+	total.frames = total.bits = total.overflows = 0;
+	total.qpmin = total.qpmax = qpp;
+
+	enabled = true;
+
+	pr_info("Rate control: %.0f kbit/s at %.2f FPS, VBV %.0f ms, QP I %d P %d",
+			kbps, fps, vbv, qpi, qpp);
+}
+
+void ratectl_queued(void)
+{
+	if (!enabled || inflight.count == RATECTL_MAX_QUEUED)
+		return;
+
+	inflight.qp[(inflight.head + inflight.count) % RATECTL_MAX_QUEUED] = rc.qp;
+	inflight.count++;
+}
+
+static void apply(int const qp)
+{
+	struct v4l2_ext_control ctrls[] = {
+		{
+			.id = V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP,
+			.value = clamp(qp + rc.offset, rc.imin, rc.imax)
+		},
+		{
+			.id = V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP,
+			.value = qp
+		}
+	};
+
+	/* Encoder keeps the previous QP, the change is retried on next frame */
+	if (v4l2_try_s_ext_ctrls(fd, V4L2_CTRL_CLASS_MPEG, 2, ctrls, NULL)) {
+		pr_warn("Rate control: can not set QP %d: %s", qp, strerror(errno));
+		return;
+	}
+
+	rc.qp = qp;
+	if (qp < total.qpmin) total.qpmin = qp;
+	if (qp > total.qpmax) total.qpmax = qp;
+}
+
+void ratectl_encoded(size_t const bytes, bool const key)
+{
+	int qp = rc.qp;
+	double const bits = bytes * 8.0;
+
+	if (!enabled)
+		return;
+
+	if (inflight.count) {
+		qp = inflight.qp[inflight.head];
+		inflight.head = (inflight.head + 1) % RATECTL_MAX_QUEUED;
+		inflight.count--;
+	}
+
+	total.frames++;
+	total.bits += bits;
+
+	rc.fullness += bits - rc.target;
+	if (rc.fullness < 0)
+		rc.fullness = 0;
+
+	/* Excess is a violation already, it must not drive QP further */
+	bool const overflow = rc.fullness > rc.size;
+	if (overflow) {
+		total.overflows++;
+		pr_debug("Rate control: VBV overflow by %.0f bits", rc.fullness - rc.size);
+		rc.fullness = rc.size;
+	}
+
+	/* I frames are rare, their size is compensated through the buffer */
+	if (!key) {
+		double const c = bits * exp2(qp / 6.0);
+
+		rc.complexity = rc.complexity ? rc.complexity * (1 - RATECTL_SMOOTHING) +
+				c * RATECTL_SMOOTHING : c;
+	}
+
+	if (!rc.complexity)
+		return;
+
+	/* Deviation from half full buffer is corrected over half buffer time */
+	double const horizon = fmax(rc.size / rc.target / 2, 1);
+	double const budget = fmax(rc.target - (rc.fullness - rc.size / 2) / horizon,
+			rc.target / 8);
+	int const step = overflow ? RATECTL_PANIC_STEP : RATECTL_STEP;
+
+	int want = lrint(6 * log2(rc.complexity / budget));
+	want = clamp(want, rc.qp - step, rc.qp + step);
+	want = clamp(want, rc.min, rc.max);
+
+	pr_debug("Rate control: %.0f bits at QP %d, VBV %.0f%%, next QP %d",
+			bits, qp, rc.fullness / rc.size * 100, want);
+
+	if (want != rc.qp)
+		apply(want);
+}
+
+void ratectl_finish(void)
+{
+	if (!enabled)
+		return;
+
+	if (total.frames)
+		pr_info("Rate control: %.0f kbit/s of %.0f kbit/s target, P QP %d-%d, "
+				"VBV overflowed by %" PRIu64 " frames",
+				total.bits / total.frames * rc.fps / 1000, rc.kbps,
+				total.qpmin, total.qpmax, total.overflows);
+
+	enabled = false;
+}
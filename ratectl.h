@@ -0,0 +1,34 @@
+/*
+ * Software rate control definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef RATECTL_H
+#define RATECTL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Closed-loop rate control for encoders with fixed I/P frame QP controls.
+ * Encoded frames fill a virtual buffer of vbv milliseconds of the target
+ * bitrate that is drained at the target bitrate, like an uplink does. QP
+ * of P frames is chosen after every encoded frame from complexity of
+ * recent P frames, assuming size halves every 6 QP, so that the buffer
+ * converges to half full. I frame QP keeps its initial offset from P frame
+ * QP. Frames in flight are accounted with QP that was set when they were
+ * queued.
+ *
+ * Functions other than ratectl_init() are no-op if rate control is not
+ * initialized.
+ */
+void ratectl_init(int const fd, double const kbps, double const fps,
+		double const vbv);
+void ratectl_queued(void);
+void ratectl_encoded(size_t const bytes, bool const key);
+void ratectl_finish(void);
+
+#endif /* RATECTL_H */
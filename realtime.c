@@ -0,0 +1,34 @@
+/*
+ * Realtime scheduling setup implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "realtime.h"
+
+/* Threaded interrupt handlers run at 50 */
+#define REALTIME_PRIORITY 40
+
+void realtime_init(void)
+{
+	struct sched_param const param = {
+		.sched_priority = REALTIME_PRIORITY
+	};
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param))
+		pr_warn("Can not set realtime priority: %s", strerror(errno));
+	else
+		pr_verb("Realtime: SCHED_FIFO priority %d", REALTIME_PRIORITY);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		pr_warn("Can not lock memory: %s", strerror(errno));
+}
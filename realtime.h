@@ -0,0 +1,20 @@
+/*
+ * Realtime scheduling setup definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+/*
+ * Switches the calling process to SCHED_FIFO below threaded interrupt
+ * handlers, so device events are still delivered in time, and locks its
+ * memory to avoid page faults on the frame path. Lack of privileges is
+ * reported as warning, the run continues with normal priority.
+ */
+void realtime_init(void);
+
+#endif /* REALTIME_H */
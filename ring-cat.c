@@ -0,0 +1,134 @@
+/*
+ * Tool to read encoded frames from shared memory ring published by
+ * m2m-test or cap-enc and write them to file or standard output.
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <linux/videodev2.h>
+
+#include "log.h"
+#include "shmring.h"
+
+#ifndef VERSION
+#define VERSION "unversioned"
+#endif
+
+static void help(const char *program_name)
+{
+	puts("ring-cat " VERSION " \n");
+	printf("Synopsys: %s [options] name\n\n", program_name);
+	puts("Options:");
+	puts("    -a        Do not wait for key frame at start and after lost frames");
+	puts("    -n arg    Specify how many frames should be read");
+	puts("    -o arg    Output file name [standard output]");
+	puts("    -t arg    Timeout waiting for frame in ms, -1 means infinitely [-1]");
+	puts("    -v        Be more verbose. Can be specified multiple times");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, outfd = STDOUT_FILENO, timeout = -1;
+	unsigned frames = 0, frame = 0;
+	bool any = false;
+	char const *output = NULL;
+
+	while ((opt = getopt(argc, argv, "ahn:o:t:v")) != -1) {
+		switch (opt) {
+			case 'a': any = true; break;
+			case 'h': help(argv[0]); return EXIT_SUCCESS;
+			case 'n': frames = atoi(optarg); break;
+			case 'o': output = optarg; break;
+			case 't': timeout = atoi(optarg); break;
+			case 'v': vlevel++; break;
+			default: error(EXIT_FAILURE, 0, "Try %s -h for help.", argv[0]);
+		}
+	}
+
+	if (argc < optind + 1)
+		error(EXIT_FAILURE, 0, "Not enough arguments");
+
+	struct shmring *const ring = shmring_open(argv[optind]);
+	if (!ring)
+		error(EXIT_FAILURE, errno, "Can not open ring %s", argv[optind]);
+
+	if (output) {
+		outfd = creat(output, S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR);
+		if (outfd < 0)
+			error(EXIT_FAILURE, errno, "Can not open output file");
+	}
+
+	struct shmring_frame f;
+	uint64_t lost = 0;
+	void *buf = NULL;
+	size_t bufsize = 0;
+	bool sync = any;
+
+	while (frames == 0 || frame < frames) {
+		if (shmring_next(ring, &f, timeout)) {
+			if (errno == EPIPE)
+				break;
+			error(EXIT_FAILURE, errno, "Can not read frame");
+		}
+
+		if (f.lost) {
+			pr_warn("Lost %" PRIu64 " frames before frame %" PRIu64,
+					f.lost, f.seq);
+			lost += f.lost;
+			sync = any;
+		}
+
+		/* Decoding can start from key frame only */
+		if (!sync && !(f.flags & V4L2_BUF_FLAG_KEYFRAME))
+			continue;
+
+		/* Output can block, so frame is copied out of the ring first */
+		if (f.size > bufsize) {
+			bufsize = f.size;
+			buf = realloc(buf, bufsize);
+			if (!buf) error(EXIT_FAILURE, 0, "Not enough memory");
+		}
+
+		memcpy(buf, f.data, f.size);
+
+		if (!shmring_valid(ring, &f)) {
+			pr_warn("Frame %" PRIu64 " is overwritten while reading", f.seq);
+			lost++;
+			sync = any;
+			continue;
+		}
+
+		sync = true;
+
+		if (write(outfd, buf, f.size) != f.size)
+			error(EXIT_FAILURE, errno, "Can not write to output");
+
+		pr_verb("Frame %" PRIu64 ": %u bytes", f.seq, f.size);
+		frame++;
+	}
+
+	pr_info("Read %u frames, lost %" PRIu64 " frames", frame, lost);
+
+	free(buf);
+	shmring_close(ring);
+
+	if (output && close(outfd))
+		error(EXIT_FAILURE, errno, "Can not write to output");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,350 @@
+/*
+ * Shared memory ring of encoded frames implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+#define SHMRING_MAGIC 0x524d324d /* "M2MR" */
+#define SHMRING_VERSION 1
+
+/* Enough for several seconds of video */
+#define SHMRING_SLOTS 256
+
+/* Slot is being rewritten */
+#define SHMRING_BUSY UINT64_MAX
+
+/* Frames start at cache line boundary */
+#define SHMRING_ALIGN 64
+
+#define ROUND_UP(x, a) (((x)+(a)-1)&~((a)-1))
+
+/*
+ * Data area is a byte ring addressed by monotonic offsets, a frame is
+ * never split at the end of the area. Before overwriting data writer
+ * advances oldest offset, so reader validates data after reading it by
+ * comparing its offset with oldest. Slots are validated the same way by
+ * their sequence numbers.
+ */
+struct shmring_header {
+	uint32_t magic, version;
+	uint32_t slots;
+	uint32_t futex; //!< Incremented on every publish and finish
+	uint64_t size; //!< Size of data area, power of two
+	uint64_t head; //!< Sequence number of the next frame
+	uint64_t oldest; //!< Offset of the oldest valid data
+	uint32_t finished;
+	uint32_t reserved[5];
+};
+
+struct shmring_slot {
+	uint64_t seq;
+	uint64_t offset;
+	uint64_t timestamp;
+	uint32_t size, flags;
+};
+
+struct shmring {
+	struct shmring_header *header;
+	struct shmring_slot *slots;
+	uint8_t *data;
+	size_t length; //!< Length of mapping
+	char *name; //!< Name to unlink, writer only
+	uint64_t pos; //!< Writer: offset of free data, reader: next sequence
+};
+
+static size_t data_offset(unsigned const slots)
+{
+	return ROUND_UP(sizeof(struct shmring_header) +
+			slots * sizeof(struct shmring_slot), 4096);
+}
+
+static void futex_wake(uint32_t *const addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int futex_wait(uint32_t const *const addr, uint32_t const val,
+		int const timeout)
+{
+	struct timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = timeout % 1000 * 1000000
+	};
+
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val,
+			timeout < 0 ? NULL : &ts, NULL, 0);
+}
+
+static struct shmring *ring_map(int const fd, size_t const length,
+		int const prot)
+{
+	struct shmring *const ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	ring->header = mmap(NULL, length, prot, MAP_SHARED, fd, 0);
+	if (ring->header == MAP_FAILED) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->length = length;
+
+	return ring;
+}
+
+static void ring_layout(struct shmring *const ring)
+{
+	ring->slots = (struct shmring_slot *)(ring->header + 1);
+	ring->data = (uint8_t *)ring->header + data_offset(ring->header->slots);
+}
+
+struct shmring *shmring_create(char const *const name, size_t const size)
+{
+	size_t datasize = 4096;
+	int err;
+
+	while (datasize < size)
+		datasize *= 2;
+
+	size_t const length = data_offset(SHMRING_SLOTS) + datasize;
+
+	int const fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, length)) {
+		err = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+
+	struct shmring *const ring = ring_map(fd, length, PROT_READ | PROT_WRITE);
+	err = errno;
+	close(fd);
+
+	if (ring)
+		ring->name = strdup(name);
+
+	if (!ring || !ring->name) {
+		if (ring) shmring_close(ring);
+		shm_unlink(name);
+		errno = ring ? ENOMEM : err;
+		return NULL;
+	}
+
+	/* Memory is zeroed by ftruncate(), so all slots are empty */
+	struct shmring_header *const h = ring->header;
+
+	h->version = SHMRING_VERSION;
+	h->slots = SHMRING_SLOTS;
+	h->size = datasize;
+	ring_layout(ring);
+
+	for (unsigned i = 0; i < SHMRING_SLOTS; i++)
+		ring->slots[i].seq = SHMRING_BUSY;
+
+	/* Readers check magic last */
+	__atomic_store_n(&h->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+	return ring;
+}
+
+int shmring_publish(struct shmring *const ring, void const *const data,
+		uint32_t const size, uint32_t const flags)
+{
+	struct shmring_header *const h = ring->header;
+	uint64_t const seq = h->head;
+	struct shmring_slot *const slot = &ring->slots[seq % h->slots];
+	uint64_t pos = ring->pos;
+	struct timespec now;
+
+	/* At least two frames fit, so the previous one is never overwritten */
+	if (size > h->size / 2) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if ((pos & (h->size - 1)) + size > h->size)
+		pos = ROUND_UP(pos, h->size);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Invalidate data and slot before overwriting them */
+	if (pos + size > h->size)
+		__atomic_store_n(&h->oldest, pos + size - h->size, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, SHMRING_BUSY, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(ring->data + (pos & (h->size - 1)), data, size);
+
+	slot->offset = pos;
+	slot->size = size;
+	slot->flags = flags;
+	slot->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->head, seq + 1, __ATOMIC_RELEASE);
+
+	/* Waking without waiters is cheap in comparison with encoding */
+	__atomic_add_fetch(&h->futex, 1, __ATOMIC_RELEASE);
+	futex_wake(&h->futex);
+
+	ring->pos = ROUND_UP(pos + size, SHMRING_ALIGN);
+
+	return 0;
+}
+
+void shmring_destroy(struct shmring *const ring)
+{
+	/* Readers keep mapping, so they are notified */
+	__atomic_store_n(&ring->header->finished, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&ring->header->futex, 1, __ATOMIC_RELEASE);
+	futex_wake(&ring->header->futex);
+
+	shm_unlink(ring->name);
+	free(ring->name);
+	shmring_close(ring);
+}
+
+struct shmring *shmring_open(char const *const name)
+{
+	struct shmring_header header;
+	struct stat st;
+	int err = EINVAL;
+
+	int const fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st)) {
+		err = errno;
+		goto fail;
+	}
+
+	if (st.st_size < sizeof(header) ||
+	    pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		goto fail;
+
+	/* Writer may be initializing it */
+	if (header.magic != SHMRING_MAGIC) {
+		err = EAGAIN;
+		goto fail;
+	}
+
+	if (header.version != SHMRING_VERSION || header.slots == 0 ||
+	    data_offset(header.slots) + header.size > st.st_size)
+		goto fail;
+
+	struct shmring *const ring = ring_map(fd, st.st_size, PROT_READ);
+	if (!ring) {
+		err = errno;
+		goto fail;
+	}
+
+	close(fd);
+
+	ring_layout(ring);
+	ring->pos = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+
+	return ring;
+
+fail:
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+int shmring_next(struct shmring *const ring, struct shmring_frame *const frame,
+		int const timeout)
+{
+	struct shmring_header const *const h = ring->header;
+	uint64_t lost = 0;
+
+	while (1) {
+		uint32_t const futex = __atomic_load_n(&h->futex, __ATOMIC_ACQUIRE);
+		uint64_t const head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+		/* Writer has lapped the reader */
+		if (head - ring->pos > h->slots) {
+			lost += head - h->slots - ring->pos;
+			ring->pos = head - h->slots;
+		}
+
+		for (; ring->pos < head; ring->pos++, lost++) {
+			struct shmring_slot const *const slot =
+					&ring->slots[ring->pos % h->slots];
+
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->pos)
+				continue;
+
+			frame->offset = slot->offset;
+			frame->size = slot->size;
+			frame->flags = slot->flags;
+			frame->timestamp = slot->timestamp;
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != ring->pos ||
+			    __atomic_load_n(&h->oldest, __ATOMIC_RELAXED) > frame->offset)
+				continue;
+
+			frame->data = ring->data + (frame->offset & (h->size - 1));
+			frame->seq = ring->pos++;
+			frame->lost = lost;
+
+			return 0;
+		}
+
+		if (__atomic_load_n(&h->finished, __ATOMIC_ACQUIRE)) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		if (timeout == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if (futex_wait(&h->futex, futex, timeout) && errno != EAGAIN) {
+			if (errno == ETIMEDOUT)
+				errno = EAGAIN;
+			return -1;
+		}
+	}
+}
+
+bool shmring_valid(struct shmring const *const ring,
+		struct shmring_frame const *const frame)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&ring->header->oldest, __ATOMIC_RELAXED) <=
+			frame->offset;
+}
+
+void shmring_close(struct shmring *const ring)
+{
+	munmap(ring->header, ring->length);
+	free(ring);
+}
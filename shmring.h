@@ -0,0 +1,60 @@
+/*
+ * Shared memory ring of encoded frames definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Encoder publishes frames into POSIX shared memory object, any number of
+ * local processes read them in place. Writer never waits for readers: a
+ * reader that lags behind by more than the ring capacity loses the oldest
+ * frames, it is reported by the lost field of the next frame. Frame data
+ * is read in place, so reader must call shmring_valid() after using it to
+ * check that writer did not overwrite it meanwhile.
+ *
+ * Functions return -1 and set errno on failure.
+ */
+
+/* Default size of data area, enough for dozens of 4K frames */
+#define SHMRING_DEFAULT_SIZE (16 << 20)
+
+struct shmring;
+
+struct shmring_frame {
+	void const *data;
+	uint32_t size;
+	uint32_t flags; //!< V4L2 buffer flags, e.g. V4L2_BUF_FLAG_KEYFRAME
+	uint64_t seq; //!< Sequence number of the frame
+	uint64_t timestamp; //!< CLOCK_MONOTONIC time of publishing in ns
+	uint64_t lost; //!< Frames lost by reader since the previous one
+	uint64_t offset; //!< Position in the ring for shmring_valid()
+};
+
+/* Writer */
+struct shmring *shmring_create(char const *const name, size_t const size);
+int shmring_publish(struct shmring *const ring, void const *const data,
+		uint32_t const size, uint32_t const flags);
+void shmring_destroy(struct shmring *const ring);
+
+/*
+ * Reader. Reading starts from the next published frame. shmring_next()
+ * waits for a frame up to timeout ms (-1 means infinitely) and fails with
+ * EAGAIN on timeout and EPIPE if writer has finished.
+ */
+struct shmring *shmring_open(char const *const name);
+int shmring_next(struct shmring *const ring, struct shmring_frame *const frame,
+		int const timeout);
+bool shmring_valid(struct shmring const *const ring,
+		struct shmring_frame const *const frame);
+void shmring_close(struct shmring *const ring);
+
+#endif /* SHMRING_H */
@@ -0,0 +1,355 @@
+/*
+ * Periodic encoding statistics implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "stats.h"
+
+/* Enough for any number of frames in flight */
+#define STATS_MAX_QUEUED 64
+
+#define NSEC_IN_SEC 1000000000
+
+static bool enabled, periodic;
+static unsigned qdepth; //!< Number of encoder buffers
+static struct timespec period;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool finishing;
+
+/* Updated by processing thread only, counters never decrease */
+static struct stats_counters counters;
+
+/* Queuing times of frames in flight, used by processing thread only */
+static struct {
+	uint64_t time[STATS_MAX_QUEUED];
+	unsigned head, count;
+} inflight;
+
+/* Owned by statistics thread */
+static struct stats_state {
+	struct timespec wall, cpu;
+	struct stats_counters c;
+} last, total;
+
+static inline uint64_t timespec2usec(struct timespec const t)
+{
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static inline uint64_t now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return timespec2usec(t);
+}
+
+static inline double elapsed(struct timespec const start,
+		struct timespec const stop)
+{
+	return stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static unsigned bucket(uint64_t const usec)
+{
+	if (usec < STATS_SUBBUCKETS)
+		return usec;
+
+	unsigned const msb = 63 - __builtin_clzll(usec);
+	unsigned const b = (msb - 1) * STATS_SUBBUCKETS +
+		((usec >> (msb - 2)) & (STATS_SUBBUCKETS - 1));
+
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+uint64_t stats_bucket_value(unsigned const b)
+{
+	if (b < STATS_SUBBUCKETS)
+		return b;
+
+	unsigned const shift = b / STATS_SUBBUCKETS - 1;
+
+	return ((uint64_t)(STATS_SUBBUCKETS + b % STATS_SUBBUCKETS) << shift) +
+		(1ULL << shift) - 1;
+}
+
+double stats_percentile(struct stats_counters const *const from,
+		struct stats_counters const *const to, double const p)
+{
+	uint64_t n = 0, sum = 0;
+
+	for (unsigned b = 0; b < STATS_BUCKETS; b++)
+		n += to->latency[b] - from->latency[b];
+
+	uint64_t const rank = n * p > 1 ? n * p + 0.5 : 1;
+
+	for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+		sum += to->latency[b] - from->latency[b];
+		if (sum >= rank)
+			return stats_bucket_value(b) / 1000.0;
+	}
+
+	return stats_bucket_value(STATS_BUCKETS - 1) / 1000.0;
+}
+
+void stats_read(struct stats_counters *const c)
+{
+	/* Frame is counted as encoded after it is counted as queued */
+	c->encoded = __atomic_load_n(&counters.encoded, __ATOMIC_RELAXED);
+	c->queued = __atomic_load_n(&counters.queued, __ATOMIC_RELAXED);
+	c->dropped = __atomic_load_n(&counters.dropped, __ATOMIC_RELAXED);
+	c->bytes = __atomic_load_n(&counters.bytes, __ATOMIC_RELAXED);
+	c->latency_sum = __atomic_load_n(&counters.latency_sum, __ATOMIC_RELAXED);
+
+	for (unsigned b = 0; b < STATS_BUCKETS; b++)
+		c->latency[b] = __atomic_load_n(&counters.latency[b],
+				__ATOMIC_RELAXED);
+}
+
+/* Summaries are requested by option, so they are printed at any verbosity */
+static void __attribute__((format(printf, 1, 2))) stats_print(char const *format, ...)
+{
+	va_list va;
+
+	va_start(va, format);
+	vprintf(format, va);
+	va_end(va);
+
+	putchar('\n');
+	fflush(stdout);
+}
+
+static void sample(struct stats_state *const s)
+{
+	clock_gettime(CLOCK_MONOTONIC, &s->wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &s->cpu);
+
+	stats_read(&s->c);
+}
+
+static void report(void)
+{
+	struct stats_state cur;
+
+	sample(&cur);
+
+	double const time = elapsed(last.wall, cur.wall);
+	double const cpu = elapsed(last.cpu, cur.cpu);
+	uint64_t const frames = cur.c.encoded - last.c.encoded;
+	uint64_t const bytes = cur.c.bytes - last.c.bytes;
+
+	if (time <= 0)
+		return;
+
+	if (frames)
+		stats_print("Stats: %.1f FPS, %.0f kbit/s, queue %" PRIu64 "/%u, "
+				"latency p50 %.1f ms p99 %.1f ms, CPU %.0f%%",
+				frames / time, bytes * 8 / time / 1000,
+				cur.c.queued - cur.c.encoded, qdepth,
+				stats_percentile(&last.c, &cur.c, 0.5),
+				stats_percentile(&last.c, &cur.c, 0.99),
+				cpu / time * 100);
+	else
+		stats_print("Stats: 0.0 FPS, queue %" PRIu64 "/%u, CPU %.0f%%",
+				cur.c.queued - cur.c.encoded, qdepth, cpu / time * 100);
+
+	last = cur;
+}
+
+static void *stats_thread(void *arg)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	pthread_mutex_lock(&lock);
+
+	while (!finishing) {
+		deadline.tv_sec += period.tv_sec;
+		deadline.tv_nsec += period.tv_nsec;
+		if (deadline.tv_nsec >= NSEC_IN_SEC) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= NSEC_IN_SEC;
+		}
+
+		int rc = 0;
+
+		while (!finishing && rc != ETIMEDOUT)
+			rc = pthread_cond_timedwait(&cond, &lock, &deadline);
+
+		if (rc == ETIMEDOUT)
+			report();
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+double stats_parse_interval(char const *const arg)
+{
+	char *end;
+	double const interval = strtod(arg, &end);
+
+	if (end == arg || *end != '\0' || !isfinite(interval) || interval <= 0)
+		error(EXIT_FAILURE, 0, "Statistics interval must be a positive number "
+				"of seconds: %s", arg);
+
+	return interval;
+}
+
+void stats_init(double const interval, unsigned const depth)
+{
+	pthread_condattr_t attr;
+	int rc;
+
+	if (interval < 0)
+		error(EXIT_FAILURE, 0, "Statistics interval must be positive");
+
+	qdepth = depth;
+	sample(&last);
+	total = last;
+	enabled = true;
+
+	if (interval == 0)
+		return;
+
+	period.tv_sec = interval;
+	period.tv_nsec = (interval - period.tv_sec) * NSEC_IN_SEC;
+	periodic = true;
+
+	/* Timer must not be affected by system time changes */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	rc = pthread_create(&thread, NULL, stats_thread, NULL);
+	if (rc) error(EXIT_FAILURE, rc, "Statistics: Can not create thread");
+}
+
+void stats_queued(void)
+{
+	stats_queued_at(now());
+}
+
+void stats_queued_at(uint64_t const usec)
+{
+	if (!enabled)
+		return;
+
+	if (inflight.count < STATS_MAX_QUEUED) {
+		inflight.time[(inflight.head + inflight.count) % STATS_MAX_QUEUED] = usec;
+		inflight.count++;
+	}
+
+	__atomic_fetch_add(&counters.queued, 1, __ATOMIC_RELAXED);
+}
+
+void stats_encoded(size_t const bytes)
+{
+	if (!enabled)
+		return;
+
+	if (inflight.count) {
+		uint64_t const time = now();
+		uint64_t const queued = inflight.time[inflight.head];
+		uint64_t const latency = time > queued ? time - queued : 0;
+
+		inflight.head = (inflight.head + 1) % STATS_MAX_QUEUED;
+		inflight.count--;
+
+		__atomic_fetch_add(&counters.latency[bucket(latency)], 1,
+				__ATOMIC_RELAXED);
+		__atomic_fetch_add(&counters.latency_sum, latency,
+				__ATOMIC_RELAXED);
+	}
+
+	__atomic_fetch_add(&counters.bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counters.encoded, 1, __ATOMIC_RELAXED);
+}
+
+void stats_dropped(unsigned const frames)
+{
+	if (enabled)
+		__atomic_fetch_add(&counters.dropped, frames, __ATOMIC_RELAXED);
+}
+
+unsigned stats_depth(void)
+{
+	return qdepth;
+}
+
+void stats_latency_summary(char const *const name)
+{
+	static struct stats_counters const zero;
+	struct stats_counters c;
+	uint64_t n = 0;
+
+	if (!enabled)
+		return;
+
+	stats_read(&c);
+
+	for (unsigned b = 0; b < STATS_BUCKETS; b++)
+		n += c.latency[b];
+
+	if (n)
+		pr_info("%s latency: %" PRIu64 " frames, mean %.2f ms, p50 %.2f ms, "
+				"p99 %.2f ms, max %.2f ms", name, n,
+				c.latency_sum / 1000.0 / n,
+				stats_percentile(&zero, &c, 0.5),
+				stats_percentile(&zero, &c, 0.99),
+				stats_percentile(&zero, &c, 1));
+}
+
+void stats_finish(void)
+{
+	if (!periodic)
+		return;
+
+	pthread_mutex_lock(&lock);
+	finishing = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+
+	struct stats_state cur;
+
+	sample(&cur);
+
+	uint64_t const frames = cur.c.encoded - total.c.encoded;
+	double const time = elapsed(total.wall, cur.wall);
+
+	if (frames && time > 0)
+		stats_print("Stats: %" PRIu64 " frames, %.1f FPS, %.0f kbit/s, "
+				"latency p50 %.1f ms p99 %.1f ms, CPU %.0f%%",
+				frames, frames / time,
+				(cur.c.bytes - total.c.bytes) * 8 / time / 1000,
+				stats_percentile(&total.c, &cur.c, 0.5),
+				stats_percentile(&total.c, &cur.c, 0.99),
+				elapsed(total.cpu, cur.cpu) / time * 100);
+
+	periodic = false;
+}
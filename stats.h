@@ -0,0 +1,61 @@
+/*
+ * Encoding statistics definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Latency histogram has 4 buckets per power of two of microseconds, that
+ * gives 25% precision up to an hour.
+ */
+#define STATS_SUBBUCKETS 4
+#define STATS_BUCKETS (32 * STATS_SUBBUCKETS)
+
+struct stats_counters {
+	uint64_t queued, encoded, dropped, bytes;
+	uint64_t latency[STATS_BUCKETS]; //!< Number of frames per bucket
+	uint64_t latency_sum; //!< Sum of latencies in microseconds
+};
+
+/*
+ * Counters are updated by the processing thread with relaxed atomic
+ * operations only and never decrease, so readers take deltas without
+ * locking. If interval is not zero, a separate thread prints one-line
+ * summary every interval seconds: FPS, bitrate, frames in encoder, latency
+ * percentiles and CPU load of the process, and stats_finish() prints
+ * summary of the whole run. Latency is measured from queuing a frame to the
+ * encoder, or from CLOCK_MONOTONIC time in microseconds given to
+ * stats_queued_at() such as capture timestamp, to dequeuing its encoded
+ * data. Frames are expected to be encoded in order. Depth is the number of
+ * encoder buffers.
+ *
+ * Counting functions are no-op if statistics are not initialized.
+ */
+void stats_init(double const interval, unsigned const depth);
+double stats_parse_interval(char const *const arg); //!< Exits if malformed
+void stats_queued(void);
+void stats_queued_at(uint64_t const usec);
+void stats_encoded(size_t const bytes);
+void stats_dropped(unsigned const frames);
+void stats_finish(void);
+
+void stats_read(struct stats_counters *const c);
+unsigned stats_depth(void);
+uint64_t stats_bucket_value(unsigned const b); //!< Upper bound in microseconds
+
+/* Prints latency of all frames since initialization */
+void stats_latency_summary(char const *const name);
+
+/* Percentile of latency in milliseconds between two readings */
+double stats_percentile(struct stats_counters const *const from,
+		struct stats_counters const *const to, double const p);
+
+#endif /* STATS_H */
@@ -0,0 +1,650 @@
+/*
+ * Two-pass encoding implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+
+#include "input.h"
+#include "log.h"
+#include "twopass.h"
+#include "v4l2-utils.h"
+
+/* Analysed luma is downscaled, so macroblock is 4x4 samples */
+#define TWOPASS_SCALE 4
+#define TWOPASS_MB 4
+
+/* Cost of macroblock header and modes */
+#define TWOPASS_MB_OVERHEAD 8
+
+/* Share of inter cost in intra cost that starts a new scene */
+#define TWOPASS_SCENECUT 0.7
+#define TWOPASS_MIN_SCENE 10
+
+/* Segment length if GOP size is unknown */
+#define TWOPASS_SEGMENT 50
+
+/* Share of complexity that is not compensated by QP, qcomp of x264 */
+#define TWOPASS_QCOMP 0.6
+#define TWOPASS_MAX_OFFSET 6
+
+/* Maximum change of base QP between segments after calibration */
+#define TWOPASS_STEP 4
+
+/* GOPs waiting for decoding per thread */
+#define TWOPASS_QUEUE 2
+
+struct cost {
+	uint32_t intra; //!< Cost of frame coded as intra
+	uint32_t inter; //!< Cost of frame coded as predicted
+};
+
+struct image {
+	uint8_t *data;
+	int width, height;
+};
+
+/* Frames of a GOP, they are decoded independently from other GOPs */
+struct chunk {
+	AVPacket *pkts;
+	unsigned npkts;
+	unsigned first; //!< Index of the first frame in input
+	struct cost *costs;
+	struct image head, tail; //!< The first and the last frames
+};
+
+struct worker {
+	pthread_t thread;
+	AVCodecContext *cc;
+	struct SwsContext *sc;
+	AVFrame *frame;
+	struct image cur, prev;
+};
+
+static struct {
+	struct chunk **chunks;
+	unsigned size, head, count;
+} queue;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool finishing;
+
+/* Result of analysis */
+static struct cost *costs;
+static unsigned nframes;
+
+struct segment {
+	unsigned start;
+	bool cut; //!< Segment starts a new scene
+	double offset; //!< QP offset from base QP
+	double weight; //!< Sum of modelled frame sizes at QP 0
+	double rest; //!< Sum of weights of this and next segments at their offsets
+	int qp;
+};
+
+static struct {
+	bool enabled;
+	int fd;
+	unsigned from, to; //!< Range of planned frames
+	unsigned queued, encoded;
+	uint64_t target, bytes;
+	double *model; //!< Modelled size of queued frames
+	double queued_model, encoded_model;
+	struct segment *segs;
+	unsigned nsegs, seg; //!< Next segment to start
+	int base; //!< Base QP
+	bool calibrated;
+	int offset; //!< Difference of I frame QP from P frame QP
+	int min, max; //!< P frame QP range of device
+	int imin, imax; //!< I frame QP range of device
+	bool forcekey;
+	unsigned cuts;
+	int qpmin, qpmax;
+} plan;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void image_copy(struct image *const dst, struct image const *const src)
+{
+	size_t const size = src->width * src->height;
+
+	dst->data = malloc(size);
+	if (!dst->data) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	memcpy(dst->data, src->data, size);
+	dst->width = src->width;
+	dst->height = src->height;
+}
+
+/*
+ * Costs are sums of absolute differences from prediction in macroblocks:
+ * intra prediction is macroblock mean, inter prediction is the same
+ * macroblock of the previous frame. Prediction of a frame chooses the
+ * cheaper one per macroblock.
+ */
+static void frame_cost(struct image const *const cur, struct image const *const prev,
+		struct cost *const cost)
+{
+	bool const inter = prev && prev->width == cur->width &&
+			prev->height == cur->height;
+	int const stride = cur->width;
+	uint32_t intra = 0, pred = 0;
+
+	for (int y = 0; y < cur->height; y += TWOPASS_MB)
+		for (int x = 0; x < cur->width; x += TWOPASS_MB) {
+			uint8_t const *const p = cur->data + y * stride + x;
+			uint8_t const *const q = inter ? prev->data + y * stride + x : NULL;
+			unsigned sum = 0, dev = 0, diff = 0;
+
+			for (int j = 0; j < TWOPASS_MB; j++)
+				for (int i = 0; i < TWOPASS_MB; i++)
+					sum += p[j * stride + i];
+
+			int const mean = (sum + TWOPASS_MB * TWOPASS_MB / 2) /
+					(TWOPASS_MB * TWOPASS_MB);
+
+			for (int j = 0; j < TWOPASS_MB; j++)
+				for (int i = 0; i < TWOPASS_MB; i++) {
+					dev += abs(p[j * stride + i] - mean);
+					if (inter)
+						diff += abs(p[j * stride + i] - q[j * stride + i]);
+				}
+
+			intra += dev + TWOPASS_MB_OVERHEAD;
+			pred += (inter && diff < dev ? diff : dev) + TWOPASS_MB_OVERHEAD;
+		}
+
+	cost->intra = intra;
+	cost->inter = pred;
+}
+
+static void analyse_frame(struct worker *const w, struct chunk *const c,
+		unsigned const n)
+{
+	AVFrame const *const frame = w->frame;
+	int const width = frame->width / (TWOPASS_SCALE * TWOPASS_MB) * TWOPASS_MB;
+	int const height = frame->height / (TWOPASS_SCALE * TWOPASS_MB) * TWOPASS_MB;
+
+	if (width == 0 || height == 0)
+		error(EXIT_FAILURE, 0, "Analysis: Frame %dx%d is too small",
+				frame->width, frame->height);
+
+	if (width != w->cur.width || height != w->cur.height) {
+		free(w->cur.data);
+		w->cur.data = malloc(width * height);
+		if (!w->cur.data) error(EXIT_FAILURE, 0, "Not enough memory");
+		w->cur.width = width;
+		w->cur.height = height;
+	}
+
+	/* Area averaging gives means of 4x4 pixel blocks */
+	w->sc = sws_getCachedContext(w->sc, frame->width, frame->height,
+			frame->format, width, height, AV_PIX_FMT_GRAY8, SWS_AREA,
+			NULL, NULL, NULL);
+	if (!w->sc) error(EXIT_FAILURE, 0, "Analysis: Can not allocate swscale context");
+
+	uint8_t *const dst[4] = { w->cur.data };
+	int const stride[4] = { width };
+
+	sws_scale(w->sc, (uint8_t const * const *)frame->data, frame->linesize, 0,
+			frame->height, dst, stride);
+
+	/* Difference from the previous GOP is found after all are decoded */
+	frame_cost(&w->cur, n ? &w->prev : NULL, &c->costs[n]);
+
+	if (n == 0)
+		image_copy(&c->head, &w->cur);
+
+	struct image const tmp = w->prev;
+	w->prev = w->cur;
+	w->cur = tmp;
+}
+
+static void decode_chunk(struct worker *const w, struct chunk *const c)
+{
+	unsigned n = 0;
+
+	c->costs = calloc(c->npkts, sizeof(*c->costs));
+	if (!c->costs) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	for (unsigned i = 0; i <= c->npkts; i++) {
+		/* Damaged packet only affects costs */
+		if (avcodec_send_packet(w->cc, i < c->npkts ? &c->pkts[i] : NULL) < 0)
+			pr_verb("Analysis: Failed to decode frame %u", c->first + i);
+
+		while (avcodec_receive_frame(w->cc, w->frame) == 0) {
+			if (n < c->npkts)
+				analyse_frame(w, c, n++);
+			av_frame_unref(w->frame);
+		}
+	}
+
+	/* Decoder is reused for the next GOP */
+	avcodec_flush_buffers(w->cc);
+
+	/* Frames referencing previous GOP may be dropped */
+	if (n == 0)
+		error(EXIT_FAILURE, 0, "Analysis: Can not decode frames from %u",
+				c->first);
+	for (unsigned i = n; i < c->npkts; i++)
+		c->costs[i] = c->costs[n - 1];
+
+	image_copy(&c->tail, &w->prev);
+
+	for (unsigned i = 0; i < c->npkts; i++)
+		av_packet_unref(&c->pkts[i]);
+	free(c->pkts);
+	c->pkts = NULL;
+}
+
+static void *worker_thread(void *const arg)
+{
+	struct worker *const w = arg;
+
+	while (true) {
+		pthread_mutex_lock(&lock);
+		while (queue.count == 0 && !finishing)
+			pthread_cond_wait(&cond, &lock);
+
+		if (queue.count == 0) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+
+		struct chunk *const c = queue.chunks[queue.head];
+		queue.head = (queue.head + 1) % queue.size;
+		queue.count--;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+
+		decode_chunk(w, c);
+	}
+
+	return NULL;
+}
+
+static void submit(struct chunk *const c)
+{
+	pthread_mutex_lock(&lock);
+	while (queue.count == queue.size)
+		pthread_cond_wait(&cond, &lock);
+
+	queue.chunks[(queue.head + queue.count) % queue.size] = c;
+	queue.count++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void twopass_analyse(char const *const input, unsigned const nthreads)
+{
+	AVFormatContext *ifc = NULL;
+	AVPacket packet;
+	struct chunk **chunks = NULL, *chunk = NULL;
+	unsigned nchunks = 0;
+	int stream = -1, rc;
+	unsigned const threads = nthreads ?: sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* Input is read sequentially once */
+	if (input_open(&ifc, input, NULL, NULL, INPUT_READAHEAD, 0) < 0)
+		error(EXIT_FAILURE, 0, "Analysis: Can't open file: %s!", input);
+
+	if (avformat_find_stream_info(ifc, NULL) < 0)
+		error(EXIT_FAILURE, 0, "Analysis: Could not find stream information");
+
+	for (int i = 0; i < ifc->nb_streams && stream < 0; i++)
+		if (ifc->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+			stream = i;
+
+	if (stream < 0)
+		error(EXIT_FAILURE, 0, "Analysis: Didn't find a video stream");
+
+	AVCodecParameters const *const par = ifc->streams[stream]->codecpar;
+	AVCodec *const codec = avcodec_find_decoder(par->codec_id);
+	if (!codec)
+		error(EXIT_FAILURE, 0, "Analysis: Unsupported codec");
+
+	struct worker *const workers = calloc(threads, sizeof(*workers));
+	queue.size = threads * TWOPASS_QUEUE;
+	queue.chunks = calloc(queue.size, sizeof(*queue.chunks));
+	if (!workers || !queue.chunks) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	double const start = now();
+
+	/* Threads decode different GOPs, so each decoder is single-threaded */
+	for (unsigned i = 0; i < threads; i++) {
+		struct worker *const w = &workers[i];
+
+		w->cc = avcodec_alloc_context3(codec);
+		w->frame = av_frame_alloc();
+		if (!w->cc || !w->frame) error(EXIT_FAILURE, 0, "Not enough memory");
+
+		if (avcodec_parameters_to_context(w->cc, par))
+			error(EXIT_FAILURE, 0, "Analysis: Failed to copy codec parameters");
+
+		w->cc->thread_count = 1;
+
+		if (avcodec_open2(w->cc, codec, NULL) < 0)
+			error(EXIT_FAILURE, 0, "Analysis: Could not open codec");
+
+		rc = pthread_create(&w->thread, NULL, worker_thread, w);
+		if (rc)
+			error(EXIT_FAILURE, rc, "Analysis: Can not create thread");
+	}
+
+	while ((rc = av_read_frame(ifc, &packet)) == 0) {
+		if (packet.stream_index != stream) {
+			av_packet_unref(&packet);
+			continue;
+		}
+
+		if (chunk && packet.flags & AV_PKT_FLAG_KEY) {
+			submit(chunk);
+			chunk = NULL;
+		}
+
+		if (!chunk) {
+			chunks = realloc(chunks, (nchunks + 1) * sizeof(*chunks));
+			chunk = calloc(1, sizeof(*chunk));
+			if (!chunks || !chunk) error(EXIT_FAILURE, 0, "Not enough memory");
+
+			chunk->first = nframes;
+			chunks[nchunks++] = chunk;
+		}
+
+		chunk->pkts = realloc(chunk->pkts, (chunk->npkts + 1) * sizeof(*chunk->pkts));
+		if (!chunk->pkts) error(EXIT_FAILURE, 0, "Not enough memory");
+
+		av_packet_move_ref(&chunk->pkts[chunk->npkts++], &packet);
+		nframes++;
+	}
+
+	if (rc != AVERROR_EOF)
+		error(EXIT_FAILURE, 0, "Analysis: Failed to read next packet: %d", rc);
+
+	if (chunk)
+		submit(chunk);
+
+	pthread_mutex_lock(&lock);
+	finishing = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (unsigned i = 0; i < threads; i++) {
+		struct worker *const w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		avcodec_free_context(&w->cc);
+		av_frame_free(&w->frame);
+		sws_freeContext(w->sc);
+		free(w->cur.data);
+		free(w->prev.data);
+	}
+
+	if (nframes == 0)
+		error(EXIT_FAILURE, 0, "Analysis: No frames in %s", input);
+
+	costs = malloc(nframes * sizeof(*costs));
+	if (!costs) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	for (unsigned i = 0; i < nchunks; i++) {
+		struct chunk *const c = chunks[i];
+
+		memcpy(&costs[c->first], c->costs, c->npkts * sizeof(*costs));
+		if (i > 0)
+			frame_cost(&c->head, &chunks[i - 1]->tail, &costs[c->first]);
+	}
+
+	for (unsigned i = 0; i < nchunks; i++) {
+		free(chunks[i]->costs);
+		free(chunks[i]->head.data);
+		free(chunks[i]->tail.data);
+		free(chunks[i]);
+	}
+
+	double const time = now() - start;
+
+	pr_info("Analysis: %u frames in %u GOPs in %.1f s (%.1f FPS), %u threads",
+			nframes, nchunks, time, nframes / time, threads);
+
+	free(chunks);
+	free(workers);
+	free(queue.chunks);
+	input_close(&ifc);
+}
+
+static int clamp(int const value, int const min, int const max)
+{
+	return value < min ? min : value > max ? max : value;
+}
+
+/* Buttons are write-only, they report 0 when present */
+static int query_ctrl(uint32_t const id, int *const min, int *const max)
+{
+	struct v4l2_query_ext_ctrl qc = { .id = id };
+	struct v4l2_ext_control ctrl = { .id = id };
+
+	if (query_ext_ctrl_ioctl(plan.fd, &qc))
+		return -1;
+
+	if (qc.type != V4L2_CTRL_TYPE_BUTTON &&
+			v4l2_try_g_ext_ctrls(plan.fd, V4L2_CTRL_CLASS_MPEG, 1, &ctrl))
+		return -1;
+
+	if (min) *min = qc.minimum;
+	if (max) *max = qc.maximum;
+
+	return ctrl.value;
+}
+
+static bool is_cut(unsigned const f, unsigned const last)
+{
+	return f - last >= TWOPASS_MIN_SCENE &&
+			costs[f].inter > TWOPASS_SCENECUT * costs[f].intra;
+}
+
+/* Modelled frame size at QP 0, key frames are coded with QP offset */
+static double frame_weight(unsigned const f, bool const key)
+{
+	return key ? costs[f].intra * exp2(-plan.offset / 6.0) : costs[f].inter;
+}
+
+void twopass_init(int const fd, uint64_t const size, unsigned const first,
+		unsigned const count)
+{
+	unsigned last = first, gop;
+
+	if (first >= nframes)
+		error(EXIT_FAILURE, 0, "Analysis has %u frames, none is encoded", nframes);
+
+	plan.fd = fd;
+	plan.from = first;
+	plan.to = count && first + count < nframes ? first + count : nframes;
+
+	int const qpi = query_ctrl(V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP, &plan.imin,
+			&plan.imax);
+	int const qpp = query_ctrl(V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP, &plan.min,
+			&plan.max);
+	if (qpi < 0 || qpp < 0)
+		error(EXIT_FAILURE, 0, "Two-pass encoding requires QP controls");
+
+	int const gopsize = query_ctrl(V4L2_CID_MPEG_VIDEO_GOP_SIZE, NULL, NULL);
+	gop = gopsize > 0 ? gopsize : TWOPASS_SEGMENT;
+
+	plan.forcekey = query_ctrl(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, NULL, NULL) >= 0;
+	if (!plan.forcekey)
+		pr_warn("Encoder can not force key frames, they are not placed at scene cuts");
+
+	plan.offset = qpi - qpp;
+	plan.base = qpp;
+	plan.calibrated = false;
+	plan.target = size;
+	plan.bytes = 0;
+	plan.queued = plan.encoded = 0;
+	plan.queued_model = plan.encoded_model = 0;
+	plan.cuts = 0;
+	plan.qpmin = plan.max;
+	plan.qpmax = plan.min;
+
+	plan.model = calloc(plan.to - plan.from, sizeof(*plan.model));
+	plan.segs = calloc(plan.to - plan.from, sizeof(*plan.segs));
+	if (!plan.model || !plan.segs) error(EXIT_FAILURE, 0, "Not enough memory");
+
+	plan.nsegs = 0;
+	for (unsigned f = plan.from; f < plan.to; f++) {
+		bool const cut = f > plan.from && is_cut(f, last);
+		struct segment *s = plan.nsegs ? &plan.segs[plan.nsegs - 1] : NULL;
+
+		if (cut)
+			last = f;
+
+		if (!s || cut || f - s->start >= gop) {
+			s = &plan.segs[plan.nsegs++];
+			s->start = f;
+			s->cut = cut;
+			plan.cuts += cut;
+		}
+
+		s->weight += frame_weight(f, f == plan.from || (cut && plan.forcekey));
+	}
+
+	/* Complexity relative to geometric mean of frames */
+	double logmean = 0;
+
+	for (unsigned i = 0; i < plan.nsegs; i++) {
+		struct segment *const s = &plan.segs[i];
+		unsigned const end = i + 1 < plan.nsegs ? s[1].start : plan.to;
+
+		logmean += log2(s->weight / (end - s->start)) * (end - s->start);
+	}
+	logmean /= plan.to - plan.from;
+
+	for (unsigned i = 0; i < plan.nsegs; i++) {
+		struct segment *const s = &plan.segs[i];
+		unsigned const end = i + 1 < plan.nsegs ? s[1].start : plan.to;
+		double const offset = 6 * (1 - TWOPASS_QCOMP) *
+				(log2(s->weight / (end - s->start)) - logmean);
+
+		s->offset = fmax(fmin(offset, TWOPASS_MAX_OFFSET), -TWOPASS_MAX_OFFSET);
+	}
+
+	for (unsigned i = plan.nsegs; i-- > 0;) {
+		struct segment *const s = &plan.segs[i];
+
+		s->rest = s->weight * exp2(-s->offset / 6) +
+				(i + 1 < plan.nsegs ? s[1].rest : 0);
+	}
+
+	plan.seg = 0;
+	plan.enabled = true;
+
+	pr_info("Two-pass: %u frames in %u segments, %u scene cuts, target %" PRIu64
+			" KiB", plan.to - plan.from, plan.nsegs, plan.cuts, size / 1024);
+}
+
+static void segment_start(struct segment *const s)
+{
+	struct v4l2_ext_control ctrls[3] = {
+		{ .id = V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP },
+		{ .id = V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP },
+		{ .id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME }
+	};
+
+	/* Bits per modelled unit are known from encoded frames */
+	if (plan.encoded_model > 0) {
+		double const k = plan.bytes * 8 / plan.encoded_model;
+		unsigned const left = plan.to - s->start;
+		double budget = (plan.target - (double)plan.bytes) * 8 -
+				k * (plan.queued_model - plan.encoded_model);
+
+		/* Overspent target is not reachable, quality is kept sane */
+		budget = fmax(budget, plan.target * 8.0 * left / (plan.to - plan.from) / 4);
+
+		int const base = lrint(6 * log2(k * s->rest / budget));
+
+		plan.base = plan.calibrated ? clamp(base, plan.base - TWOPASS_STEP,
+				plan.base + TWOPASS_STEP) : base;
+		plan.calibrated = true;
+	}
+
+	s->qp = clamp(lrint(plan.base + s->offset), plan.min, plan.max);
+	ctrls[0].value = clamp(s->qp + plan.offset, plan.imin, plan.imax);
+	ctrls[1].value = s->qp;
+	ctrls[2].value = 1;
+
+	v4l2_s_ext_ctrls(plan.fd, V4L2_CTRL_CLASS_MPEG,
+			s->cut && plan.forcekey ? 3 : 2, ctrls);
+
+	if (s->qp < plan.qpmin) plan.qpmin = s->qp;
+	if (s->qp > plan.qpmax) plan.qpmax = s->qp;
+
+	pr_debug("Two-pass: segment at frame %u%s, QP %d (base %d, offset %+.1f)",
+			s->start, s->cut ? " (scene cut)" : "", s->qp, plan.base, s->offset);
+}
+
+void twopass_queue(void)
+{
+	unsigned const f = plan.from + plan.queued;
+
+	if (!plan.enabled || f >= plan.to)
+		return;
+
+	if (plan.seg < plan.nsegs && plan.segs[plan.seg].start == f)
+		segment_start(&plan.segs[plan.seg++]);
+
+	struct segment const *const cur = &plan.segs[plan.seg - 1];
+	bool const key = f == cur->start && (f == plan.from || (cur->cut && plan.forcekey));
+	double const model = frame_weight(f, key) * exp2(-cur->qp / 6.0);
+
+	plan.model[plan.queued++] = model;
+	plan.queued_model += model;
+}
+
+void twopass_encoded(size_t const bytes)
+{
+	if (!plan.enabled || plan.encoded >= plan.queued)
+		return;
+
+	plan.bytes += bytes;
+	plan.encoded_model += plan.model[plan.encoded++];
+}
+
+void twopass_finish(void)
+{
+	if (!plan.enabled)
+		return;
+
+	pr_info("Two-pass: %" PRIu64 " KiB of %" PRIu64 " KiB target, QP %d-%d",
+			plan.bytes / 1024, plan.target / 1024, plan.qpmin, plan.qpmax);
+
+	free(plan.model);
+	free(plan.segs);
+	plan.enabled = false;
+}
@@ -0,0 +1,39 @@
+/*
+ * Two-pass encoding definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef TWOPASS_H
+#define TWOPASS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The first pass decodes input in parallel: demuxed packets are split into
+ * GOPs that are decoded by independent threads. Every frame is reduced to
+ * 1/4 scale luma, its intra cost is the deviation of 16x16 blocks from their
+ * means and its inter cost also counts difference from the previous frame
+ * for blocks that are cheaper to predict. Frames that are mostly cheaper to
+ * code as intra start new scenes.
+ *
+ * The second pass encodes input split into segments at scene cuts and at
+ * GOP size. Complex segments get higher QP, as their artifacts are less
+ * visible. QP of all segments is shifted to meet the size target, the
+ * relation of frame size to cost is calibrated by frames encoded so far.
+ * Key frames are forced at scene cuts if the device supports it.
+ *
+ * twopass_queue() must be called before a frame is queued to encoder, so
+ * controls apply to it.
+ */
+void twopass_analyse(char const *const input, unsigned const threads);
+void twopass_init(int const fd, uint64_t const size, unsigned const first,
+		unsigned const count);
+void twopass_queue(void);
+void twopass_encoded(size_t const bytes);
+void twopass_finish(void);
+
+#endif /* TWOPASS_H */
@@ -0,0 +1,687 @@
+/*
+ * V4L2 session recording and replay implementation
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/videodev2.h>
+
+#include "log.h"
+#include "v4l2-trace.h"
+
+#define ROUND_UP(x, a) (((x)+(a)-1)&~((a)-1))
+
+#define NSEC_IN_SEC 1000000000
+#define MAX_DEVICES 8
+
+#define REPLAY_PAGE 4096
+#define REPLAY_MAX_RESULTS (2 * VIDEO_MAX_FRAME)
+
+uint64_t v4l2_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_IN_SEC + ts.tv_nsec;
+}
+
+/* Recording */
+
+static FILE *trace;
+static uint64_t trace_start;
+static int trace_fds[MAX_DEVICES];
+static unsigned trace_ndevices;
+static uint64_t ready_in[MAX_DEVICES], ready_out[MAX_DEVICES];
+
+static void v4l2_trace_close(void)
+{
+	if (trace && fclose(trace))
+		pr_err("Failed to write V4L2 trace");
+
+	trace = NULL;
+}
+
+void v4l2_trace_open(char const *const path)
+{
+	struct v4l2_trace_header const header = {
+		.magic = V4L2_TRACE_MAGIC,
+		.version = V4L2_TRACE_VERSION,
+		.record_size = sizeof(struct v4l2_trace_record)
+	};
+
+	trace = fopen(path, "wb");
+	if (!trace)
+		error(EXIT_FAILURE, errno, "Can not create trace file %s", path);
+
+	if (fwrite(&header, sizeof(header), 1, trace) != 1)
+		error(EXIT_FAILURE, errno, "Can not write trace file %s", path);
+
+	trace_start = v4l2_trace_now();
+
+	/* Tools often exit via error(), so buffered records are flushed at exit */
+	atexit(v4l2_trace_close);
+
+	pr_verb("V4L2: Recording session to %s", path);
+}
+
+bool v4l2_trace_enabled(void)
+{
+	return trace != NULL;
+}
+
+static int trace_device_find(int const fd)
+{
+	for (unsigned i = 0; i < trace_ndevices; i++)
+		if (trace_fds[i] == fd)
+			return i;
+
+	return -1;
+}
+
+void v4l2_trace_device(int const fd)
+{
+	if (trace_device_find(fd) >= 0)
+		return;
+
+	if (trace_ndevices == MAX_DEVICES)
+		error(EXIT_FAILURE, 0, "Too many devices to trace");
+
+	trace_fds[trace_ndevices++] = fd;
+}
+
+void v4l2_trace_ioctl(int const fd, unsigned long const request, void const *arg,
+		int const result, uint64_t const start, uint64_t const stop)
+{
+	int const device = trace_device_find(fd);
+	struct v4l2_trace_record r = {
+		.start = start - trace_start,
+		.ready = start - trace_start,
+		.duration = stop - start,
+		.request = request,
+		.result = result,
+		.device = device < 0 ? UINT8_MAX : device
+	};
+
+	switch (request) {
+	case VIDIOC_QBUF:
+	case VIDIOC_DQBUF:
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer const *const buf = arg;
+
+		r.type = buf->type;
+		r.index = buf->index;
+		r.bytesused = buf->bytesused;
+		r.flags = buf->flags;
+
+		if (request == VIDIOC_DQBUF && device >= 0) {
+			uint64_t *const ready = V4L2_TYPE_IS_OUTPUT(buf->type) ?
+					&ready_out[device] : &ready_in[device];
+
+			if (*ready) {
+				r.ready = *ready - trace_start;
+				*ready = 0;
+			}
+		}
+		break;
+	}
+	case VIDIOC_REQBUFS: {
+		struct v4l2_requestbuffers const *const req = arg;
+
+		r.type = req->type;
+		r.index = req->count;
+		break;
+	}
+	case VIDIOC_S_FMT:
+	case VIDIOC_G_FMT: {
+		struct v4l2_format const *const f = arg;
+
+		r.type = f->type;
+		r.bytesused = f->fmt.pix.sizeimage;
+		break;
+	}
+	case VIDIOC_STREAMON:
+	case VIDIOC_STREAMOFF:
+		r.type = *(int const *)arg;
+		break;
+	}
+
+	if (fwrite(&r, sizeof(r), 1, trace) != 1)
+		error(EXIT_FAILURE, errno, "Can not write trace");
+}
+
+void v4l2_trace_poll(struct pollfd const *fds, nfds_t const nfds, uint64_t const time)
+{
+	for (nfds_t i = 0; i < nfds; i++) {
+		int const device = trace_device_find(fds[i].fd);
+
+		if (device < 0)
+			continue;
+
+		if ((fds[i].revents & POLLIN) && !ready_in[device])
+			ready_in[device] = time;
+
+		if ((fds[i].revents & POLLOUT) && !ready_out[device])
+			ready_out[device] = time;
+	}
+}
+
+/* Replay */
+
+static struct replay {
+	int fd;
+
+	struct replay_frame {
+		uint64_t out_latency; //!< From OUTPUT QBUF to OUTPUT buffer done
+		uint64_t cap_latency; //!< From OUTPUT QBUF to CAPTURE buffer done
+		uint32_t bytesused;
+		uint32_t flags;
+	} *frames;
+	unsigned nframes, next;
+	uint32_t max_bytesused;
+
+	struct replay_queue {
+		struct v4l2_format fmt;
+		enum v4l2_memory memory;
+		unsigned count;
+		uint32_t size; //!< Size of allocated buffers
+		struct replay_buffer {
+			void *mem;
+			bool queued;
+			uint64_t ready;
+			struct timeval timestamp;
+		} bufs[VIDEO_MAX_FRAME];
+		unsigned fifo[VIDEO_MAX_FRAME], head, len;
+		uint64_t last_ready;
+	} out, cap;
+
+	struct replay_result {
+		uint64_t ready;
+		uint32_t bytesused, flags;
+		struct timeval timestamp;
+	} results[REPLAY_MAX_RESULTS];
+	unsigned rhead, rlen;
+	bool stopping; //!< Stop command is received, last buffer is not returned
+} replay = { .fd = -1 };
+
+static uint64_t latency(uint64_t const from, uint64_t const to)
+{
+	return to > from ? to - from : 0;
+}
+
+/* Returns -1 and sets errno if trace can not be replayed */
+static int replay_load(char const *const path)
+{
+	struct v4l2_trace_header header;
+	struct v4l2_trace_record r;
+	uint64_t *qout = NULL, *dout = NULL;
+	unsigned nqout = 0, ndout = 0, ncap = 0, size = 0;
+	int device = -1, err;
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		err = errno;
+		pr_warn("Can not open trace file %s: %s", path, strerror(err));
+		errno = err;
+		return -1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    strncmp(header.magic, V4L2_TRACE_MAGIC, sizeof(header.magic)) ||
+	    header.version != V4L2_TRACE_VERSION ||
+	    header.record_size != sizeof(r)) {
+		pr_warn("Unsupported trace file %s", path);
+		err = EINVAL;
+		goto fail;
+	}
+
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if (r.result)
+			continue;
+
+		/* Replay the first device which encodes frames */
+		if (device < 0 && r.request == VIDIOC_QBUF &&
+		    r.type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+			device = r.device;
+
+		if (r.device != device)
+			continue;
+
+		if (size == nqout || size == ndout || size == ncap) {
+			size = size ? size * 2 : 1024;
+
+			void *const q = realloc(qout, size * sizeof(*qout));
+			if (q) qout = q;
+			void *const d = realloc(dout, size * sizeof(*dout));
+			if (d) dout = d;
+			void *const c = realloc(replay.frames, size * sizeof(*replay.frames));
+			if (c) replay.frames = c;
+
+			if (!q || !d || !c) {
+				pr_warn("Not enough memory to replay %s", path);
+				err = ENOMEM;
+				goto fail;
+			}
+		}
+
+		if (r.request == VIDIOC_QBUF && r.type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+			qout[nqout++] = r.start;
+		} else if (r.request == VIDIOC_DQBUF &&
+			   r.type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+			dout[ndout++] = r.ready;
+		} else if (r.request == VIDIOC_DQBUF &&
+			   r.type == V4L2_BUF_TYPE_VIDEO_CAPTURE && r.bytesused) {
+			replay.frames[ncap].cap_latency = r.ready;
+			replay.frames[ncap].bytesused = r.bytesused;
+			replay.frames[ncap].flags = r.flags &
+				(V4L2_BUF_FLAG_KEYFRAME | V4L2_BUF_FLAG_PFRAME |
+				 V4L2_BUF_FLAG_BFRAME);
+			ncap++;
+
+			if (r.bytesused > replay.max_bytesused)
+				replay.max_bytesused = r.bytesused;
+		}
+	}
+
+	replay.nframes = nqout < ncap ? nqout : ncap;
+	if (replay.nframes == 0) {
+		pr_warn("Trace %s does not contain encoded frames", path);
+		err = EINVAL;
+		goto fail;
+	}
+
+	for (unsigned i = 0; i < replay.nframes; i++) {
+		struct replay_frame *const frame = &replay.frames[i];
+
+		frame->cap_latency = latency(qout[i], frame->cap_latency);
+		frame->out_latency = i < ndout ? latency(qout[i], dout[i]) : 0;
+	}
+
+	fclose(f);
+	free(qout);
+	free(dout);
+
+	pr_info("V4L2: Replaying %u frames from %s", replay.nframes, path);
+
+	return 0;
+
+fail:
+	fclose(f);
+	free(qout);
+	free(dout);
+	free(replay.frames);
+	replay.frames = NULL;
+	replay.nframes = replay.max_bytesused = 0;
+	errno = err;
+	return -1;
+}
+
+int v4l2_replay_open(char const *const path)
+{
+	if (replay.fd >= 0) {
+		pr_warn("Only one device can be replayed");
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (replay_load(path))
+		return -1;
+
+	/* Descriptor is only used as a handle */
+	replay.fd = open("/dev/null", O_RDWR);
+
+	return replay.fd;
+}
+
+bool v4l2_replay_is(int const fd)
+{
+	return fd >= 0 && fd == replay.fd;
+}
+
+static struct replay_queue *replay_queue(uint32_t const type)
+{
+	switch (type) {
+	case V4L2_BUF_TYPE_VIDEO_OUTPUT: return &replay.out;
+	case V4L2_BUF_TYPE_VIDEO_CAPTURE: return &replay.cap;
+	default: return NULL;
+	}
+}
+
+static void replay_wait(uint64_t const time)
+{
+	uint64_t const now = v4l2_trace_now();
+
+	if (time > now) {
+		struct timespec const ts = {
+			.tv_sec = (time - now) / NSEC_IN_SEC,
+			.tv_nsec = (time - now) % NSEC_IN_SEC
+		};
+
+		while (nanosleep(&ts, NULL) && errno == EINTR)
+			;
+	}
+}
+
+static int replay_fmt(struct replay_queue *const q, struct v4l2_format *const f)
+{
+	struct v4l2_pix_format *const pix = &f->fmt.pix;
+
+	if (q == &replay.out) {
+		if (pix->bytesperline < pix->width)
+			pix->bytesperline = pix->width;
+		pix->sizeimage = pix->bytesperline * pix->height * 3 / 2;
+	} else {
+		pix->bytesperline = 0;
+		pix->sizeimage = ROUND_UP(replay.max_bytesused, REPLAY_PAGE);
+	}
+
+	/* Allocated buffers are kept while they fit new format */
+	if (q->count && pix->sizeimage > q->size)
+		return EBUSY;
+
+	q->fmt = *f;
+
+	return 0;
+}
+
+static int replay_reqbufs(struct replay_queue *const q,
+		struct v4l2_requestbuffers *const req)
+{
+	for (unsigned i = 0; i < q->count; i++) {
+		free(q->bufs[i].mem);
+		q->bufs[i].mem = NULL;
+		q->bufs[i].queued = false;
+	}
+
+	if (req->count > VIDEO_MAX_FRAME)
+		req->count = VIDEO_MAX_FRAME;
+
+	q->count = req->count;
+	q->memory = req->memory;
+	q->size = q->fmt.fmt.pix.sizeimage;
+	q->head = q->len = 0;
+
+	if (req->memory == V4L2_MEMORY_MMAP)
+		for (unsigned i = 0; i < q->count; i++) {
+			q->bufs[i].mem = calloc(1, q->fmt.fmt.pix.sizeimage);
+			if (!q->bufs[i].mem)
+				return ENOMEM;
+		}
+
+	return 0;
+}
+
+static void replay_fill(struct replay_queue const *const q, unsigned const index,
+		struct v4l2_buffer *const buf)
+{
+	buf->index = index;
+	buf->length = q->size;
+	buf->flags = q->bufs[index].queued ? V4L2_BUF_FLAG_QUEUED : 0;
+
+	if (q->memory == V4L2_MEMORY_MMAP)
+		buf->m.offset = (index + (q == &replay.cap ? VIDEO_MAX_FRAME : 0)) *
+				REPLAY_PAGE;
+}
+
+static int replay_qbuf(struct replay_queue *const q, struct v4l2_buffer *const buf)
+{
+	if (buf->index >= q->count || q->bufs[buf->index].queued)
+		return EINVAL;
+
+	struct replay_buffer *const b = &q->bufs[buf->index];
+
+	if (q == &replay.out) {
+		struct replay_frame const *const frame =
+				&replay.frames[replay.next++ % replay.nframes];
+		uint64_t const now = v4l2_trace_now();
+
+		if (replay.rlen == REPLAY_MAX_RESULTS)
+			return ENOBUFS;
+
+		/* Device processes frames in order */
+		b->ready = now + frame->out_latency;
+		if (b->ready < q->last_ready)
+			b->ready = q->last_ready;
+		q->last_ready = b->ready;
+
+		struct replay_result *const res = &replay.results[
+				(replay.rhead + replay.rlen++) % REPLAY_MAX_RESULTS];
+
+		res->ready = now + frame->cap_latency;
+		if (res->ready < replay.cap.last_ready)
+			res->ready = replay.cap.last_ready;
+		replay.cap.last_ready = res->ready;
+
+		res->bytesused = frame->bytesused;
+		res->flags = frame->flags;
+		res->timestamp = buf->timestamp;
+		b->timestamp = buf->timestamp;
+	}
+
+	b->queued = true;
+	q->fifo[(q->head + q->len++) % VIDEO_MAX_FRAME] = buf->index;
+	replay_fill(q, buf->index, buf);
+
+	return 0;
+}
+
+static int replay_dqbuf(struct replay_queue *const q, struct v4l2_buffer *const buf)
+{
+	if (q->len == 0 ||
+	    (q == &replay.cap && replay.rlen == 0 && !replay.stopping))
+		return EPIPE;
+
+	unsigned const index = q->fifo[q->head];
+	struct replay_buffer *const b = &q->bufs[index];
+	uint32_t flags = 0;
+
+	if (q == &replay.cap && replay.rlen == 0) {
+		/* All frames are returned before stop command */
+		buf->bytesused = 0;
+		flags = V4L2_BUF_FLAG_LAST;
+		replay.stopping = false;
+	} else if (q == &replay.cap) {
+		struct replay_result const *const res = &replay.results[replay.rhead];
+
+		replay_wait(res->ready);
+
+		buf->bytesused = res->bytesused < q->fmt.fmt.pix.sizeimage ?
+				res->bytesused : q->fmt.fmt.pix.sizeimage;
+		buf->timestamp = res->timestamp;
+		flags = res->flags;
+		replay.rhead = (replay.rhead + 1) % REPLAY_MAX_RESULTS;
+		replay.rlen--;
+
+		if (replay.rlen == 0 && replay.stopping) {
+			flags |= V4L2_BUF_FLAG_LAST;
+			replay.stopping = false;
+		}
+	} else {
+		replay_wait(b->ready);
+		buf->timestamp = b->timestamp;
+	}
+
+	b->queued = false;
+	q->head = (q->head + 1) % VIDEO_MAX_FRAME;
+	q->len--;
+
+	replay_fill(q, index, buf);
+	buf->flags |= flags | V4L2_BUF_FLAG_DONE;
+
+	return 0;
+}
+
+int v4l2_replay_ioctl(int const fd, unsigned long const request, void *arg)
+{
+	int rc = 0;
+
+	switch (request) {
+	case VIDIOC_QUERYCAP: {
+		struct v4l2_capability *const cap = arg;
+
+		memset(cap, 0, sizeof(*cap));
+		strncpy((char *)cap->driver, "replay", sizeof(cap->driver));
+		strncpy((char *)cap->card, "replay", sizeof(cap->card));
+		cap->device_caps = V4L2_CAP_VIDEO_M2M | V4L2_CAP_STREAMING;
+		cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+		break;
+	}
+	case VIDIOC_S_FMT:
+	case VIDIOC_TRY_FMT:
+	case VIDIOC_G_FMT: {
+		struct v4l2_format *const f = arg;
+		struct replay_queue *const q = replay_queue(f->type);
+
+		if (!q)
+			rc = EINVAL;
+		else if (request == VIDIOC_G_FMT)
+			*f = q->fmt;
+		else if (request == VIDIOC_S_FMT)
+			rc = replay_fmt(q, f);
+		break;
+	}
+	case VIDIOC_REQBUFS: {
+		struct v4l2_requestbuffers *const req = arg;
+		struct replay_queue *const q = replay_queue(req->type);
+
+		rc = q ? replay_reqbufs(q, req) : EINVAL;
+		break;
+	}
+	case VIDIOC_QUERYBUF: {
+		struct v4l2_buffer *const buf = arg;
+		struct replay_queue *const q = replay_queue(buf->type);
+
+		if (!q || buf->index >= q->count)
+			rc = EINVAL;
+		else
+			replay_fill(q, buf->index, buf);
+		break;
+	}
+	case VIDIOC_QBUF:
+	case VIDIOC_DQBUF: {
+		struct v4l2_buffer *const buf = arg;
+		struct replay_queue *const q = replay_queue(buf->type);
+
+		if (!q)
+			rc = EINVAL;
+		else if (request == VIDIOC_QBUF)
+			rc = replay_qbuf(q, buf);
+		else
+			rc = replay_dqbuf(q, buf);
+		break;
+	}
+	case VIDIOC_STREAMON:
+		break;
+	case VIDIOC_STREAMOFF: {
+		struct replay_queue *const q = replay_queue(*(int *)arg);
+
+		if (!q) {
+			rc = EINVAL;
+			break;
+		}
+
+		for (unsigned i = 0; i < q->count; i++)
+			q->bufs[i].queued = false;
+		q->head = q->len = 0;
+		replay.stopping = false;
+		break;
+	}
+	case VIDIOC_ENCODER_CMD:
+	case VIDIOC_TRY_ENCODER_CMD: {
+		struct v4l2_encoder_cmd *const cmd = arg;
+
+		if (cmd->cmd != V4L2_ENC_CMD_STOP)
+			rc = EINVAL;
+		else if (request == VIDIOC_ENCODER_CMD)
+			replay.stopping = true;
+		break;
+	}
+	case VIDIOC_G_PARM: {
+		struct v4l2_streamparm *const parm = arg;
+		uint32_t const type = parm->type;
+
+		memset(parm, 0, sizeof(*parm));
+		parm->type = type;
+		break;
+	}
+	case VIDIOC_G_EXT_CTRLS:
+	case VIDIOC_S_EXT_CTRLS:
+		break;
+	case VIDIOC_QUERYCTRL:
+	case VIDIOC_QUERY_EXT_CTRL:
+	case VIDIOC_S_CTRL:
+	case VIDIOC_S_PARM:
+		rc = EINVAL;
+		break;
+	default:
+		rc = ENOTTY;
+	}
+
+	if (rc) {
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+void *v4l2_replay_mmap(int const fd, size_t const length, off_t const offset)
+{
+	unsigned index = offset / REPLAY_PAGE;
+	struct replay_queue *q = &replay.out;
+
+	if (index >= VIDEO_MAX_FRAME) {
+		index -= VIDEO_MAX_FRAME;
+		q = &replay.cap;
+	}
+
+	if (index >= q->count || !q->bufs[index].mem ||
+	    length > q->size) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	return q->bufs[index].mem;
+}
+
+static void replay_event(uint64_t const ready, uint64_t const now, short const event,
+		short *const revents, int64_t *const wait)
+{
+	if (ready <= now)
+		*revents |= event;
+	else if (ready - now < *wait)
+		*wait = ready - now;
+}
+
+short v4l2_replay_revents(int const fd, short const events, int64_t *const wait)
+{
+	uint64_t const now = v4l2_trace_now();
+	short revents = 0;
+
+	if ((events & POLLOUT) && replay.out.len)
+		replay_event(replay.out.bufs[replay.out.fifo[replay.out.head]].ready,
+				now, POLLOUT, &revents, wait);
+
+	if ((events & POLLIN) && replay.cap.len && replay.rlen)
+		replay_event(replay.results[replay.rhead].ready, now, POLLIN,
+				&revents, wait);
+	else if ((events & POLLIN) && replay.cap.len && replay.stopping)
+		revents |= POLLIN;
+
+	return revents;
+}
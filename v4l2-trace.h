@@ -0,0 +1,68 @@
+/*
+ * V4L2 session recording and replay definition
+ *
+ * Copyright 2019 RnD Center "ELVEES", JSC
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef V4L2_TRACE_H
+#define V4L2_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#define V4L2_TRACE_MAGIC "V4L2TRC"
+#define V4L2_TRACE_VERSION 1
+
+/* Device name prefix to replay recorded session instead of real device */
+#define V4L2_REPLAY_PREFIX "replay:"
+
+struct v4l2_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+/*
+ * Record of one ioctl. Times are in nanoseconds since the beginning of
+ * recording. Ready time is the time when poll() reported that the buffer
+ * can be dequeued or start time if no such poll() was made.
+ */
+struct v4l2_trace_record {
+	uint64_t start;
+	uint64_t ready;
+	uint32_t duration;
+	uint32_t request;
+	int32_t result; //!< 0 or errno
+	uint32_t bytesused;
+	uint32_t flags;
+	uint16_t index; //!< Buffer index or number of buffers for REQBUFS
+	uint8_t type;
+	uint8_t device; //!< Device number in order of opening
+};
+
+/* Recording */
+void v4l2_trace_open(char const *const path);
+void v4l2_trace_device(int const fd);
+void v4l2_trace_ioctl(int const fd, unsigned long const request, void const *arg,
+		int const result, uint64_t const start, uint64_t const stop);
+void v4l2_trace_poll(struct pollfd const *fds, nfds_t const nfds, uint64_t const time);
+bool v4l2_trace_enabled(void);
+uint64_t v4l2_trace_now(void);
+
+/*
+ * Replay. Replayed device is an M2M device that completes buffers with the
+ * same latencies and sizes as the first M2M device of the recorded
+ * session. Only one replayed device is supported, opening of another one
+ * fails with EBUSY.
+ */
+int v4l2_replay_open(char const *const path);
+bool v4l2_replay_is(int const fd);
+int v4l2_replay_ioctl(int const fd, unsigned long const request, void *arg);
+void *v4l2_replay_mmap(int const fd, size_t const length, off_t const offset);
+short v4l2_replay_revents(int const fd, short const events, int64_t *const wait);
+
+#endif /* V4L2_TRACE_H */
@@ -22,10 +22,12 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <poll.h>
 
 #include <linux/videodev2.h>
 
 #include "v4l2-utils.h"
+#include "v4l2-trace.h"
 #include "log.h"
 
 static const char *v4l2_field_names[] = {
@@ -193,78 +195,255 @@ void v4l2_print_buffer(struct v4l2_buffer const *const p)
 			(p->memory == V4L2_MEMORY_MMAP) ? p->m.offset : 0);
 }
 
-int v4l2_open(char const *const device, uint32_t positive, uint32_t negative,
-		char card[32])
+int v4l2_ioctl(int const fd, unsigned long const request, void *const arg)
+{
+	uint64_t start;
+	int rc, err;
+
+	if (v4l2_replay_is(fd))
+		return v4l2_replay_ioctl(fd, request, arg);
+
+	if (!v4l2_trace_enabled())
+		return ioctl(fd, request, arg);
+
+	start = v4l2_trace_now();
+	rc = ioctl(fd, request, arg);
+	err = rc ? errno : 0;
+	v4l2_trace_ioctl(fd, request, arg, err, start, v4l2_trace_now());
+	errno = err;
+
+	return rc;
+}
+
+void *v4l2_mmap(void *const addr, size_t const length, int const prot,
+		int const flags, int const fd, off_t const offset)
+{
+	if (v4l2_replay_is(fd))
+		return v4l2_replay_mmap(fd, length, offset);
+
+	return mmap(addr, length, prot, flags, fd, offset);
+}
+
+int v4l2_munmap(int const fd, void *const addr, size_t const length)
+{
+	/* Memory of replayed buffers is freed on buffers release */
+	if (v4l2_replay_is(fd))
+		return 0;
+
+	return munmap(addr, length);
+}
+
+static bool busy_poll;
+
+void v4l2_set_busy_poll(bool const busy)
+{
+	busy_poll = busy;
+}
+
+/*
+ * Replayed devices have no kernel descriptor to wait on, so their events
+ * are computed from the replay model and the real descriptors are polled
+ * with timeout until the nearest replayed event.
+ */
+int v4l2_poll(struct pollfd fds[], nfds_t const nfds, int const timeout)
 {
-	int ret;
+	struct pollfd real[nfds];
+	uint64_t const deadline = v4l2_trace_now() + (int64_t)timeout * 1000000;
+	bool replayed = false;
+	int rc;
+
+	for (nfds_t i = 0; i < nfds; i++)
+		replayed |= v4l2_replay_is(fds[i].fd);
+
+	/* Spinning avoids scheduler wake-up latency at the cost of a CPU */
+	if (!replayed && busy_poll) {
+		do
+			rc = poll(fds, nfds, 0);
+		while (rc == 0 && (timeout < 0 || v4l2_trace_now() < deadline));
+		if (rc > 0 && v4l2_trace_enabled())
+			v4l2_trace_poll(fds, nfds, v4l2_trace_now());
+		return rc;
+	}
+
+	if (!replayed) {
+		rc = poll(fds, nfds, timeout);
+		if (rc > 0 && v4l2_trace_enabled())
+			v4l2_trace_poll(fds, nfds, v4l2_trace_now());
+		return rc;
+	}
+
+	while (true) {
+		uint64_t const now = v4l2_trace_now();
+		int64_t wait = timeout < 0 ? INT64_MAX :
+			deadline > now ? deadline - now : 0;
+		int ready = 0, ms;
+
+		for (nfds_t i = 0; i < nfds; i++) {
+			real[i] = fds[i];
+
+			if (v4l2_replay_is(fds[i].fd)) {
+				fds[i].revents = v4l2_replay_revents(fds[i].fd,
+						fds[i].events, &wait);
+				ready += fds[i].revents != 0;
+				real[i].fd = -1;
+			}
+		}
+
+		ms = ready ? 0 : wait == INT64_MAX ? -1 : (wait + 999999) / 1000000;
+
+		rc = poll(real, nfds, ms);
+		if (rc < 0)
+			return rc;
+
+		for (nfds_t i = 0; i < nfds; i++)
+			if (real[i].fd >= 0)
+				fds[i].revents = real[i].revents;
+
+		ready += rc;
+
+		if (ready || (timeout >= 0 && v4l2_trace_now() >= deadline))
+			return ready;
+	}
+}
+
+int v4l2_try_open(char const *const device, uint32_t positive,
+		uint32_t negative, char card[32])
+{
+	int ret, fd, err;
 	struct v4l2_capability cap;
 	struct stat stat;
 
-	int fd = open(device, O_RDWR, 0);
-	if (fd < 0) error(EXIT_FAILURE, errno, "Can not open %s", device);
+	if (strncmp(device, V4L2_REPLAY_PREFIX, strlen(V4L2_REPLAY_PREFIX)) == 0) {
+		fd = v4l2_replay_open(device + strlen(V4L2_REPLAY_PREFIX));
+		if (fd < 0)
+			return -1;
+	} else {
+		fd = open(device, O_RDWR, 0);
+		if (fd < 0)
+			return -1;
+
+		if (fstat(fd, &stat) == -1) {
+			err = errno;
+			goto fail;
+		} else if (!S_ISCHR(stat.st_mode)) {
+			pr_warn("%s is not a character device", device);
+			err = ENODEV;
+			goto fail;
+		}
+	}
 
 	pr_verb("V4L2: Device %s descriptor is %d", device, fd);
 
-	if (fstat(fd, &stat) == -1)
-		error(EXIT_FAILURE, errno, "Can not stat() %s", device);
-	else if (!S_ISCHR(stat.st_mode))
-		error(EXIT_FAILURE, 0, "%s is not a character device", device);
+	if (v4l2_trace_enabled())
+		v4l2_trace_device(fd);
 
-	ret = ioctl(fd, VIDIOC_QUERYCAP, &cap);
-	if (ret != 0)
-		error(EXIT_FAILURE, errno, "Can not query device capabilities");
+	ret = v4l2_ioctl(fd, VIDIOC_QUERYCAP, &cap);
+	if (ret != 0) {
+		err = errno;
+		pr_warn("Can not query device %s capabilities", device);
+		goto fail;
+	}
 
-	if ((cap.capabilities & positive) != positive)
-		error(EXIT_FAILURE, 0, "Device %s does not support required "
-				"capabilities: %#08x", device, positive);
+	if ((cap.capabilities & positive) != positive) {
+		pr_warn("Device %s does not support required capabilities: %#08x",
+				device, positive);
+		err = ENODEV;
+		goto fail;
+	}
 
-	if ((cap.capabilities & negative) != 0)
-		error(EXIT_FAILURE, 0, "Device %s supports unsupported "
-				"capabilities: %#08x", device, negative);
+	if ((cap.capabilities & negative) != 0) {
+		pr_warn("Device %s supports unsupported capabilities: %#08x",
+				device, negative);
+		err = ENODEV;
+		goto fail;
+	}
 
 	if (card) memcpy(card, cap.card, 32);
 
 	return fd;
+
+fail:
+	if (!v4l2_replay_is(fd))
+		close(fd);
+	errno = err;
+	return -1;
 }
 
-void v4l2_pix_fmt_validate(struct v4l2_pix_format const *f, uint32_t const pixelformat,
-		uint32_t const width, uint32_t const height, uint32_t const bytesperline)
+int v4l2_open(char const *const device, uint32_t positive, uint32_t negative,
+		char card[32])
 {
-	if ((f->width != width && width != 0) || (f->height != height && height != 0))
-		error(EXIT_FAILURE, 0, "Invalid size %ux%u", f->width, f->height);
+	int const fd = v4l2_try_open(device, positive, negative, card);
+
+	if (fd < 0)
+		error(EXIT_FAILURE, errno, "Can not open %s", device);
 
-	if (f->pixelformat != pixelformat)
-		error(EXIT_FAILURE, 0, "Invalid pixel format %c%c%c%c",
+	return fd;
+}
+
+int v4l2_try_pix_fmt_validate(struct v4l2_pix_format const *f,
+		uint32_t const pixelformat, uint32_t const width, uint32_t const height,
+		uint32_t const bytesperline)
+{
+	if ((f->width != width && width != 0) || (f->height != height && height != 0))
+		pr_warn("Invalid size %ux%u", f->width, f->height);
+	else if (f->pixelformat != pixelformat)
+		pr_warn("Invalid pixel format %c%c%c%c",
 		      (f->pixelformat & 0xff),
 		      (f->pixelformat >>  8) & 0xff,
 		      (f->pixelformat >> 16) & 0xff,
 		      (f->pixelformat >> 24) & 0xff);
+	else if (f->bytesperline != bytesperline && bytesperline != 0)
+		pr_warn("Invalid bytes per line %u", f->bytesperline);
+	else
+		return 0;
 
-	if (f->bytesperline != bytesperline && bytesperline != 0)
-		error(EXIT_FAILURE, 0, "Invalid bytes per line %u", f->bytesperline);
+	errno = EINVAL;
+	return -1;
 }
 
-void v4l2_setformat(int const fd, enum v4l2_buf_type const type, struct v4l2_format *f)
+void v4l2_pix_fmt_validate(struct v4l2_pix_format const *f, uint32_t const pixelformat,
+		uint32_t const width, uint32_t const height, uint32_t const bytesperline)
+{
+	if (v4l2_try_pix_fmt_validate(f, pixelformat, width, height, bytesperline))
+		error(EXIT_FAILURE, 0, "Device does not accept format");
+}
+
+int v4l2_try_setformat(int const fd, enum v4l2_buf_type const type,
+		struct v4l2_format *f)
 {
 	f->type = type;
 
 	pr_verb("V4L2: Setup format for %d %s", fd, v4l2_type_name(type));
 
-	if (ioctl(fd, VIDIOC_S_FMT, f) != 0)
-		error(EXIT_FAILURE, 0, "Can not set %s format", v4l2_type_name(type));
+	if (v4l2_ioctl(fd, VIDIOC_S_FMT, f) != 0)
+		return -1;
 
 	v4l2_print_format(f);
+
+	return 0;
 }
 
-void v4l2_getformat(int const fd, enum v4l2_buf_type const type,
+void v4l2_setformat(int const fd, enum v4l2_buf_type const type, struct v4l2_format *f)
+{
+	if (v4l2_try_setformat(fd, type, f))
+		error(EXIT_FAILURE, errno, "Can not set %s format", v4l2_type_name(type));
+}
+
+int v4l2_try_getformat(int const fd, enum v4l2_buf_type const type,
 		struct v4l2_format *f)
 {
 	f->type = type;
 
 	pr_verb("V4L2: Get format for %d %s", fd, v4l2_type_name(type));
 
-	if (ioctl(fd, VIDIOC_G_FMT, f) != 0)
-		error(EXIT_FAILURE, 0,
+	return v4l2_ioctl(fd, VIDIOC_G_FMT, f) ? -1 : 0;
+}
+
+void v4l2_getformat(int const fd, enum v4l2_buf_type const type,
+		struct v4l2_format *f)
+{
+	if (v4l2_try_getformat(fd, type, f))
+		error(EXIT_FAILURE, errno,
 		      "Can not get %s format", v4l2_type_name(type));
 }
 
@@ -297,7 +476,7 @@ void v4l2_framerate_configure(int const fd, enum v4l2_buf_type const type,
 			v4l2_type_name(type),
 			(float)timeperframe->denominator / timeperframe->numerator);
 
-	rc = ioctl(fd, VIDIOC_G_PARM, &parm);
+	rc = v4l2_ioctl(fd, VIDIOC_G_PARM, &parm);
 	if (rc != 0)
 		error(EXIT_FAILURE, 0, "Can not get device streaming parameters");
 
@@ -309,7 +488,7 @@ void v4l2_framerate_configure(int const fd, enum v4l2_buf_type const type,
 
 	*tpf = *timeperframe;
 
-	rc = ioctl(fd, VIDIOC_S_PARM, &parm);
+	rc = v4l2_ioctl(fd, VIDIOC_S_PARM, &parm);
 	if (rc != 0)
 		error(EXIT_FAILURE, 0, "Can not set device streaming parameters");
 
@@ -328,7 +507,7 @@ float v4l2_framerate_get(int const fd, enum v4l2_buf_type const type)
 		.type = type
 	};
 
-	rc = ioctl(fd, VIDIOC_G_PARM, &parm);
+	rc = v4l2_ioctl(fd, VIDIOC_G_PARM, &parm);
 
 	if (rc != 0) {
 		pr_warn("Can not get device %d %s streaming parameters", fd,
@@ -340,11 +519,9 @@ float v4l2_framerate_get(int const fd, enum v4l2_buf_type const type)
 			parm.parm.capture.timeperframe.numerator;
 }
 
-uint32_t v4l2_buffers_request(int const fd, enum v4l2_buf_type const type,
+int v4l2_try_buffers_request(int const fd, enum v4l2_buf_type const type,
 		uint32_t const num, enum v4l2_memory const memory)
 {
-	int rc;
-
 	pr_verb("V4L2: Obtaining %d %s buffers for %d %s", num,
 			v4l2_memory_name(memory), fd, v4l2_type_name(type));
 
@@ -354,24 +531,33 @@ uint32_t v4l2_buffers_request(int const fd, enum v4l2_buf_type const type,
 		.memory = memory
 	};
 
-	rc = ioctl(fd, VIDIOC_REQBUFS, &reqbuf);
+	if (v4l2_ioctl(fd, VIDIOC_REQBUFS, &reqbuf) != 0)
+		return -1;
 
-	if (rc != 0)
+	pr_debug("V4L2: Got %d %s buffers", reqbuf.count,
+			v4l2_type_name(type));
+
+	return reqbuf.count;
+}
+
+uint32_t v4l2_buffers_request(int const fd, enum v4l2_buf_type const type,
+		uint32_t const num, enum v4l2_memory const memory)
+{
+	int const count = v4l2_try_buffers_request(fd, type, num, memory);
+
+	if (count < 0)
 		error(EXIT_FAILURE, errno, "Can not request %s buffers",
 				v4l2_type_name(type));
 
-	if (reqbuf.count == 0)
+	if (count == 0)
 		error(EXIT_FAILURE, 0, "Device gives zero %s buffers",
 				v4l2_type_name(type));
 
-	if (reqbuf.count != num)
+	if (count != num)
 		error(EXIT_FAILURE, 0, "Device gives %u %s buffers, but %u is requested",
-				reqbuf.count, v4l2_type_name(type), num);
-
-	pr_debug("V4L2: Got %d %s buffers", reqbuf.count,
-			v4l2_type_name(type));
+				count, v4l2_type_name(type), num);
 
-	return reqbuf.count;
+	return count;
 }
 
 void v4l2_buffers_mmap(int const fd, enum v4l2_buf_type const type,
@@ -385,14 +571,14 @@ void v4l2_buffers_mmap(int const fd, enum v4l2_buf_type const type,
 			.type = type
 		};
 
-		rc = ioctl(fd, VIDIOC_QUERYBUF, &buf);
+		rc = v4l2_ioctl(fd, VIDIOC_QUERYBUF, &buf);
 		if (rc != 0) error(EXIT_FAILURE, errno, "Can not query buffer");
 
 		pr_debug("V4L2: Got %s buffer #%u: length = %u",
 				v4l2_type_name(type), i, buf.length);
 
 		//! \todo size field is not needed
-		bufs[i] = mmap(NULL, buf.length, prot, MAP_SHARED, fd,
+		bufs[i] = v4l2_mmap(NULL, buf.length, prot, MAP_SHARED, fd,
 				buf.m.offset);
 
 		if (bufs[i] == MAP_FAILED)
@@ -412,7 +598,7 @@ void v4l2_buffers_export(int const fd, enum v4l2_buf_type const type,
 			.type = type
 		};
 
-		rc = ioctl(fd, VIDIOC_EXPBUF, &ebuf);
+		rc = v4l2_ioctl(fd, VIDIOC_EXPBUF, &ebuf);
 		if (rc != 0)
 			error(EXIT_FAILURE, errno, "Can not export %s buffer",
 					v4l2_type_name(type));
@@ -424,74 +610,189 @@ void v4l2_buffers_export(int const fd, enum v4l2_buf_type const type,
 	}
 }
 
-void v4l2_dqbuf(int const fd, struct v4l2_buffer *const restrict buf)
+int v4l2_try_dqbuf(int const fd, struct v4l2_buffer *const restrict buf)
 {
 	int rc;
 
-	rc = ioctl(fd, VIDIOC_DQBUF, buf);
-	if (rc != 0)
+	do {
+		rc = v4l2_ioctl(fd, VIDIOC_DQBUF, buf);
+	} while (rc != 0 && errno == EINTR);
+
+	return rc ? -1 : 0;
+}
+
+void v4l2_dqbuf(int const fd, struct v4l2_buffer *const restrict buf)
+{
+	if (v4l2_try_dqbuf(fd, buf))
 		error(EXIT_FAILURE, errno, "Can not dequeue %s buffer from %d",
 				v4l2_type_name(buf->type), fd);
 }
 
-void v4l2_qbuf(int const fd, struct v4l2_buffer *const restrict buf)
+int v4l2_try_qbuf(int const fd, struct v4l2_buffer *const restrict buf)
 {
-	int rc;
-
 	pr_debug("Enqueuing buffer #%d to %d %s", buf->index, fd,
 			v4l2_type_name(buf->type));
 
 	v4l2_print_buffer(buf);
-	rc = ioctl(fd, VIDIOC_QBUF, buf);
 
-	if (rc != 0)
+	return v4l2_ioctl(fd, VIDIOC_QBUF, buf) ? -1 : 0;
+}
+
+void v4l2_qbuf(int const fd, struct v4l2_buffer *const restrict buf)
+{
+	if (v4l2_try_qbuf(fd, buf))
 		error(EXIT_FAILURE, errno, "Can not enqueue %s buffer to %d",
 				v4l2_type_name(buf->type), fd);
 }
 
-void v4l2_streamon(int const fd, enum v4l2_buf_type const type)
+int v4l2_try_streamon(int const fd, enum v4l2_buf_type const type)
 {
-	int rc;
 	pr_verb("V4L2: Stream on for %d %s", fd, v4l2_type_name(type));
 
-	rc = ioctl(fd, VIDIOC_STREAMON, &type);
-	if (rc != 0)
+	return v4l2_ioctl(fd, VIDIOC_STREAMON, (void *)&type) ? -1 : 0;
+}
+
+void v4l2_streamon(int const fd, enum v4l2_buf_type const type)
+{
+	if (v4l2_try_streamon(fd, type))
 		error(EXIT_FAILURE, errno, "Failed to start %s stream",
 				v4l2_type_name(type));
 }
 
-void v4l2_g_ext_ctrls(int const fd, uint32_t const which, uint32_t const count,
-		      struct v4l2_ext_control *const controls)
+int v4l2_try_streamoff(int const fd, enum v4l2_buf_type const type)
+{
+	pr_verb("V4L2: Stream off for %d %s", fd, v4l2_type_name(type));
+
+	return v4l2_ioctl(fd, VIDIOC_STREAMOFF, (void *)&type) ? -1 : 0;
+}
+
+void v4l2_streamoff(int const fd, enum v4l2_buf_type const type)
+{
+	if (v4l2_try_streamoff(fd, type))
+		error(EXIT_FAILURE, errno, "Failed to stop %s stream",
+				v4l2_type_name(type));
+}
+
+int v4l2_try_encoder_stop(int const fd)
+{
+	struct v4l2_encoder_cmd cmd = {
+		.cmd = V4L2_ENC_CMD_STOP
+	};
+
+	pr_verb("V4L2: Stop encoder %d", fd);
+
+	return v4l2_ioctl(fd, VIDIOC_ENCODER_CMD, &cmd) ? -1 : 0;
+}
+
+bool v4l2_encoder_stop(int const fd)
+{
+	if (v4l2_try_encoder_stop(fd) == 0)
+		return true;
+
+	if (errno != ENOTTY && errno != EINVAL)
+		error(EXIT_FAILURE, errno, "Can not stop encoder %d", fd);
+
+	pr_verb("V4L2: Device %d does not support encoder commands", fd);
+
+	return false;
+}
+
+int v4l2_try_subscribe_event(int const fd, uint32_t const type)
+{
+	struct v4l2_event_subscription sub = {
+		.type = type
+	};
+
+	pr_verb("V4L2: Subscribe to event %u of %d", type, fd);
+
+	return v4l2_ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub) ? -1 : 0;
+}
+
+bool v4l2_subscribe_event(int const fd, uint32_t const type)
+{
+	if (v4l2_try_subscribe_event(fd, type) == 0)
+		return true;
+
+	if (errno != ENOTTY && errno != EINVAL)
+		error(EXIT_FAILURE, errno, "Can not subscribe to event %u", type);
+
+	pr_verb("V4L2: Device %d does not support event %u", fd, type);
+
+	return false;
+}
+
+int v4l2_try_dqevent(int const fd, struct v4l2_event *const event)
+{
+	if (v4l2_ioctl(fd, VIDIOC_DQEVENT, event))
+		return -1;
+
+	pr_debug("V4L2: Got event %u from %d, %u pending", event->type, fd,
+			event->pending);
+
+	return 0;
+}
+
+bool v4l2_dqevent(int const fd, struct v4l2_event *const event)
+{
+	if (v4l2_try_dqevent(fd, event) == 0)
+		return true;
+
+	if (errno != ENOENT)
+		error(EXIT_FAILURE, errno, "Can not dequeue event from %d", fd);
+
+	return false;
+}
+
+int v4l2_try_g_ext_ctrls(int const fd, uint32_t const which,
+		uint32_t const count, struct v4l2_ext_control *const controls)
 {
-	int rc;
 	struct v4l2_ext_controls ctrls = {
 		.ctrl_class = which,
 		.count = count,
 		.controls = controls
 	};
 
-	rc = ioctl(fd, VIDIOC_G_EXT_CTRLS, &ctrls);
-	if (rc != 0)
-		error(EXIT_FAILURE, errno, "Error getting controls");
+	return v4l2_ioctl(fd, VIDIOC_G_EXT_CTRLS, &ctrls) ? -1 : 0;
 }
 
-void v4l2_s_ext_ctrls(int const fd, uint32_t const which, uint32_t const count,
+void v4l2_g_ext_ctrls(int const fd, uint32_t const which, uint32_t const count,
 		      struct v4l2_ext_control *const controls)
 {
-	int rc;
+	if (v4l2_try_g_ext_ctrls(fd, which, count, controls))
+		error(EXIT_FAILURE, errno, "Error getting controls");
+}
+
+/* Index of failed control is returned in error_idx if it is not NULL */
+int v4l2_try_s_ext_ctrls(int const fd, uint32_t const which,
+		uint32_t const count, struct v4l2_ext_control *const controls,
+		uint32_t *const error_idx)
+{
 	struct v4l2_ext_controls ctrls = {
 		.ctrl_class = which,
 		.count = count,
 		.controls = controls
 	};
 
-	rc = ioctl(fd, VIDIOC_S_EXT_CTRLS, &ctrls);
-	if (rc != 0) {
-		if (ctrls.error_idx >= ctrls.count || count == 0)
+	if (v4l2_ioctl(fd, VIDIOC_S_EXT_CTRLS, &ctrls) == 0)
+		return 0;
+
+	if (error_idx)
+		*error_idx = ctrls.error_idx;
+
+	return -1;
+}
+
+void v4l2_s_ext_ctrls(int const fd, uint32_t const which, uint32_t const count,
+		      struct v4l2_ext_control *const controls)
+{
+	uint32_t error_idx;
+
+	if (v4l2_try_s_ext_ctrls(fd, which, count, controls, &error_idx)) {
+		if (error_idx >= count || count == 0)
 			error(EXIT_FAILURE, errno, "Error setting controls");
 		else
 			error(EXIT_FAILURE, errno, "Error setting control %u",
-			      controls[ctrls.error_idx].id);
+			      controls[error_idx].id);
 	}
 }
 
@@ -500,12 +801,12 @@ int query_ext_ctrl_ioctl(int const fd, struct v4l2_query_ext_ctrl *qctrl)
 	struct v4l2_queryctrl qc;
 	int rc;
 
-	rc = ioctl(fd, VIDIOC_QUERY_EXT_CTRL, qctrl);
+	rc = v4l2_ioctl(fd, VIDIOC_QUERY_EXT_CTRL, qctrl);
 	if (rc != ENOTTY)
 		return rc;
 
 	qc.id = qctrl->id;
-	rc = ioctl(fd, VIDIOC_QUERYCTRL, &qc);
+	rc = v4l2_ioctl(fd, VIDIOC_QUERYCTRL, &qc);
 	if (rc == 0) {
 		qctrl->type = qc.type;
 		memcpy(qctrl->name, qc.name, sizeof(qctrl->name));
@@ -10,6 +10,11 @@
 #ifndef V4L2_H
 #define V4L2_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
 #include <linux/videodev2.h>
 
 struct ctrl {
@@ -26,34 +31,81 @@ struct class_ctrls {
 	__u32 cnt;
 };
 
+/*
+ * Functions that fail exit the program with an error message. Those that
+ * have v4l2_try_* counterparts may be replaced with them, the counterparts
+ * return -1 and set errno instead, so a single stream can recover from a
+ * failure, e.g. retry on EAGAIN. Buffer mapping, export, frame rate and
+ * control option helpers have no counterparts and always exit. Helpers keep
+ * no per-device state and may be used for several devices from several
+ * threads; tracing and replaying are global.
+ */
+
 const char *v4l2_field_name(enum v4l2_field const field);
 const char *v4l2_type_name(enum v4l2_buf_type const type);
 const char *v4l2_memory_name(enum v4l2_memory const memory);
 
 void v4l2_print_format(struct v4l2_format const *const p);
 void v4l2_print_buffer(struct v4l2_buffer const *const p);
+int v4l2_ioctl(int const fd, unsigned long const request, void *const arg);
+void *v4l2_mmap(void *const addr, size_t const length, int const prot,
+		int const flags, int const fd, off_t const offset);
+int v4l2_munmap(int const fd, void *const addr, size_t const length);
+int v4l2_poll(struct pollfd fds[], nfds_t const nfds, int const timeout);
+void v4l2_set_busy_poll(bool const busy);
+int v4l2_try_open(char const *const device, uint32_t positive,
+		uint32_t negative, char card[32]);
 int v4l2_open(char const *const device, uint32_t positive, uint32_t negative,
 		char card[32]);
+int v4l2_try_setformat(int const fd, enum v4l2_buf_type const type,
+		struct v4l2_format *f);
 void v4l2_setformat(int const fd, enum v4l2_buf_type const type,
 		struct v4l2_format *f);
+int v4l2_try_pix_fmt_validate(struct v4l2_pix_format const *f,
+		uint32_t const pixelformat, uint32_t const width, uint32_t const height,
+		uint32_t const bytesperline);
 void v4l2_pix_fmt_validate(struct v4l2_pix_format const *f, uint32_t const pixelformat,
 		uint32_t const width, uint32_t const height, uint32_t const bytesperline);
+int v4l2_try_getformat(int const fd, enum v4l2_buf_type const type,
+		struct v4l2_format *f);
 void v4l2_getformat(int const fd, enum v4l2_buf_type const type,
 		struct v4l2_format *f);
 void v4l2_framerate_configure(int const fd, enum v4l2_buf_type const type,
 		struct v4l2_fract *const timeperframe);
 float v4l2_framerate_get(int const fd, enum v4l2_buf_type const type);
+/* Returns number of buffers given by device, it may differ from num */
+int v4l2_try_buffers_request(int const fd, enum v4l2_buf_type const type,
+		uint32_t const num, enum v4l2_memory const memory);
 uint32_t v4l2_buffers_request(int const fd, enum v4l2_buf_type const type,
 		uint32_t const num, enum v4l2_memory const memory);
 void v4l2_buffers_mmap(int const fd, enum v4l2_buf_type const type,
 		uint32_t const num, void *bufs[], int const prot);
 void v4l2_buffers_export(int const fd, enum v4l2_buf_type const type,
 		uint32_t const num, int bufs[]);
+int v4l2_try_dqbuf(int const fd, struct v4l2_buffer *const restrict buf);
 void v4l2_dqbuf(int const fd, struct v4l2_buffer *const restrict buf);
+int v4l2_try_qbuf(int const fd, struct v4l2_buffer *const restrict buf);
 void v4l2_qbuf(int const fd, struct v4l2_buffer *const restrict buf);
+int v4l2_try_streamon(int const fd, enum v4l2_buf_type const type);
 void v4l2_streamon(int const fd, enum v4l2_buf_type const type);
+int v4l2_try_streamoff(int const fd, enum v4l2_buf_type const type);
+void v4l2_streamoff(int const fd, enum v4l2_buf_type const type);
+
+/* Wrappers return false if device does not support command or event */
+int v4l2_try_encoder_stop(int const fd);
+bool v4l2_encoder_stop(int const fd);
+int v4l2_try_subscribe_event(int const fd, uint32_t const type);
+bool v4l2_subscribe_event(int const fd, uint32_t const type);
+int v4l2_try_dqevent(int const fd, struct v4l2_event *const event);
+bool v4l2_dqevent(int const fd, struct v4l2_event *const event);
+
+int v4l2_try_g_ext_ctrls(int const fd, uint32_t const which,
+		uint32_t const count, struct v4l2_ext_control *const controls);
 void v4l2_g_ext_ctrls(int const fd, uint32_t const which, uint32_t const count,
 		      struct v4l2_ext_control *const controls);
+int v4l2_try_s_ext_ctrls(int const fd, uint32_t const which,
+		uint32_t const count, struct v4l2_ext_control *const controls,
+		uint32_t *const error_idx);
 void v4l2_s_ext_ctrls(int const fd, uint32_t const which, uint32_t const count,
 		      struct v4l2_ext_control *const controls);
 int query_ext_ctrl_ioctl(int const fd, struct v4l2_query_ext_ctrl *qctrl);